@@ -0,0 +1,705 @@
+/*
+ * checkshmlog: checks of libshmlog, libshmlogclient and the parts of shmlogtail
+ * which can be run without a terminal, see `make check`.
+ *
+ *   checkshmlog [name]   run all checks, or the one of the name
+ *
+ * Every check runs in a child process, so it starts without a ring.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <threads.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <err.h>
+#include <error.h>
+#include <sys/wait.h>
+#include "libshmlog.h"
+#include "libshmlogclient.h"
+#include "shmlogmetrics.h"
+#include "shmlogarchive.h"
+
+#if 1
+#define LOG(fmt, arg...) fprintf(stderr, "<%s:%d> " fmt, __FILE__, __LINE__, ##arg)
+#else
+#define LOG(fmt, arg...)
+#endif
+
+#define CHECK(cond)                                 \
+    do {                                            \
+        if ( !(cond) ) {                            \
+            LOG("check failed: %s\n", #cond);       \
+            return -1;                              \
+        }                                           \
+    } while ( 0 )
+
+// the body of a message as a number, -1 if it isn't one
+static long msg_number(const struct shmlog_msg *msg)
+{
+    char buf[32];
+    char *end;
+    long n;
+    if ( NULL == msg || 0 == msg->hdr.len || msg->hdr.len >= sizeof(buf) ) {
+        return -1;
+    }
+    memcpy(buf, msg->body, msg->hdr.len);
+    buf[msg->hdr.len] = '\0';
+    n = strtol(buf, &end, 10);
+    return ('\0' == *end) ? n : -1;
+}
+
+/*
+ * checkpoint: a consumer which restarts after the producer has overwritten
+ * part of what it hadn't read counts every lost message, by the resume or
+ * while replaying, and reads the rest in order, once
+ */
+static int check_checkpoint()
+{
+    struct shm_log_client_t client;
+    struct shmlog_checkpoint_t ckpt;
+    struct shmlog_lease_t lease;
+    uint64_t gap, seq, lost;
+    long next;
+    int ret, i;
+    CHECK(shmlog_init(64, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    CHECK(shmlogclient_checkpoint_init(&client, &ckpt) == 0);
+    for ( i = 0; i < 10; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    ret = shmlogclient_lease_acquire(&client, &lease, 64, 0);
+    CHECK(10 == ret);
+    CHECK(shmlogclient_lease_seq(&client, &lease, &seq) == 0 && 0 == seq);
+    shmlogclient_checkpoint_update(&client, &ckpt, &lease);
+    shmlogclient_lease_release(&client, &lease);
+    CHECK(10 == ckpt.seq[SHMLOG_LANE_MAIN]);
+    // taken but not output when the consumer stops
+    for ( i = 10; i < 20; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(10 == shmlogclient_lease_acquire(&client, &lease, 64, 0));
+    shmlogclient_uninit(&client);
+    // 10 to be replayed, then 100 more written: 110 in all, the latest 64 are kept
+    for ( i = 20; i < 120; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    CHECK(shmlogclient_resume(&client, &ckpt, &gap) == 0);
+    lost = gap;
+    next = -1;
+    while ( (ret = shmlogclient_lease_resume(&client, &lease, 16)) > 0 ) {
+        lost += lease.lost;
+        for ( i = 0; i < ret; i++ ) {
+            if ( NULL != shmlogclient_lease_msg(&client, &lease, i) ) {
+                CHECK(next < 0 || msg_number(shmlogclient_lease_msg(&client, &lease, i)) == next);
+                next = msg_number(shmlogclient_lease_msg(&client, &lease, i)) + 1;
+            }
+        }
+        shmlogclient_checkpoint_update(&client, &ckpt, &lease);
+        shmlogclient_lease_release(&client, &lease);
+    }
+    CHECK(0 == ret && -1 == next); // all 10 have been overwritten
+    while ( (ret = shmlogclient_lease_acquire(&client, &lease, 16, 0)) > 0 ) {
+        lost += lease.lost;
+        CHECK(shmlogclient_lease_seq(&client, &lease, &seq) == 0);
+        for ( i = 0; i < ret; i++ ) {
+            CHECK(msg_number(shmlogclient_lease_msg(&client, &lease, i)) == (long)(seq + i));
+            CHECK(next < 0 || (long)(seq + i) == next);
+            next = seq + i + 1;
+        }
+        shmlogclient_checkpoint_update(&client, &ckpt, &lease);
+        shmlogclient_lease_release(&client, &lease);
+    }
+    CHECK(120 == next && 120 - 64 - 10 == lost);
+    CHECK(120 == ckpt.seq[SHMLOG_LANE_MAIN]);
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+/*
+ * recovery: a persistent ring reopened after its producer died in a write keeps
+ * the sequence continuous over the torn slot, whose generation may be odd (in
+ * the write) or even (torn by the crash)
+ */
+static int recover_torn(const char *path, int torn_even)
+{
+    struct shmlog_attr attr = { .nmsg = 64, .remove_unused = 1, .path = path };
+    struct shm_log_client_t client;
+    struct shmlog_msg *msg;
+    shmlog_int_headtail ht;
+    shmlog_int_head head, tail;
+    uint64_t seq, prev = 0;
+    uint32_t id;
+    pid_t pid;
+    unlink(path);
+    pid = fork();
+    if ( 0 == pid ) {
+        if ( shmlog_init_attr(&attr) < 0 ) {
+            _exit(1);
+        }
+        for ( int i = 0; i < 100; i++ ) {
+            shmlog_printf("%d", i);
+        }
+        msg = shmlog_reserve();
+        if ( torn_even ) {
+            atomic_fetch_sub(&msg->hdr.gen, 1);
+        }
+        _exit(0); // dies in the write
+    }
+    CHECK(pid > 0 && waitpid(pid, NULL, 0) == pid);
+    pid = fork();
+    if ( 0 == pid ) {
+        exit((shmlog_init_attr(&attr) < 0) ? 1 : 0); // recovers the ring
+    }
+    CHECK(pid > 0 && waitpid(pid, NULL, 0) == pid);
+    CHECK(shmlogclient_init_file(path, &client, 1) == 0);
+    ht = atomic_load(&client.hdr->headtail);
+    head = SHMLOG_GET_HEAD(ht);
+    tail = SHMLOG_GET_TAIL(ht);
+    CHECK(64 == tail - head);
+    for ( shmlog_int_head j = 0; j < tail - head; j++ ) {
+        id = (head + j) % 64;
+        seq = shmlog_seq(atomic_load(&client.msgs[id].hdr.gen), 64, id);
+        CHECK(0 == j || prev + 1 == seq);
+        prev = seq;
+    }
+    CHECK(100 == prev); // the torn one, filled by a note
+    shmlogclient_uninit(&client);
+    unlink(path);
+    return 0;
+}
+
+static int check_recover()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/checkshmlog-%d.ring", getpid());
+    CHECK(recover_torn(path, 0) == 0);
+    CHECK(recover_torn(path, 1) == 0);
+    return 0;
+}
+
+static atomic_int g_stall_reserved = 0;
+
+// reserve the slot of message 1 and commit it after the consumer's timeout
+static int stall_writer(void *arg)
+{
+    struct shmlog_msg *msg = shmlog_reserve();
+    if ( NULL == msg ) {
+        return -1;
+    }
+    atomic_store(&g_stall_reserved, 1);
+    usleep(SHMLOG_SLOT_TIMEOUT_US * 3 / 2);
+    shmlog_commit(msg, snprintf((char *)msg->body, SHMLOG_MSG_BODY_SIZE, "1"));
+    return 0;
+}
+
+// read all messages, the body of each one is its sequence number. return how many, or -1
+static int read_in_seq(struct shm_log_client_t *client, size_t *lost)
+{
+    struct shmlog_lease_t lease;
+    uint64_t seq;
+    int ret, n = 0;
+    while ( (ret = shmlogclient_lease_acquire(client, &lease, 8, 0)) > 0 ) {
+        *lost += lease.lost;
+        if ( shmlogclient_lease_seq(client, &lease, &seq) == 0 ) {
+            for ( int i = 0; i < ret; i++ ) {
+                CHECK(msg_number(shmlogclient_lease_msg(client, &lease, i)) == (long)(seq + i));
+            }
+        }
+        n += ret;
+        shmlogclient_lease_release(client, &lease);
+    }
+    return n;
+}
+
+/*
+ * stall: a live producer stopped between reserve and commit longer than the
+ * slot timeout is waited for. a late commit to a slot the consumer has
+ * abandoned is dropped, and the sequence of the slot goes on without a gap.
+ */
+static int check_stall()
+{
+    struct shm_log_client_t client;
+    struct shmlog_msg *msg;
+    thrd_t writer;
+    size_t lost = 0;
+    int ret, i;
+    CHECK(shmlog_init(8, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    shmlog_printf("0");
+    CHECK(thrd_create(&writer, stall_writer, NULL) == thrd_success);
+    while ( !atomic_load(&g_stall_reserved) ) {
+        usleep(1000);
+    }
+    for ( i = 2; i < 8; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(8 == read_in_seq(&client, &lost) && 0 == lost);
+    thrd_join(writer, &ret);
+    CHECK(0 == ret);
+    CHECK(0 == atomic_load(&client.hdr->abandoned_writes));
+    // a slot which no producer has marked is abandoned, as if its producer had gone
+    msg = shmlog_reserve();
+    CHECK(NULL != msg);
+    atomic_store(&msg->hdr.owner, 0);
+    CHECK(1 == read_in_seq(&client, &lost) && 1 == lost);
+    CHECK(1 == atomic_load(&client.hdr->abandoned_writes));
+    shmlog_commit(msg, snprintf((char *)msg->body, SHMLOG_MSG_BODY_SIZE, "late"));
+    // two laps over the slot
+    for ( i = 9; i < 9 + 16; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(8 == read_in_seq(&client, &lost) && 1 + 8 == lost);
+    CHECK(0 == atomic_load(&client.hdr->overrun_reads));
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+static long elapsed_ms(const struct timespec *from)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * lease: producers overwrite leased slots when the ring wraps, at once or
+ * after the hold time, and the consumer finds its lease invalidated. slots
+ * held by a consumer which has died are taken back at once.
+ */
+static int check_lease()
+{
+    struct shm_log_client_t client;
+    struct shmlog_lease_t lease;
+    struct timespec start;
+    size_t lost = 0;
+    void *buf;
+    int bufid, i;
+    pid_t pid;
+    CHECK(shmlog_init(8, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    // no hold: overwritten at once
+    for ( i = 0; i < 8; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(8 == shmlogclient_lease_acquire(&client, &lease, 8, 0));
+    for ( i = 8; i < 11; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(3 == atomic_load(&client.hdr->overrun_reads));
+    for ( i = 0; i < 8; i++ ) {
+        CHECK(shmlogclient_lease_valid(&client, &lease, i) == (i >= 3));
+    }
+    CHECK(3 == shmlogclient_lease_release(&client, &lease));
+    CHECK(3 == read_in_seq(&client, &lost) && 0 == lost);
+    bufid = shmlogclient_zerocopy_read(&client, &buf, NULL, &lost, 0);
+    CHECK(bufid < 0); // empty
+    shmlog_printf("11");
+    bufid = shmlogclient_zerocopy_read(&client, &buf, NULL, &lost, 0);
+    CHECK(bufid >= 0 && 0 == lost && 0 == memcmp(buf, "11", 2));
+    for ( i = 12; i < 20; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(SHMLOG_LEASE_INVALIDATED == shmlogclient_zerocopy_free(&client, bufid));
+    CHECK(4 == atomic_load(&client.hdr->overrun_reads));
+    CHECK(8 == read_in_seq(&client, &lost) && 0 == lost);
+    // held: the producer waits for the hold time, then overwrites
+    for ( i = 20; i < 28; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(shmlogclient_set_lease_hold(&client, 200*1000) == 0);
+    CHECK(8 == shmlogclient_lease_acquire(&client, &lease, 8, 0));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    shmlog_printf("28");
+    CHECK(elapsed_ms(&start) >= 200);
+    CHECK(5 == atomic_load(&client.hdr->overrun_reads));
+    CHECK(!shmlogclient_lease_valid(&client, &lease, 0) && shmlogclient_lease_valid(&client, &lease, 1));
+    CHECK(1 == shmlogclient_lease_release(&client, &lease));
+    CHECK(1 == read_in_seq(&client, &lost) && 0 == lost);
+    // a consumer dies with a lease, its slots are taken back without waiting for the hold time
+    CHECK(shmlogclient_set_lease_hold(&client, 60*1000*1000) == 0);
+    for ( i = 29; i < 37; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    pid = fork();
+    if ( 0 == pid ) {
+        struct shm_log_client_t other;
+        if ( shmlogclient_init(getppid(), &other, 1) < 0 || shmlogclient_lease_acquire(&other, &lease, 8, 0) != 8 ) {
+            _exit(1);
+        }
+        _exit(0); // without releasing it
+    }
+    CHECK(pid > 0 && waitpid(pid, &i, 0) == pid && WIFEXITED(i) && 0 == WEXITSTATUS(i));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 37; i < 45; i++ ) {
+        shmlog_printf("%d", i);
+    }
+    CHECK(elapsed_ms(&start) < 1000);
+    CHECK(8 == atomic_load(&client.hdr->abandoned_reads));
+    CHECK(5 == atomic_load(&client.hdr->overrun_reads));
+    CHECK(8 == read_in_seq(&client, &lost) && 0 == lost);
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+// run under libshmlogpreload.so by check_preload: its lines are written into the ring, not to stderr
+static int preload_writer()
+{
+    fprintf(stderr, "fprintf %d\n", 1);
+    fputs("fputs\n", stderr);
+    fwrite("fwrite\n", 1, 7, stderr);
+    write(STDERR_FILENO, "write\n", 6);
+    dprintf(STDERR_FILENO, "dprintf %d\n", 2);
+    errno = ENOENT;
+    perror("perror");
+    error(0, 0, "error %d", 3);
+    warnx("warnx");
+    psignal(SIGTERM, "psignal");
+    fputs_unlocked("fputs_unlocked\n", stderr);
+    putc_unlocked('x', stderr);
+    putc_unlocked('\n', stderr);
+    fprintf(stderr, "partial ");
+    fprintf(stderr, "line");
+    return (STDERR_FILENO == fileno(stderr)) ? 0 : 1;
+}
+
+/*
+ * preload: every way a binary writes stderr ends up in the ring, including
+ * the ones glibc makes without the hooked calls
+ */
+static int check_preload()
+{
+    static const char *expected[] = {
+        "fprintf 1", "fputs", "fwrite", "write", "dprintf 2", "perror: No such file or directory",
+        "checkshmlog: error 3", "checkshmlog: warnx", "psignal: Terminated", "fputs_unlocked", "x",
+        "partial line",
+    };
+    struct shm_log_client_t client;
+    char buf[SHMLOG_MSG_BODY_SIZE+1], exe[PATH_MAX], path[64], *slash;
+    size_t lost;
+    ssize_t n;
+    pid_t pid;
+    int ret, status;
+    n = readlink("/proc/self/exe", exe, sizeof(exe) - sizeof("libshmlogpreload.so"));
+    CHECK(n > 0 && NULL != (slash = memrchr(exe, '/', n)));
+    strcpy(slash + 1, "libshmlogpreload.so");
+    snprintf(path, sizeof(path), "/tmp/checkshmlog-%d.ring", getpid());
+    unlink(path);
+    pid = fork();
+    if ( 0 == pid ) {
+        setenv("LD_PRELOAD", exe, 1);
+        setenv("SHMLOG_PRELOAD_PATH", path, 1);
+        execl("/proc/self/exe", "checkshmlog", "--preload-writer", NULL);
+        _exit(127);
+    }
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    CHECK(shmlogclient_init_file(path, &client, 1) == 0);
+    for ( int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++ ) {
+        ret = shmlogclient_read(&client, buf, sizeof(buf) - 1, &lost, 0);
+        CHECK(ret >= 0 && 0 == lost);
+        buf[ret] = '\0';
+        if ( strcmp(buf, expected[i]) != 0 ) {
+            LOG("line %d: '%s', expected '%s'\n", i, buf, expected[i]);
+            return -1;
+        }
+    }
+    CHECK(shmlogclient_read(&client, buf, sizeof(buf), &lost, 0) < 0);
+    shmlogclient_uninit(&client);
+    unlink(path);
+    return 0;
+}
+
+#define RESIZE_NMSG 60000
+#define RESIZE_EVERY 2000
+static atomic_int g_resized = 0;
+
+static int resize_writer(void *arg)
+{
+    for ( int i = 0; i < RESIZE_NMSG; i++ ) {
+        shmlog_printf("%d", i);
+        if ( RESIZE_EVERY - 1 == i % RESIZE_EVERY && i + 1 < RESIZE_NMSG &&
+             shmlog_resize((i / RESIZE_EVERY % 3 + 1) * 256) == 0 ) {
+            atomic_fetch_add(&g_resized, 1);
+        }
+        if ( 0 == i % 100 ) {
+            usleep(100);
+        }
+    }
+    return 0;
+}
+
+/*
+ * resize while tailing: a blocking consumer follows every ring the producer
+ * moves to, and reads all messages in order
+ */
+static int check_resize()
+{
+    struct shm_log_client_t client;
+    struct shmlog_lease_t lease;
+    thrd_t writer;
+    long next = 0;
+    int ret;
+    CHECK(shmlog_init(512, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 0) == 0);
+    shmlogclient_set_lease_hold(&client, SHMLOG_SLOT_TIMEOUT_US);
+    CHECK(thrd_create(&writer, resize_writer, NULL) == thrd_success);
+    while ( next < RESIZE_NMSG ) {
+        ret = shmlogclient_lease_acquire(&client, &lease, 64, 1000*1000);
+        if ( ret < 0 ) {
+            LOG("read %ld messages, then %d:%s\n", next, errno, strerror(errno));
+            break;
+        }
+        CHECK(0 == lease.lost);
+        for ( int i = 0; i < ret; i++ ) {
+            CHECK(msg_number(shmlogclient_lease_msg(&client, &lease, i)) == next);
+            next++;
+        }
+        shmlogclient_lease_release(&client, &lease);
+    }
+    thrd_join(writer, NULL);
+    CHECK(RESIZE_NMSG == next);
+    CHECK(atomic_load(&g_resized) > RESIZE_NMSG / RESIZE_EVERY / 2);
+    CHECK(0 == atomic_load(&client.hdr->moved)); // on the latest ring
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+static atomic_int g_dedup_done = 0;
+
+static int dedup_writer(void *arg)
+{
+    for ( int i = 0; i < 5; i++ ) {
+        shmlog_printf("same");
+    }
+    // doesn't log any more, nor exit
+    while ( !atomic_load(&g_dedup_done) ) {
+        usleep(1000);
+    }
+    return 0;
+}
+
+/*
+ * dedup: the record of a run is written once the window has passed, by another
+ * thread if the one of the run doesn't log any more
+ */
+static int check_dedup()
+{
+    static const char *expected[] = { "same", "[shmlog] last message repeated 4 times", "other" };
+    struct shm_log_client_t client;
+    char buf[SHMLOG_MSG_BODY_SIZE+1];
+    size_t lost;
+    thrd_t writer;
+    int ret;
+    CHECK(shmlog_init(64, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    shmlog_set_dedup(50);
+    CHECK(thrd_create(&writer, dedup_writer, NULL) == thrd_success);
+    usleep(100*1000);
+    shmlog_printf("other");
+    for ( int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++ ) {
+        ret = shmlogclient_read(&client, buf, sizeof(buf) - 1, &lost, 0);
+        CHECK(ret >= 0 && 0 == lost);
+        buf[ret] = '\0';
+        CHECK(strncmp(buf, expected[i], strlen(expected[i])) == 0);
+    }
+    CHECK(shmlogclient_read(&client, buf, sizeof(buf), &lost, 0) < 0);
+    atomic_store(&g_dedup_done, 1);
+    thrd_join(writer, NULL);
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+static void feed_str(struct shmlog_metrics_t *metrics, const char *msg)
+{
+    shmlogmetrics_feed(metrics, msg, strlen(msg));
+}
+
+/*
+ * metrics: a field is the first "<field>=" with a number, as a whole word
+ */
+static int check_metrics()
+{
+    static const char rules[] =
+        "# comment\n"
+        "counter requests \"GET /\"\n"
+        "counter bytes - size\n"
+        "gauge lat - lat\n"
+        "histogram lat_hist - lat 5,10,100\n";
+    struct shmlog_metrics_t metrics;
+    char path[] = "/tmp/checkshmlog-XXXXXX";
+    int fd, ret;
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, rules, sizeof(rules) - 1) == sizeof(rules) - 1);
+    close(fd);
+    ret = shmlogmetrics_load(&metrics, path);
+    unlink(path);
+    CHECK(0 == ret && 4 == metrics.nmetric);
+    feed_str(&metrics, "GET / size=100 lat=? x mylat=3 lat=12");
+    feed_str(&metrics, "GET /a size=-1.5e2 lat=7");
+    feed_str(&metrics, "POST / lat=3");
+    feed_str(&metrics, "lat= lat=x");
+    CHECK(4 == metrics.nmsg);
+    CHECK(2 == metrics.metrics[0].count && 2 == metrics.metrics[0].value);
+    CHECK(2 == metrics.metrics[1].count && -50 == metrics.metrics[1].value);
+    CHECK(3 == metrics.metrics[2].count && 3 == metrics.metrics[2].value);
+    CHECK(3 == metrics.metrics[3].count && 22 == metrics.metrics[3].value);
+    CHECK(1 == metrics.metrics[3].buckets[0] && 1 == metrics.metrics[3].buckets[1] && 1 == metrics.metrics[3].buckets[2]);
+    shmlogmetrics_free(&metrics);
+    return 0;
+}
+
+// output of a query, and the number of lines
+static char *archive_query(struct shmlog_archive_query_t *query, int jobs, int *nline)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    query->jobs = jobs;
+    query->out = open_memstream(&buf, &len);
+    if ( NULL == query->out ) {
+        return NULL;
+    }
+    if ( shmlogarchive_query(query) < 0 ) {
+        fclose(query->out);
+        free(buf);
+        return NULL;
+    }
+    fclose(query->out);
+    *nline = 0;
+    for ( size_t i = 0; i < len; i++ ) {
+        *nline += ('\n' == buf[i]);
+    }
+    return buf;
+}
+
+static int archive_check(const char *dir)
+{
+    struct shmlog_archive_query_t query = { .dir = dir, .pid = 1234, .from = 0, .to = UINT64_MAX };
+    struct shmlog_archive_t arc;
+    char msg[32], *out1, *out4, *line;
+    int len, nline, nseg = 0, i;
+    struct dirent *dent;
+    DIR *d;
+    CHECK(shmlogarchive_open(&arc, dir, 1234, 4096) == 0);
+    for ( i = 0; i < 2000; i++ ) {
+        len = snprintf(msg, sizeof(msg), "msg %d", i);
+        CHECK(shmlogarchive_write(&arc, i, msg, len) == len);
+    }
+    CHECK(shmlogarchive_flush(&arc) == 0);
+    shmlogarchive_close(&arc);
+    d = opendir(dir);
+    CHECK(NULL != d);
+    while ( (dent = readdir(d)) != NULL ) {
+        nseg += (NULL != strstr(dent->d_name, ".seg"));
+    }
+    closedir(d);
+    CHECK(nseg > 4); // rotated
+    // in order, searched by one thread or in parallel
+    out1 = archive_query(&query, 1, &nline);
+    CHECK(NULL != out1 && 2000 == nline);
+    line = out1;
+    for ( i = 0; i < 2000; i++ ) {
+        len = snprintf(msg, sizeof(msg), " msg %d\n", i);
+        line = strchr(line, '\n');
+        CHECK(NULL != line && line + 1 - len >= out1 && memcmp(line + 1 - len, msg, len) == 0);
+        line++;
+    }
+    out4 = archive_query(&query, 4, &nline);
+    CHECK(NULL != out4 && strcmp(out1, out4) == 0);
+    free(out1);
+    free(out4);
+    // nothing out of the range, nor of another process
+    CHECK(shmlogarchive_parse_time("@4000000000", &query.from) == 0);
+    out1 = archive_query(&query, 4, &nline);
+    CHECK(NULL != out1 && 0 == nline);
+    free(out1);
+    query.from = 0;
+    query.pid = 4321;
+    out1 = archive_query(&query, 1, &nline);
+    CHECK(NULL != out1 && 0 == nline);
+    free(out1);
+    return 0;
+}
+
+/*
+ * archive: records are found in order across rotated segments, by any number
+ * of parallel jobs, and only in the range
+ */
+static int check_archive()
+{
+    char dir[] = "/tmp/checkshmlog-XXXXXX", path[512];
+    struct dirent *dent;
+    DIR *d;
+    int ret;
+    CHECK(NULL != mkdtemp(dir));
+    ret = archive_check(dir);
+    d = opendir(dir);
+    while ( NULL != d && (dent = readdir(d)) != NULL ) {
+        if ( '.' != dent->d_name[0] ) {
+            snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name);
+            unlink(path);
+        }
+    }
+    if ( NULL != d ) {
+        closedir(d);
+    }
+    rmdir(dir);
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)();
+} g_checks[] = {
+    { "checkpoint", check_checkpoint },
+    { "recover", check_recover },
+    { "stall", check_stall },
+    { "lease", check_lease },
+    { "preload", check_preload },
+    { "resize", check_resize },
+    { "dedup", check_dedup },
+    { "metrics", check_metrics },
+    { "archive", check_archive },
+};
+
+int main(int argc, char *argv[])
+{
+    const int nchecks = sizeof(g_checks) / sizeof(g_checks[0]);
+    int failed = 0, status, run = 0;
+    pid_t pid;
+    if ( argc > 1 && strcmp(argv[1], "--preload-writer") == 0 ) {
+        return preload_writer();
+    }
+    for ( int i = 0; i < nchecks; i++ ) {
+        if ( argc > 1 && strcmp(argv[1], g_checks[i].name) != 0 ) {
+            continue;
+        }
+        run++;
+        fprintf(stderr, "checkshmlog: %s ...\n", g_checks[i].name);
+        pid = fork();
+        if ( 0 == pid ) {
+            exit((g_checks[i].fn() < 0) ? 1 : 0);
+        }
+        if ( pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || 0 != WEXITSTATUS(status) ) {
+            fprintf(stderr, "checkshmlog: %s FAILED\n", g_checks[i].name);
+            failed++;
+        }
+    }
+    if ( 0 == run ) {
+        fprintf(stderr, "checkshmlog: Error: no check named '%s'\n", argv[1]);
+        return 1;
+    }
+    fprintf(stderr, "checkshmlog: %d of %d passed\n", run - failed, run);
+    return (failed > 0) ? 1 : 0;
+}
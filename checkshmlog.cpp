@@ -0,0 +1,89 @@
+/*
+ * checkshmlog.cpp: builds shmlog.hpp as the standard it's compiled with, C++17
+ * or C++20, and checks the formatting and the messages it writes, see `make check`.
+ */
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+#include "shmlog.hpp"
+#include "libshmlogclient.h"
+
+#if 1
+#define LOG(fmt, arg...) fprintf(stderr, "<%s:%d> " fmt, __FILE__, __LINE__, ##arg)
+#else
+#define LOG(fmt, arg...)
+#endif
+
+#define CHECK(cond)                                 \
+    do {                                            \
+        if ( !(cond) ) {                            \
+            LOG("check failed: %s\n", #cond);       \
+            return -1;                              \
+        }                                           \
+    } while ( 0 )
+
+enum class color { red = 1, green = 2 };
+
+static int check_format()
+{
+    char buf[64];
+    const std::string s = "str";
+    const char *cs = "cstr";
+    size_t len;
+
+    len = shmlog::detail::format_to(buf, buf + sizeof(buf), "x={} y={} {{}} {} {} {}", 42, s, cs, true, color::green);
+    CHECK(std::string_view(buf, len) == "x=42 y=str {} cstr true 2");
+    len = shmlog::detail::format_to(buf, buf + sizeof(buf), "{}{}", 'c', -7L);
+    CHECK(std::string_view(buf, len) == "c-7");
+    // truncated at the end of the buffer
+    len = shmlog::detail::format_to(buf, buf + 4, "abc{}", 12345);
+    CHECK(4 == len && std::string_view(buf, len) == "abc1");
+    static_assert(shmlog::detail::count_placeholders("{} {{}} {}") == 2);
+    static_assert(shmlog::detail::count_placeholders("{") < 0);
+    static_assert(shmlog::detail::count_placeholders("}") < 0);
+    return 0;
+}
+
+static int check_write()
+{
+    std::vector<std::string> expected = { "macro 1 two", "log 3" };
+    struct shm_log_client_t client;
+    char buf[SHMLOG_MSG_BODY_SIZE+1];
+    size_t lost;
+    int ret;
+
+    CHECK(shmlog_init(64, 1) == 0);
+    CHECK(shmlogclient_init(getpid(), &client, 1) == 0);
+    SHMLOG_INFO("macro {} {}", 1, "two");
+    CHECK(shmlog::log<shmlog::level::warn>("log {}", 3) == 5);
+#ifdef SHMLOG_HAS_FORMAT_STRING
+    CHECK(shmlog::info("checked {}", 4.5) > 0);
+    expected.push_back("checked 4.5");
+#endif
+    {
+        shmlog::span span("span");
+    }
+    for ( const std::string &e : expected ) {
+        ret = shmlogclient_read(&client, buf, sizeof(buf) - 1, &lost, 0);
+        CHECK(ret >= 0 && 0 == lost);
+        CHECK(std::string_view(buf, ret) == e);
+    }
+    CHECK(shmlogclient_read(&client, buf, sizeof(buf) - 1, &lost, 0) > 0); // the span
+    CHECK(shmlogclient_read(&client, buf, sizeof(buf) - 1, &lost, 0) < 0);
+    shmlogclient_uninit(&client);
+    shmlog_uninit();
+    return 0;
+}
+
+int main()
+{
+    if ( check_format() < 0 || check_write() < 0 ) {
+        printf("C++%ld: FAIL\n", __cplusplus / 100 % 100);
+        return 1;
+    }
+    printf("C++%ld: ok\n", __cplusplus / 100 % 100);
+    return 0;
+}
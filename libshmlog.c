@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <string.h>
 #include <threads.h>
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -10,18 +11,104 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
 #include "libshmlog.h"
+#include "shmlogregistry.h"
 
 #define SHM_FILE_PATH "/dev/shm"
 #define FULL_RETRY_MAX 16
+#define SLOT_SPIN_MAX 64     // yield some times before checking the owner of a busy slot
+#define SLOT_SLEEP_US 1000
+#define SITE_SUMMARY_INTERVAL_NS 1000000000ULL
+#define HASH_MUL 0xff51afd7ed558ccdULL
+#define RING_REFS 8          // mappings of the current ring and the ones replaced by shmlog_resize, see ring_ref
+
+#define FORK_NONE    0 // the ring is ours
+#define FORK_PENDING 1 // forked, the ring is the parent's one, create our own at the first write
+#define FORK_INIT    2 // creating our own ring
 
 static int g_regAtexit = 0;
 static int g_fd = -1;
 static void *g_addr = MAP_FAILED;
 static size_t g_size = 0;
-static struct shmlog_header *g_hdr = NULL;
+static struct shmlog_header *_Atomic g_hdr = NULL; // replaced by shmlog_resize while other threads write
 static struct shmlog_msg *g_msgs = NULL;
 static size_t g_remove_unused = 0;
+static pid_t g_pid = 0;              // pid of this process, the owner of slots being written
+static pid_t g_ring_pid = 0;         // pid of the process which created the ring
+static struct shmlog_registry *g_reg = NULL;
+static int g_reg_idx = -1;
+static thread_local unsigned t_writes = 0;
+static thread_local pid_t t_tid = 0;
+static struct shmlog_attr g_attr;     // attributes of the ring, for the rings of forked processes
+static pid_t g_ppid = 0;              // pid of the process which the ring is forked from
+static int g_fork_policy = SHMLOG_FORK_INHERIT;
+static atomic_int g_fork_state = 0;  // FORK_*: whether the ring is inherited from the parent
+static int g_regAtfork = 0;
+static _Atomic(struct shmlog_site *) g_sites = NULL; // sites which have suppressed messages
+static int g_persistent = 0;         // the ring is a file, see shmlog_attr.path
+static char g_path[PATH_MAX];
+static atomic_int g_notify_fd = -1;  // socket to wake up the consumer, created at the first notification
+static atomic_flag g_resizing = ATOMIC_FLAG_INIT; // shmlog_resize, or unmapping replaced rings
+static thread_local int t_heartbeat = 0; // due at the last reserve, done after the commit
+
+// odd generations of the slots reserved by the thread and not committed yet. a commit finishes
+// the generation by a CAS from it, so a late one after the slot was abandoned is dropped
+#define RESERVED_MAX 4
+struct reserved_slot {
+    struct shmlog_msg *msg;
+    unsigned gen;
+};
+static thread_local struct reserved_slot t_reserved[RESERVED_MAX];
+static thread_local unsigned t_reserved_next = 0;
+
+/*
+ * a mapping of the ring. a writer counts itself in before it loads the header
+ * and out after its commit, so a ring replaced by shmlog_resize is unmapped only
+ * after its last writer has left. refs are static and reused once unmapped, a
+ * writer which has loaded a stale one finds it isn't the current ring any more.
+ */
+// counters of a ring when they were carried over to the one which has replaced it
+struct ring_counters {
+    uint64_t nwrite, nbytes, noverwrite, nread;
+    unsigned suppressed, repeated, abandoned_writes, abandoned_reads, overrun_reads;
+};
+struct ring_ref {
+    _Alignas(64) atomic_uint writers;
+    _Atomic(struct shmlog_header *) hdr; // NULL: unused
+    atomic_size_t size;
+    unsigned alias;      // SHMLOG_RESIZED_NAME of a resized ring, 0: none
+    struct ring_counters carried;
+};
+static struct ring_ref g_refs[RING_REFS];
+static _Atomic(struct ring_ref *) g_ring = NULL; // the current one, see enter_ring
+static atomic_int g_nretired = 0;                // replaced rings still mapped
+static unsigned g_nresize = 0;                   // names the rings created by shmlog_resize
+
+// the previous message of a thread and how many times it has been repeated since
+struct dedup_state {
+    atomic_flag busy;     // held by the thread, or by another one which writes its expired record
+    uint64_t hash;
+    uint32_t len;
+    int level;            // -1: unleveled
+    pid_t ring_pid;       // the ring it has been written into
+    unsigned repeats;
+    struct timespec first, last;
+    struct dedup_state *prev, *next; // in g_dedup_runs while repeats > 0
+    int linked;
+    char body[SHMLOG_MSG_BODY_SIZE];
+};
+static thread_local struct dedup_state t_dedup;
+static pthread_once_t g_dedup_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_dedup_key; // flushes the pending record at thread exit
+static pthread_mutex_t g_dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedup_state *g_dedup_runs = NULL; // threads with a pending record, under g_dedup_lock
+static atomic_int g_dedup_pending = 0;
+#define DEDUP_FLUSH_MAX 16 // expired records written by one call of another thread
 
 #if 1
 #define LOG(fmt, arg...) fprintf(stderr, fmt, ##arg)
@@ -34,25 +121,112 @@ static size_t g_remove_unused = 0;
 #define MAKE_HT(head, tail) SHMLOG_MAKE_HT(head, tail)
 #define INTHEAD_MAX SHMLOG_INTHEAD_MAX
 
+static void flush_repeated(void *arg);
+
+// persistent rings: everything has been written, the next init needs no recovery
+static void mark_clean()
+{
+    if ( NULL != g_hdr ) {
+        atomic_store(&g_hdr->clean, 1);
+        msync(g_addr, g_size, MS_SYNC);
+    }
+}
+
+// the names of resized rings, which consumers of the replaced ones follow
+static void unlink_aliases()
+{
+    char filename[256];
+    for ( int i = 0; i < RING_REFS; i++ ) {
+        if ( g_refs[i].alias > 0 && NULL != atomic_load(&g_refs[i].hdr) ) {
+            snprintf(filename, sizeof(filename), SHMLOG_RESIZED_NAME, g_ring_pid, g_refs[i].alias);
+            shm_unlink(filename);
+        }
+    }
+}
 
 static void onexit()
 {
+    // a forked child which shares the ring or hasn't created its own leaves it to the parent
+    const int owner = (g_ring_pid == getpid());
+    if ( g_fd > 0 && FORK_NONE == atomic_load(&g_fork_state) ) {
+        flush_repeated(&t_dedup); // thread-specific destructors don't run at exit
+    }
+    if ( owner && g_reg_idx >= 0 ) {
+        shmlogregistry_remove(g_reg, g_reg_idx, g_ring_pid);
+        g_reg_idx = -1;
+    }
     if ( g_fd > 0 ) {
         char filename[256];
-        snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
-        shm_unlink(filename);
+        if ( owner && g_persistent ) {
+            mark_clean();
+        } else if ( owner ) {
+            snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", g_ring_pid);
+            shm_unlink(filename);
+            unlink_aliases();
+        }
+        close(g_fd);
+        g_fd = -1;
+    }
+}
+
+static void onfork_child()
+{
+    t_tid = 0;
+    t_dedup.repeats = 0; // counted by the parent
+    t_dedup.linked = 0;
+    atomic_flag_clear(&t_dedup.busy);
+    pthread_mutex_init(&g_dedup_lock, NULL); // may have been held by another thread of the parent
+    g_dedup_runs = NULL;
+    atomic_store(&g_dedup_pending, 0);
+    g_pid = getpid();
+    if ( g_fd > 0 && SHMLOG_FORK_SHARE != g_fork_policy ) {
+        atomic_store(&g_fork_state, FORK_PENDING);
+    }
+}
+
+// forget all rings and unmap the replaced ones, the current one (g_addr) is left to the caller
+static void unmap_retired()
+{
+    struct shmlog_header *hdr;
+    atomic_store(&g_ring, NULL);
+    for ( int i = 0; i < RING_REFS; i++ ) {
+        hdr = atomic_load(&g_refs[i].hdr);
+        if ( NULL != hdr && (void*)hdr != g_addr ) {
+            munmap((void*)hdr, atomic_load(&g_refs[i].size));
+        }
+        atomic_store(&g_refs[i].hdr, NULL);
+        atomic_store(&g_refs[i].writers, 0);
+        g_refs[i].alias = 0;
+    }
+    atomic_store(&g_nretired, 0);
+}
+
+// unmap the ring inherited from the parent, without touching it
+static void drop_parent_ring()
+{
+    unmap_retired();
+    if ( MAP_FAILED != g_addr ) {
+        munmap(g_addr, g_size);
+        g_addr = MAP_FAILED;
+    }
+    if ( g_fd > 0 ) {
         close(g_fd);
         g_fd = -1;
     }
+    g_size = 0;
+    g_hdr = NULL;
+    g_msgs = NULL;
+    g_reg_idx = -1;
 }
 
-static int unlink_all_unuse()
+// remove the rings of dead processes in /dev/shm, or only the ones created by shmlog_resize
+static int unlink_all_unuse(int resized_only)
 {
     char filename[256];
     struct stat statbuf;
     DIR *dir;
     struct dirent *dent;
-    int errbak, pid;
+    int errbak, pid, n;
     dir = opendir(SHM_FILE_PATH);
     if ( NULL == dir ) {
         return -1;
@@ -63,16 +237,18 @@ static int unlink_all_unuse()
         //    dent->d_name, dent->d_ino, dent->d_off, dent->d_reclen, dent->d_type);
         if ( DT_REG == dent->d_type ) {
             //LOG("find shm: %s, type=0x%x\n", dent->d_name, dent->d_type);
-            if ( sscanf(dent->d_name, SHMLOG_FILE_PREFIX "%d", &pid) == 1 && pid > 0 ) {
+            n = 0;
+            if ( sscanf(dent->d_name, SHMLOG_FILE_PREFIX "%d%n", &pid, &n) == 1 && pid > 0 &&
+                 (!resized_only || '.' == dent->d_name[n]) ) {
                 snprintf(filename, sizeof(filename), "/proc/%d", pid);
                 //LOG("found shm with pid %d\n", pid);
                 if ( stat(filename, &statbuf) == -1 && ENOENT == errno ) {
                     LOG("found shm with pid %d, but process is not exist!\n", pid);
-                    snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", pid);
-                    if ( shm_unlink(filename) >= 0 ) {
-                        LOG("file '%s' has been deleted.\n", filename);
+                    // the ring, or one created by shmlog_resize
+                    if ( shm_unlink(dent->d_name) >= 0 ) {
+                        LOG("file '%s' has been deleted.\n", dent->d_name);
                     } else {
-                        LOG("delete file '%s' failed.\n", filename);
+                        LOG("delete file '%s' failed.\n", dent->d_name);
                     }
                 }
             }
@@ -87,13 +263,161 @@ static int unlink_all_unuse()
     return 0;
 }
 
-int shmlog_init(size_t nmsg, int remove_unused)
+// a note in place of a message torn by a crash, so consumers don't wait for it
+static void fill_lost(struct shmlog_msg *msg, unsigned gen)
+{
+    static const char note[] = "[shmlog] message lost in crash";
+    memcpy(msg->body, note, sizeof(note) - 1);
+    msg->hdr.len = sizeof(note) - 1;
+    msg->hdr.type = SHMLOG_MSG_TEXT;
+    atomic_store(&msg->hdr.gen, gen);
+    atomic_store(&msg->hdr.filled, true);
+}
+
+static inline int slot_intact(struct shmlog_msg *msg)
+{
+    const unsigned gen = atomic_load(&msg->hdr.gen);
+    return atomic_load(&msg->hdr.filled) && !(gen & 1) && gen >= 2 && msg->hdr.len <= SHMLOG_MSG_BODY_SIZE;
+}
+
+// check the slots of a lane of a persistent ring after a restart, return the number of messages kept
+static unsigned recover_lane(shmlog_atomic_headtail *headtail, uint32_t nmsg, struct shmlog_msg *msgs, unsigned *lost)
+{
+    shmlog_int_headtail ht = atomic_load(headtail);
+    shmlog_int_head head = GET_HEAD(ht), tail = GET_TAIL(ht);
+    struct shmlog_msg *msg;
+    unsigned kept = 0, gen;
+    uint64_t first = 0; // sequence number of the head, told by an intact message
+    int anchored = 0;
+    uint32_t id;
+    if ( head > tail || tail - head > nmsg ) { // the header page didn't make it to disk
+        head = tail = 0;
+        atomic_store(headtail, 0);
+    }
+    for ( uint32_t j = 0; j < nmsg; j++ ) {
+        id = (head + j) % nmsg;
+        msg = &msgs[id];
+        gen = atomic_load(&msg->hdr.gen);
+        atomic_store(&msg->hdr.owner, 0);
+        if ( j >= (uint32_t)(tail - head) ) { // out of the ring, a torn write is finished as a commit would
+            atomic_store(&msg->hdr.filled, false);
+            atomic_store(&msg->hdr.gen, (gen + 1) & ~1U);
+        } else if ( slot_intact(msg) ) {
+            kept++;
+            if ( !anchored && shmlog_seq(gen, nmsg, id) >= j ) {
+                first = shmlog_seq(gen, nmsg, id) - j;
+                anchored = 1;
+            }
+        }
+    }
+    // messages in the ring are consecutive, a torn one gets the generation of its sequence,
+    // so sequences go on across the recovery
+    for ( uint32_t j = 0; j < (uint32_t)(tail - head); j++ ) {
+        id = (head + j) % nmsg;
+        msg = &msgs[id];
+        if ( slot_intact(msg) ) {
+            continue;
+        }
+        gen = atomic_load(&msg->hdr.gen);
+        if ( anchored ) {
+            gen = shmlog_seq_gen(first + j, nmsg);
+        } else {
+            gen = (gen < 2) ? 2 : (gen + 1) & ~1U; // the first write of the slot, or one step of commit
+        }
+        fill_lost(msg, gen);
+        (*lost)++;
+    }
+    return kept;
+}
+
+static void recover_ring()
+{
+    unsigned kept, lost = 0;
+    kept = recover_lane(&g_hdr->headtail, g_hdr->nmsg, g_msgs, &lost);
+    kept += recover_lane(&g_hdr->prio_headtail, g_hdr->prio_nmsg, g_msgs + g_hdr->nmsg, &lost);
+    if ( !atomic_load(&g_hdr->clean) ) {
+        LOG("[dengjfzh/libshmlog] Warning: '%s' was not shut down cleanly, %u messages recovered, %u lost! %s:%d\n",
+            g_path, kept, lost, __FILE__, __LINE__);
+    }
+    // runtime settings of the previous run
+    atomic_store(&g_hdr->consumer_pid, 0);
+    atomic_store(&g_hdr->notify_armed, 0);
+    atomic_store(&g_hdr->lease_hold_us, 0);
+    atomic_store(&g_hdr->site_rate, 0);
+    atomic_store(&g_hdr->site_burst, 0);
+    atomic_store(&g_hdr->site_sample, 0);
+    atomic_store(&g_hdr->dedup_ms, 0);
+    atomic_store(&g_hdr->prio_level, g_attr.prio_level);
+}
+
+// remove rings of dead processes by the registry, or by scanning /dev/shm if there is no registry.
+// the registry doesn't know the rings created by shmlog_resize
+static void remove_dead_rings()
 {
-    int errno_bak;
+    if ( NULL != g_reg ) {
+        shmlogregistry_remove_dead(g_reg);
+        unlink_all_unuse(1);
+    } else {
+        unlink_all_unuse(0);
+    }
+}
+
+static inline struct shmlog_msg *ring_msgs(struct shmlog_header *hdr)
+{
+    return (struct shmlog_msg *)((uint8_t*)hdr + sizeof(struct shmlog_fullheader));
+}
+
+static void init_header(struct shmlog_header *hdr, uint32_t nmsg, uint32_t prio_nmsg, int prio_level)
+{
+    struct shmlog_msg *msgs = ring_msgs(hdr);
+    struct timespec ts;
+    hdr->nmsg = nmsg;
+    hdr->prio_nmsg = prio_nmsg;
+    atomic_init(&hdr->prio_level, prio_level);
+    atomic_init(&hdr->prio_headtail, 0);
+    atomic_init(&hdr->dedup_ms, 0);
+    atomic_init(&hdr->repeated, 0);
+    atomic_init(&hdr->nwrite, 0);
+    atomic_init(&hdr->nbytes, 0);
+    atomic_init(&hdr->noverwrite, 0);
+    atomic_init(&hdr->nread, 0);
+    atomic_init(&hdr->notify_armed, 0);
+    atomic_init(&hdr->consumer_pid, 0);
+    atomic_init(&hdr->headtail, 0);
+    atomic_init(&hdr->abandoned_writes, 0);
+    atomic_init(&hdr->abandoned_reads, 0);
+    atomic_init(&hdr->lease_hold_us, 0);
+    atomic_init(&hdr->overrun_reads, 0);
+    atomic_init(&hdr->site_rate, 0);
+    atomic_init(&hdr->site_burst, 0);
+    atomic_init(&hdr->site_sample, 0);
+    atomic_init(&hdr->suppressed, 0);
+    atomic_init(&hdr->resize_nmsg, 0);
+    atomic_init(&hdr->moved, 0);
+    atomic_init(&hdr->next_ring, 0);
+    atomic_init(&hdr->sealed, 0);
+    for ( size_t i = 0; i < nmsg + prio_nmsg; i++ ) {
+        atomic_init(&msgs[i].hdr.filled, false);
+        atomic_init(&msgs[i].hdr.owner, 0);
+        atomic_init(&msgs[i].hdr.gen, 0);
+    }
+    hdr->magic = SHMLOG_RING_MAGIC;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr->ring_id = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)g_pid << 48);
+}
+
+static int init_ring(const struct shmlog_attr *attr, pid_t ppid)
+{
+    int errno_bak, recover = 0;
     char filename[256];
-    const size_t size = sizeof(struct shmlog_fullheader) + SHMLOG_MSG_SIZE * nmsg;
-    if ( remove_unused ) {
-        unlink_all_unuse();
+    struct stat statbuf;
+    const size_t nmsg = attr->nmsg, prio_nmsg = attr->prio_nmsg;
+    const size_t size = sizeof(struct shmlog_fullheader) + SHMLOG_MSG_SIZE * (nmsg + prio_nmsg);
+    if ( NULL == g_reg ) {
+        g_reg = shmlogregistry_open(1);
+    }
+    if ( attr->remove_unused ) {
+        remove_dead_rings();
     }
     if ( g_fd > 0 ) {
         return -1;
@@ -101,35 +425,81 @@ int shmlog_init(size_t nmsg, int remove_unused)
     // clear global variables
     g_hdr = NULL;
     g_msgs = NULL;
-    g_remove_unused = remove_unused;
-    // open shm
-    snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
-    g_fd = shm_open(filename, O_CREAT|O_RDWR, 0666);
-    if ( g_fd < 0 ) {
-        goto FAILED;
+    g_remove_unused = attr->remove_unused;
+    g_attr = *attr;
+    g_pid = getpid();
+    g_ring_pid = g_pid;
+    g_ppid = ppid;
+    g_persistent = (NULL != attr->path);
+    g_attr.path = NULL;
+    if ( g_persistent ) {
+        // open the file, keep its messages if it's a ring of the same size
+        snprintf(g_path, sizeof(g_path), "%s", attr->path);
+        filename[0] = '\0'; // not in /dev/shm
+        g_fd = open(g_path, O_CREAT|O_RDWR|O_CLOEXEC, 0644);
+        if ( g_fd < 0 || fstat(g_fd, &statbuf) < 0 ) {
+            goto FAILED;
+        }
+        recover = (statbuf.st_size == size);
+    } else {
+        // open shm
+        snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
+        g_fd = shm_open(filename, O_CREAT|O_RDWR, 0666);
+        if ( g_fd < 0 ) {
+            goto FAILED;
+        }
     }
-    if ( ftruncate(g_fd, size) < 0 ) {
+    if ( !recover && ftruncate(g_fd, size) < 0 ) {
         goto FAILED;
     }
-    g_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, g_fd, 0);
+    g_addr = MAP_FAILED;
+#ifdef MAP_SYNC
+    if ( g_persistent ) { // DAX: stores reach persistent memory without msync
+        g_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, g_fd, 0);
+    }
+#endif
+    if ( MAP_FAILED == g_addr ) {
+        g_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, g_fd, 0);
+    }
     if ( MAP_FAILED == g_addr ) {
         goto FAILED;
     }
     // setup global variables
     g_size = size;
     g_hdr = (struct shmlog_header *)g_addr;
-    g_hdr->nmsg = nmsg;
-    atomic_init(&g_hdr->consumer_pid, 0);
-    atomic_init(&g_hdr->headtail, 0);
-    g_msgs = (struct shmlog_msg *)(g_addr + sizeof(struct shmlog_fullheader));
-    for ( size_t i = 0; i < nmsg; i++ ) {
-        atomic_init(&g_msgs[i].hdr.filled, false);
+    g_msgs = ring_msgs(g_hdr);
+    if ( recover && SHMLOG_RING_MAGIC == g_hdr->magic && nmsg == g_hdr->nmsg && prio_nmsg == g_hdr->prio_nmsg ) {
+        recover_ring();
+        goto READY;
+    }
+    if ( recover ) {
+        LOG("[dengjfzh/libshmlog] Warning: '%s' is not a ring of this size, reinitialize it! %s:%d\n",
+            g_path, __FILE__, __LINE__);
+        memset(g_addr, 0, size);
+    }
+    init_header(g_hdr, nmsg, prio_nmsg, attr->prio_level);
+READY:
+    g_hdr->pid = g_pid;
+    atomic_store(&g_hdr->clean, 0);
+    if ( g_persistent ) {
+        msync(g_addr, SHMLOG_MSG_SIZE, MS_SYNC); // the header says it's being written before any message
+    }
+    atomic_store(&g_refs[0].size, size);
+    atomic_store(&g_refs[0].hdr, g_hdr);
+    atomic_store(&g_ring, &g_refs[0]);
+    // register the ring, so it can be found without scanning /dev/shm
+    if ( NULL != g_reg ) {
+        g_reg_idx = shmlogregistry_add(g_reg, g_pid, g_ppid, filename, nmsg, size);
     }
     // register an exit function to unlink shm
     if ( 0 == g_regAtexit ) {
         g_regAtexit = 1;
         atexit(onexit);
     }
+    if ( 0 == g_regAtfork ) {
+        g_regAtfork = 1;
+        pthread_atfork(NULL, NULL, onfork_child);
+    }
     return 0;
 FAILED:
     errno_bak = errno;
@@ -141,21 +511,116 @@ FAILED:
     if ( g_fd > 0 ) {
         close(g_fd);
         g_fd = -1;
-        snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
-        shm_unlink(filename);
+        if ( !g_persistent ) {
+            snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
+            shm_unlink(filename);
+        }
     }
+    g_persistent = 0;
     errno = errno_bak;
     return -1;
 }
 
+int shmlog_init_attr(const struct shmlog_attr *attr)
+{
+    if ( NULL == attr || 0 == attr->nmsg ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( FORK_NONE != atomic_load(&g_fork_state) ) {
+        drop_parent_ring();
+        atomic_store(&g_fork_state, FORK_NONE);
+    }
+    return init_ring(attr, 0);
+}
+
+int shmlog_init(size_t nmsg, int remove_unused)
+{
+    struct shmlog_attr attr = {
+        .nmsg = nmsg, .remove_unused = remove_unused, .prio_nmsg = 0, .prio_level = SHMLOG_LEVEL_ERROR,
+    };
+    return shmlog_init_attr(&attr);
+}
+
+void shmlog_set_prio_level(int level)
+{
+    if ( NULL != g_hdr ) {
+        atomic_store(&g_hdr->prio_level, level);
+    }
+}
+
+void shmlog_set_fork_policy(int policy)
+{
+    g_fork_policy = policy;
+}
+
+/*
+ * the first write of a forked child creates its own ring, so workers of a
+ * pre-fork server don't contend on one headtail. the other threads of the
+ * child wait for it.
+ */
+static int init_child_ring()
+{
+    unsigned site_rate = 0, site_burst = 0, site_sample = 0, dedup_ms = 0;
+    int state = FORK_PENDING, prio_level = g_attr.prio_level, ret;
+    pid_t ppid;
+    if ( atomic_compare_exchange_strong(&g_fork_state, &state, FORK_INIT) ) {
+        ppid = g_ring_pid;
+        if ( SHMLOG_FORK_INHERIT == g_fork_policy && NULL != g_hdr ) {
+            site_rate = atomic_load(&g_hdr->site_rate);
+            site_burst = atomic_load(&g_hdr->site_burst);
+            site_sample = atomic_load(&g_hdr->site_sample);
+            prio_level = atomic_load(&g_hdr->prio_level);
+            dedup_ms = atomic_load(&g_hdr->dedup_ms);
+        }
+        drop_parent_ring();
+        ret = init_ring(&g_attr, ppid);
+        if ( 0 == ret ) {
+            atomic_store(&g_hdr->site_rate, site_rate);
+            atomic_store(&g_hdr->site_burst, site_burst);
+            atomic_store(&g_hdr->site_sample, site_sample);
+            atomic_store(&g_hdr->prio_level, prio_level);
+            atomic_store(&g_hdr->dedup_ms, dedup_ms);
+        } else {
+            LOG("[dengjfzh/libshmlog] Error: create ring of forked process failed! %d:%s %s:%d\n",
+                errno, strerror(errno), __FILE__, __LINE__);
+        }
+        atomic_store(&g_fork_state, FORK_NONE);
+        return ret;
+    }
+    while ( FORK_NONE != atomic_load(&g_fork_state) ) {
+        thrd_yield();
+    }
+    return (g_fd < 0) ? -1 : 0;
+}
+
 void shmlog_uninit()
 {
     char filename[256];
     if ( g_fd < 0 ) {
         return;
     }
+    if ( FORK_NONE != atomic_load(&g_fork_state) || g_ring_pid != g_pid ) {
+        // the parent's ring
+        drop_parent_ring();
+        atomic_store(&g_fork_state, FORK_NONE);
+        return;
+    }
+    shmlog_flush_suppressed();
+    shmlog_flush_repeated();
+    if ( g_persistent ) {
+        mark_clean();
+    }
     int fd = g_fd;
     g_fd = -1;
+    if ( g_reg_idx >= 0 ) {
+        shmlogregistry_remove(g_reg, g_reg_idx, g_ring_pid);
+        g_reg_idx = -1;
+    }
+    if ( !g_persistent ) {
+        unlink_aliases();
+    }
+    unmap_retired();
     g_hdr = NULL;
     g_msgs = NULL;
     if ( MAP_FAILED != g_addr ) {
@@ -165,29 +630,117 @@ void shmlog_uninit()
     g_size = 0;
     if ( fd > 0 ) {
         close(fd);
-        snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", getpid());
-        shm_unlink(filename);
+        if ( !g_persistent ) {
+            snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", g_ring_pid);
+            shm_unlink(filename);
+        }
     }
+    g_persistent = 0;
     if ( g_remove_unused ) {
-        unlink_all_unuse();
+        remove_dead_rings();
     }
 }
 
-int shmlog_write(const void *data, size_t len)
+/*
+ * wait for the consumer to release the slot. a slot still held by the consumer
+ * is overwritten after lease_hold_us (at once by default), so a slow consumer
+ * never blocks producers; the consumer finds that its lease is invalid by gen.
+ * a slot held by a dead consumer is taken back at once.
+ */
+static unsigned wait_slot_released(struct shmlog_header *hdr, struct shmlog_msg *msg)
+{
+    int spin = 0, wait = 0, hold_us;
+    unsigned gen;
+    pid_t owner;
+    while ( atomic_load(&msg->hdr.filled) ) {
+        owner = atomic_load(&msg->hdr.owner);
+        hold_us = atomic_load_explicit(&hdr->lease_hold_us, memory_order_relaxed);
+        // owner 0: the consumer is releasing the slot, it will be empty soon
+        if ( wait >= hold_us && (0 != owner || wait >= SHMLOG_SLOT_TIMEOUT_US) ) {
+            // the consumer releases the slot only if it is still the owner
+            if ( atomic_compare_exchange_strong(&msg->hdr.owner, &owner, g_pid) ) {
+                atomic_fetch_add(&hdr->overrun_reads, 1);
+                break;
+            }
+            continue; // the owner has changed, it may be releasing the slot
+        }
+        if ( spin < SLOT_SPIN_MAX ) {
+            spin++;
+            thrd_yield();
+            continue;
+        }
+        if ( owner > 0 && owner != g_pid && kill(owner, 0) < 0 && ESRCH == errno ) {
+            if ( atomic_compare_exchange_strong(&msg->hdr.owner, &owner, g_pid) ) {
+                atomic_fetch_add(&hdr->abandoned_reads, 1);
+                LOG("[dengjfzh/libshmlog] Warning: slot held by %d has been taken back! %s:%d\n",
+                    owner, __FILE__, __LINE__);
+                break;
+            }
+            continue;
+        }
+        usleep(SLOT_SLEEP_US);
+        wait += SLOT_SLEEP_US;
+    }
+    // make gen odd: the slot is being written. if the last writer died while writing, count its write too.
+    // gen changes before owner, so a consumer taking the slot by CAS on owner meanwhile sees it.
+    gen = atomic_load(&msg->hdr.gen);
+    gen = (gen & 1) ? gen + 2 : gen + 1;
+    atomic_store(&msg->hdr.gen, gen);
+    atomic_store(&msg->hdr.owner, g_pid);
+    atomic_thread_fence(memory_order_release);
+    msg->hdr.type = SHMLOG_MSG_TEXT;
+    return gen;
+}
+
+// count the writer in the current ring, see ring_ref
+static struct ring_ref *enter_ring()
+{
+    struct ring_ref *ref;
+    for ( ;; ) {
+        ref = atomic_load(&g_ring);
+        if ( NULL == ref ) {
+            return NULL;
+        }
+        atomic_fetch_add(&ref->writers, 1);
+        // pairs with shmlog_resize: either it sees the writer in the old ring, or the writer sees the new one
+        if ( atomic_load(&g_ring) == ref ) {
+            return ref;
+        }
+        atomic_fetch_sub(&ref->writers, 1);
+    }
+}
+
+static inline int ring_has(struct ring_ref *ref, const struct shmlog_msg *msg)
+{
+    const uint8_t *hdr = (const uint8_t *)atomic_load(&ref->hdr);
+    return NULL != hdr && (const uint8_t *)msg > hdr && (const uint8_t *)msg < hdr + atomic_load_explicit(&ref->size, memory_order_relaxed);
+}
+
+// the ring which a reserved slot belongs to, its writer is still counted in it
+static struct ring_ref *ring_of(const struct shmlog_msg *msg)
+{
+    struct ring_ref *ref = atomic_load(&g_ring);
+    if ( NULL != ref && ring_has(ref, msg) ) {
+        return ref;
+    }
+    for ( int i = 0; i < RING_REFS; i++ ) {
+        if ( ring_has(&g_refs[i], msg) ) {
+            return &g_refs[i];
+        }
+    }
+    return NULL;
+}
+
+// reserve a slot of a ring: the main one or the priority lane
+static struct shmlog_msg *reserve_slot(struct shmlog_header *hdr, shmlog_atomic_headtail *headtail, uint32_t nmsg, struct shmlog_msg *msgs)
 {
     shmlog_int_headtail ht_old, ht_new;
     shmlog_int_head head, tail, head_new, tail_new;
     bool full;
     int full_retry, full_wait;
-    if ( g_fd < 0 || NULL == g_hdr || NULL == g_msgs ) {
-        return -1;
-    }
-    if ( len > SHMLOG_MSG_BODY_SIZE ) {
-        len = SHMLOG_MSG_BODY_SIZE;
-    }
     full_retry = 0;
     full_wait = 1;
-    ht_old = atomic_load(&g_hdr->headtail);
+    ht_old = atomic_load(headtail);
     do {
         head = GET_HEAD(ht_old);
         tail = GET_TAIL(ht_old);
@@ -198,8 +751,8 @@ int shmlog_write(const void *data, size_t len)
         }
         head_new = head;
         tail_new = tail + 1;
-        if ( (tail_new - head_new) > g_hdr->nmsg ) { // full
-            const pid_t consumer_pid = atomic_load(&g_hdr->consumer_pid);
+        if ( (tail_new - head_new) > nmsg ) { // full
+            const pid_t consumer_pid = atomic_load(&hdr->consumer_pid);
             if ( consumer_pid > 0 ) {
                 if ( full_retry < FULL_RETRY_MAX ) {
                     // wait a moment if there is a consumer
@@ -209,12 +762,12 @@ int shmlog_write(const void *data, size_t len)
                         full_wait *= 2;
                     }
                     usleep(full_wait);
-                    ht_old = atomic_load(&g_hdr->headtail);
+                    ht_old = atomic_load(headtail);
                     continue;
                 }
                 // consumer timeout, remve it
                 if ( kill(consumer_pid, 0) < 0 && ESRCH == errno ) {
-                    if ( atomic_compare_exchange_strong(&g_hdr->consumer_pid, &consumer_pid, 0) ) {
+                    if ( atomic_compare_exchange_strong(&hdr->consumer_pid, &consumer_pid, 0) ) {
                         LOG("[dengjfzh/libshmlog] Warning: consumer %d has been removed! %s:%d\n",
                             consumer_pid, __FILE__, __LINE__);
                     }
@@ -223,7 +776,7 @@ int shmlog_write(const void *data, size_t len)
             // overwrite oldest msg
             head_new = head + 1;
             if ( head_new >= INTHEAD_MAX ) {
-                shmlog_int_head tmp = (head_new / g_hdr->nmsg) * g_hdr->nmsg;
+                shmlog_int_head tmp = (head_new / nmsg) * nmsg;
                 head_new -= tmp;
                 tail_new -= tmp;
             }
@@ -232,23 +785,594 @@ int shmlog_write(const void *data, size_t len)
         full_retry = 0;
         full_wait = 1;
         ht_new = MAKE_HT(head_new, tail_new);
-    } while ( full || !atomic_compare_exchange_weak(&g_hdr->headtail, &ht_old, ht_new) );
+    } while ( full || !atomic_compare_exchange_weak(headtail, &ht_old, ht_new) );
     if ( head_new != head ) { // oldest msg has been removed
-        head %= g_hdr->nmsg;
-        atomic_store(&g_msgs[head].hdr.filled, false);
+        atomic_fetch_add_explicit(&hdr->noverwrite, 1, memory_order_relaxed);
+        head %= nmsg;
+        atomic_store(&msgs[head].hdr.filled, false);
     }
-    if ( tail >= g_hdr->nmsg ) {
-        tail %= g_hdr->nmsg;
+    if ( tail >= nmsg ) {
+        tail %= nmsg;
     }
-    while ( atomic_load(&g_msgs[tail].hdr.filled) ) {
-        thrd_yield();
+    t_reserved[t_reserved_next % RESERVED_MAX].msg = &msgs[tail];
+    t_reserved[t_reserved_next % RESERVED_MAX].gen = wait_slot_released(hdr, &msgs[tail]);
+    t_reserved_next++;
+    if ( 0 == (++t_writes & SHMLOG_REGISTRY_HEARTBEAT_MASK) ) {
+        if ( g_reg_idx >= 0 ) {
+            atomic_store_explicit(&g_reg->entries[g_reg_idx].heartbeat, time(NULL), memory_order_relaxed);
+        }
+        t_heartbeat = 1; // the rest is done after the commit, out of the ring
+    }
+    return &msgs[tail];
+}
+
+struct shmlog_msg *shmlog_reserve()
+{
+    struct shmlog_header *hdr;
+    struct ring_ref *ref;
+    if ( FORK_NONE != atomic_load_explicit(&g_fork_state, memory_order_acquire) && init_child_ring() < 0 ) {
+        return NULL;
+    }
+    ref = (g_fd < 0) ? NULL : enter_ring(); // left by shmlog_commit
+    if ( NULL == ref ) {
+        return NULL;
+    }
+    hdr = atomic_load(&ref->hdr);
+    return reserve_slot(hdr, &hdr->headtail, hdr->nmsg, ring_msgs(hdr));
+}
+
+struct shmlog_msg *shmlog_reserve_level(int level)
+{
+    struct shmlog_header *hdr;
+    struct ring_ref *ref;
+    if ( FORK_NONE != atomic_load_explicit(&g_fork_state, memory_order_acquire) && init_child_ring() < 0 ) {
+        return NULL;
     }
-    memcpy(g_msgs[tail].body, data, len);
-    g_msgs[tail].hdr.len = len;
-    atomic_store(&g_msgs[tail].hdr.filled, true);
+    ref = (g_fd < 0) ? NULL : enter_ring();
+    if ( NULL == ref ) {
+        return NULL;
+    }
+    hdr = atomic_load(&ref->hdr);
+    if ( hdr->prio_nmsg > 0 && level >= atomic_load_explicit(&hdr->prio_level, memory_order_relaxed) ) {
+        return reserve_slot(hdr, &hdr->prio_headtail, hdr->prio_nmsg, ring_msgs(hdr) + hdr->nmsg);
+    }
+    return reserve_slot(hdr, &hdr->headtail, hdr->nmsg, ring_msgs(hdr));
+}
+
+// wake up the consumer waiting for the ring to become non-empty
+static void notify(struct shmlog_header *hdr)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int fd = atomic_load(&g_notify_fd), expected = -1;
+    if ( !atomic_exchange(&hdr->notify_armed, 0) ) {
+        return; // another producer did it
+    }
+    if ( fd < 0 ) {
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if ( fd < 0 ) {
+            return;
+        }
+        if ( !atomic_compare_exchange_strong(&g_notify_fd, &expected, fd) ) {
+            close(fd);
+            fd = expected;
+        }
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 +
+              snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, SHMLOG_NOTIFY_NAME, g_ring_pid);
+    // the consumer may have gone, or has not drained previous ones
+    sendto(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr *)&addr, addrlen);
+}
+
+static void heartbeat();
+static void flush_expired(unsigned window_ms);
+
+// the generation of a slot taken at its reserve, or the current one if it's committed by another thread
+static unsigned reserved_gen(struct shmlog_msg *msg)
+{
+    for ( int i = 0; i < RESERVED_MAX; i++ ) {
+        if ( msg == t_reserved[i].msg ) {
+            t_reserved[i].msg = NULL;
+            return t_reserved[i].gen;
+        }
+    }
+    return atomic_load(&msg->hdr.gen) | 1;
+}
+
+void shmlog_commit(struct shmlog_msg *msg, size_t len)
+{
+    struct ring_ref *ref = ring_of(msg); // the ring may have been replaced since the reserve
+    struct shmlog_header *hdr;
+    unsigned gen;
+    if ( len > SHMLOG_MSG_BODY_SIZE ) {
+        len = SHMLOG_MSG_BODY_SIZE;
+    }
+    // a late commit is dropped if the consumer has abandoned the slot, a producer may be writing it again
+    gen = reserved_gen(msg);
+    if ( atomic_load(&msg->hdr.gen) == gen ) {
+        msg->hdr.len = len;
+        if ( atomic_compare_exchange_strong(&msg->hdr.gen, &gen, gen + 1) ) {
+            atomic_store(&msg->hdr.filled, true);
+        }
+    }
+    if ( NULL != ref ) {
+        hdr = atomic_load(&ref->hdr);
+        atomic_fetch_add_explicit(&hdr->nwrite, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&hdr->nbytes, len, memory_order_relaxed);
+        // pairs with shmlogclient_arm: either it sees the message, or we see it armed
+        if ( atomic_load(&hdr->notify_armed) ) {
+            notify(hdr);
+        }
+        // the last writer of a replaced ring, no one can enter it any more. missed if another one leaves
+        // at the same time, then it's sealed by unmap_left_rings, or consumers wait SHMLOG_RESIZE_GRACE_US
+        if ( ref != atomic_load(&g_ring) && 1 == atomic_load(&ref->writers) ) {
+            atomic_store(&hdr->sealed, 1);
+        }
+        atomic_fetch_sub(&ref->writers, 1); // it may be unmapped from now on
+    }
+    if ( t_heartbeat ) {
+        t_heartbeat = 0;
+        heartbeat();
+    }
+}
+
+static inline uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// carry the counters of a ring over to the one which replaces it
+static void carry_counters(struct shmlog_header *to, struct shmlog_header *from, struct ring_counters *c)
+{
+    c->nwrite = atomic_load(&from->nwrite);
+    c->nbytes = atomic_load(&from->nbytes);
+    c->noverwrite = atomic_load(&from->noverwrite);
+    c->nread = atomic_load(&from->nread);
+    c->suppressed = atomic_load(&from->suppressed);
+    c->repeated = atomic_load(&from->repeated);
+    c->abandoned_writes = atomic_load(&from->abandoned_writes);
+    c->abandoned_reads = atomic_load(&from->abandoned_reads);
+    c->overrun_reads = atomic_load(&from->overrun_reads);
+    atomic_store(&to->nwrite, c->nwrite);
+    atomic_store(&to->nbytes, c->nbytes);
+    atomic_store(&to->noverwrite, c->noverwrite);
+    atomic_store(&to->nread, c->nread);
+    atomic_store(&to->suppressed, c->suppressed);
+    atomic_store(&to->repeated, c->repeated);
+    atomic_store(&to->abandoned_writes, c->abandoned_writes);
+    atomic_store(&to->abandoned_reads, c->abandoned_reads);
+    atomic_store(&to->overrun_reads, c->overrun_reads);
+}
+
+// add what a replaced ring has counted since its counters were carried over, before it's unmapped
+static void fold_counters(struct shmlog_header *to, struct shmlog_header *from, const struct ring_counters *c)
+{
+    atomic_fetch_add(&to->nwrite, atomic_load(&from->nwrite) - c->nwrite);
+    atomic_fetch_add(&to->nbytes, atomic_load(&from->nbytes) - c->nbytes);
+    atomic_fetch_add(&to->noverwrite, atomic_load(&from->noverwrite) - c->noverwrite);
+    atomic_fetch_add(&to->nread, atomic_load(&from->nread) - c->nread);
+    atomic_fetch_add(&to->suppressed, atomic_load(&from->suppressed) - c->suppressed);
+    atomic_fetch_add(&to->repeated, atomic_load(&from->repeated) - c->repeated);
+    atomic_fetch_add(&to->abandoned_writes, atomic_load(&from->abandoned_writes) - c->abandoned_writes);
+    atomic_fetch_add(&to->abandoned_reads, atomic_load(&from->abandoned_reads) - c->abandoned_reads);
+    atomic_fetch_add(&to->overrun_reads, atomic_load(&from->overrun_reads) - c->overrun_reads);
+}
+
+/*
+ * unmap the replaced rings which no writer is in, with g_resizing held. a ring
+ * is kept until it's drained (or given up), so consumers of the ring before it
+ * can still follow to it by name, even if it has been replaced too.
+ */
+static void unmap_left_rings()
+{
+    struct ring_ref *cur = atomic_load(&g_ring), *ref;
+    struct shmlog_header *hdr;
+    shmlog_int_headtail ht, prio_ht;
+    char filename[256];
+    for ( int i = 0; i < RING_REFS; i++ ) {
+        ref = &g_refs[i];
+        hdr = atomic_load(&ref->hdr);
+        if ( ref == cur || NULL == hdr || atomic_load(&ref->writers) > 0 ) {
+            continue;
+        }
+        atomic_store(&hdr->sealed, 1);
+        ht = atomic_load(&hdr->headtail);
+        prio_ht = atomic_load(&hdr->prio_headtail);
+        if ( (GET_HEAD(ht) != GET_TAIL(ht) || GET_HEAD(prio_ht) != GET_TAIL(prio_ht)) &&
+             monotonic_ns() - atomic_load(&hdr->moved) < SHMLOG_RESIZE_KEEP_US * 1000ULL ) {
+            continue;
+        }
+        if ( ref->alias > 0 ) {
+            snprintf(filename, sizeof(filename), SHMLOG_RESIZED_NAME, g_ring_pid, ref->alias);
+            shm_unlink(filename);
+        }
+        if ( NULL != cur ) {
+            fold_counters(atomic_load(&cur->hdr), hdr, &ref->carried);
+        }
+        atomic_store(&ref->hdr, NULL);
+        munmap((void*)hdr, atomic_load(&ref->size));
+        atomic_fetch_sub(&g_nretired, 1);
+    }
+}
+
+int shmlog_resize(size_t nmsg)
+{
+    struct shmlog_header *old = g_hdr, *hdr;
+    struct ring_ref *ref = NULL, *cur;
+    char filename[256], alias[256], tmpname[256], from[PATH_MAX], to[PATH_MAX];
+    void *addr = MAP_FAILED;
+    size_t size;
+    int fd = -1, old_fd, errno_bak;
+    if ( 0 == nmsg || nmsg >= INTHEAD_MAX / 2 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( g_fd < 0 || NULL == old || FORK_NONE != atomic_load(&g_fork_state) || g_ring_pid != g_pid ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( g_persistent ) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if ( atomic_flag_test_and_set(&g_resizing) ) {
+        errno = EBUSY;
+        return -1;
+    }
+    if ( nmsg == old->nmsg ) {
+        atomic_flag_clear(&g_resizing);
+        return 0;
+    }
+    // a ref for the new ring, the replaced ones are kept until their writers leave
+    unmap_left_rings();
+    for ( int i = 0; i < RING_REFS && NULL == ref; i++ ) {
+        if ( NULL == atomic_load(&g_refs[i].hdr) ) {
+            ref = &g_refs[i];
+        }
+    }
+    if ( NULL == ref ) {
+        atomic_flag_clear(&g_resizing);
+        errno = EAGAIN;
+        return -1;
+    }
+    // create the new ring under its own name, consumers of the old one follow to it by the name
+    size = sizeof(struct shmlog_fullheader) + SHMLOG_MSG_SIZE * (nmsg + old->prio_nmsg);
+    g_nresize++;
+    snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", g_ring_pid);
+    snprintf(alias, sizeof(alias), SHMLOG_RESIZED_NAME, g_ring_pid, g_nresize);
+    snprintf(tmpname, sizeof(tmpname), SHMLOG_FILE_PREFIX "%d.resize", g_ring_pid);
+    shm_unlink(alias); // left by a dead process of the same pid
+    shm_unlink(tmpname);
+    fd = shm_open(alias, O_CREAT|O_EXCL|O_RDWR, 0666);
+    if ( fd < 0 || ftruncate(fd, size) < 0 ) {
+        goto FAILED;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( MAP_FAILED == addr ) {
+        goto FAILED;
+    }
+    hdr = (struct shmlog_header *)addr;
+    init_header(hdr, nmsg, old->prio_nmsg, atomic_load(&old->prio_level));
+    // runtime settings go on, and counters, which are added up when the old ring is unmapped
+    atomic_store(&hdr->consumer_pid, atomic_load(&old->consumer_pid));
+    atomic_store(&hdr->lease_hold_us, atomic_load(&old->lease_hold_us));
+    atomic_store(&hdr->site_rate, atomic_load(&old->site_rate));
+    atomic_store(&hdr->site_burst, atomic_load(&old->site_burst));
+    atomic_store(&hdr->site_sample, atomic_load(&old->site_sample));
+    atomic_store(&hdr->dedup_ms, atomic_load(&old->dedup_ms));
+    cur = atomic_load(&g_ring);
+    carry_counters(hdr, old, &cur->carried);
+    hdr->pid = g_pid;
+    atomic_store(&hdr->clean, 0);
+    // it replaces the old one under the name of the ring, by a second link
+    snprintf(from, sizeof(from), SHM_FILE_PATH "/%s", alias);
+    snprintf(to, sizeof(to), SHM_FILE_PATH "/%s", tmpname);
+    if ( link(from, to) < 0 ) {
+        goto FAILED;
+    }
+    snprintf(from, sizeof(from), SHM_FILE_PATH "/%s", tmpname);
+    snprintf(to, sizeof(to), SHM_FILE_PATH "/%s", filename);
+    if ( rename(from, to) < 0 ) {
+        shm_unlink(tmpname);
+        goto FAILED;
+    }
+    // switch writers, the ones which have entered the old ring finish their writes there
+    atomic_store(&ref->size, size);
+    atomic_store(&ref->hdr, hdr);
+    ref->alias = g_nresize;
+    old_fd = g_fd;
+    g_fd = fd;
+    g_addr = addr;
+    g_size = size;
+    g_msgs = ring_msgs(hdr);
+    g_hdr = hdr;
+    g_attr.nmsg = nmsg;
+    atomic_fetch_add(&g_nretired, 1);
+    atomic_store(&g_ring, ref);
+    // consumers drain the old ring, then follow
+    atomic_store(&old->next_ring, g_nresize);
+    atomic_store(&old->moved, monotonic_ns());
+    if ( atomic_load(&old->notify_armed) ) {
+        notify(old);
+    }
+    close(old_fd);
+    unmap_left_rings(); // seals the old ring at once if no writer is in it, it may be unmapped from now on
+    if ( g_reg_idx >= 0 ) {
+        g_reg->entries[g_reg_idx].nmsg = nmsg;
+        g_reg->entries[g_reg_idx].size = size;
+    }
+    atomic_flag_clear(&g_resizing);
+    return 0;
+FAILED:
+    errno_bak = errno;
+    if ( MAP_FAILED != addr ) {
+        munmap(addr, size);
+    }
+    if ( fd >= 0 ) {
+        close(fd);
+        shm_unlink(alias);
+    }
+    atomic_flag_clear(&g_resizing);
+    errno = errno_bak;
+    return -1;
+}
+
+static void resize_requested(struct shmlog_header *hdr)
+{
+    unsigned nmsg = atomic_exchange(&hdr->resize_nmsg, 0), expected = 0;
+    if ( nmsg > 0 && shmlog_resize(nmsg) < 0 ) {
+        if ( EBUSY == errno || EAGAIN == errno ) { // try again at the next heartbeat
+            atomic_compare_exchange_strong(&hdr->resize_nmsg, &expected, nmsg);
+            return;
+        }
+        LOG("[dengjfzh/libshmlog] Error: resize ring to %u messages failed! %d:%s %s:%d\n",
+            nmsg, errno, strerror(errno), __FILE__, __LINE__);
+    }
+}
+
+// every SHMLOG_REGISTRY_HEARTBEAT_MASK+1 writes of a thread, out of any ring:
+// a resize requested by `shmlogtail --resize`, and unmapping replaced rings
+static void heartbeat()
+{
+    struct shmlog_header *hdr = g_hdr;
+    if ( NULL != hdr && atomic_load_explicit(&hdr->resize_nmsg, memory_order_relaxed) > 0 ) {
+        resize_requested(hdr);
+    }
+    if ( atomic_load_explicit(&g_nretired, memory_order_relaxed) > 0 && !atomic_flag_test_and_set(&g_resizing) ) {
+        unmap_left_rings();
+        atomic_flag_clear(&g_resizing);
+    }
+    if ( NULL != hdr ) {
+        flush_expired(atomic_load_explicit(&hdr->dedup_ms, memory_order_relaxed));
+    }
+}
+
+static inline uint64_t hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = len, w;
+    for ( ; len >= sizeof(w); p += sizeof(w), len -= sizeof(w) ) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * HASH_MUL;
+        h ^= h >> 32;
+    }
+    if ( len > 0 ) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ w) * HASH_MUL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static void dedup_key_create()
+{
+    pthread_key_create(&g_dedup_key, flush_repeated);
+}
+
+static inline uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+static void write_repeated(struct dedup_state *st);
+
+/*
+ * write the records of runs which have lasted the window, for the threads
+ * which don't log any more. called by any thread on its way, it takes the
+ * states it can get at once and leaves the rest to the next call.
+ */
+static void flush_expired(unsigned window_ms)
+{
+    struct dedup_state *expired[DEDUP_FLUSH_MAX], *st;
+    struct timespec now;
+    int n = 0;
+    if ( 0 == atomic_load_explicit(&g_dedup_pending, memory_order_relaxed) ) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if ( 0 != pthread_mutex_trylock(&g_dedup_lock) ) {
+        return; // another thread does it
+    }
+    for ( st = g_dedup_runs; NULL != st && n < DEDUP_FLUSH_MAX; st = st->next ) {
+        // the first of a run doesn't change while it's listed
+        if ( elapsed_ns(&st->first, &now) >= window_ms * 1000000ULL &&
+             !atomic_flag_test_and_set_explicit(&st->busy, memory_order_acquire) ) {
+            expired[n++] = st;
+        }
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+    // the owners wait for busy, even to exit
+    for ( int i = 0; i < n; i++ ) {
+        write_repeated(expired[i]);
+        atomic_flag_clear_explicit(&expired[i]->busy, memory_order_release);
+    }
+}
+
+/*
+ * return 1 if the message repeats the previous one of this thread, then it's
+ * counted instead of written. cost of a new message: a hash of its words and
+ * a copy, which is compared on a hash hit.
+ */
+static int dedup(int level, const void *data, size_t len)
+{
+    struct dedup_state *st = &t_dedup;
+    unsigned window_ms;
+    uint64_t hash;
+    int repeated = 0;
+    if ( NULL == g_hdr || FORK_NONE != atomic_load_explicit(&g_fork_state, memory_order_relaxed) ) {
+        return 0;
+    }
+    window_ms = atomic_load_explicit(&g_hdr->dedup_ms, memory_order_relaxed);
+    // disabled, and no run of this thread to end. repeats is only cleared by others
+    if ( 0 == window_ms && 0 == st->repeats ) {
+        if ( UINT32_MAX != st->len ) {
+            st->len = UINT32_MAX;
+        }
+        return 0;
+    }
+    flush_expired(window_ms);
+    // taken by flush_expired, or by the write this one interrupts in a signal handler: don't wait
+    if ( atomic_flag_test_and_set_explicit(&st->busy, memory_order_acquire) ) {
+        return 0;
+    }
+    if ( 0 == window_ms ) {
+        write_repeated(st);
+        st->len = UINT32_MAX;
+        goto DONE;
+    }
+    hash = hash_bytes(data, len);
+    if ( hash == st->hash && len == st->len && level == st->level && g_ring_pid == st->ring_pid &&
+         0 == memcmp(data, st->body, len) ) {
+        clock_gettime(CLOCK_REALTIME_COARSE, &st->last);
+        if ( 0 == st->repeats++ ) {
+            st->first = st->last;
+            pthread_once(&g_dedup_once, dedup_key_create);
+            pthread_setspecific(g_dedup_key, st);
+            pthread_mutex_lock(&g_dedup_lock);
+            st->prev = NULL;
+            st->next = g_dedup_runs;
+            if ( NULL != g_dedup_runs ) {
+                g_dedup_runs->prev = st;
+            }
+            g_dedup_runs = st;
+            st->linked = 1;
+            pthread_mutex_unlock(&g_dedup_lock);
+            atomic_fetch_add(&g_dedup_pending, 1);
+        }
+        atomic_fetch_add_explicit(&g_hdr->repeated, 1, memory_order_relaxed);
+        if ( elapsed_ns(&st->first, &st->last) >= window_ms * 1000000ULL ) {
+            write_repeated(st);
+        }
+        repeated = 1;
+        goto DONE;
+    }
+    write_repeated(st);
+    st->hash = hash;
+    st->len = len;
+    st->level = level;
+    st->ring_pid = g_ring_pid;
+    memcpy(st->body, data, len);
+DONE:
+    atomic_flag_clear_explicit(&st->busy, memory_order_release);
+    return repeated;
+}
+
+static int write_msg(struct shmlog_msg *msg, const void *data, size_t len)
+{
+    if ( NULL == msg ) {
+        return -1;
+    }
+    if ( len > SHMLOG_MSG_BODY_SIZE ) {
+        len = SHMLOG_MSG_BODY_SIZE;
+    }
+    memcpy(msg->body, data, len);
+    shmlog_commit(msg, len);
     return len;
 }
 
+// write the record of repeats, into the lane of the repeated message, with st->busy held
+static void write_repeated(struct dedup_state *st)
+{
+    char msg[SHMLOG_MSG_BODY_SIZE];
+    int len;
+    if ( 0 == st->repeats ) {
+        return;
+    }
+    if ( st->linked ) {
+        pthread_mutex_lock(&g_dedup_lock);
+        if ( NULL != st->prev ) {
+            st->prev->next = st->next;
+        } else {
+            g_dedup_runs = st->next;
+        }
+        if ( NULL != st->next ) {
+            st->next->prev = st->prev;
+        }
+        st->linked = 0;
+        pthread_mutex_unlock(&g_dedup_lock);
+        atomic_fetch_sub(&g_dedup_pending, 1);
+    }
+    len = snprintf(msg, sizeof(msg), "[shmlog] last message repeated %u times, from %ld.%03ld to %ld.%03ld",
+                   st->repeats, (long)st->first.tv_sec, st->first.tv_nsec / 1000000,
+                   (long)st->last.tv_sec, st->last.tv_nsec / 1000000);
+    st->repeats = 0;
+    if ( g_ring_pid == st->ring_pid && FORK_NONE == atomic_load(&g_fork_state) ) {
+        write_msg((st->level < 0) ? shmlog_reserve() : shmlog_reserve_level(st->level), msg, len);
+    }
+}
+
+// at thread exit, the state must not be in use by flush_expired any more
+static void flush_repeated(void *arg)
+{
+    struct dedup_state *st = (struct dedup_state *)arg;
+    while ( atomic_flag_test_and_set_explicit(&st->busy, memory_order_acquire) ); // taken by flush_expired
+    write_repeated(st);
+    atomic_flag_clear_explicit(&st->busy, memory_order_release);
+}
+
+int shmlog_write(const void *data, size_t len)
+{
+    if ( len > SHMLOG_MSG_BODY_SIZE ) {
+        len = SHMLOG_MSG_BODY_SIZE;
+    }
+    if ( dedup(-1, data, len) ) {
+        return len;
+    }
+    return write_msg(shmlog_reserve(), data, len);
+}
+
+int shmlog_write_level(int level, const void *data, size_t len)
+{
+    if ( len > SHMLOG_MSG_BODY_SIZE ) {
+        len = SHMLOG_MSG_BODY_SIZE;
+    }
+    if ( dedup(level, data, len) ) {
+        return len;
+    }
+    return write_msg(shmlog_reserve_level(level), data, len);
+}
+
+void shmlog_set_dedup(unsigned window_ms)
+{
+    if ( NULL != g_hdr ) {
+        atomic_store(&g_hdr->dedup_ms, window_ms);
+    }
+}
+
+void shmlog_flush_repeated()
+{
+    // if busy, it's being written by flush_expired, or by the write a signal handler interrupts
+    if ( !atomic_flag_test_and_set_explicit(&t_dedup.busy, memory_order_acquire) ) {
+        write_repeated(&t_dedup);
+        atomic_flag_clear_explicit(&t_dedup.busy, memory_order_release);
+    }
+}
+
 int shmlog_vprintf(const char *fmt, va_list ap)
 {
     char msg[SHMLOG_MSG_BODY_SIZE];
@@ -267,3 +1391,162 @@ int shmlog_printf(const char *fmt, ...)
     va_end(ap);
     return ret;
 }
+
+int shmlog_vprintf_level(int level, const char *fmt, va_list ap)
+{
+    char msg[SHMLOG_MSG_BODY_SIZE];
+    int len;
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    if ( len < 0 )
+        return len;
+    return shmlog_write_level(level, msg, len);
+}
+
+int shmlog_printf_level(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = shmlog_vprintf_level(level, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+static void write_suppressed(struct shmlog_site *site)
+{
+    unsigned n = atomic_exchange(&site->suppressed, 0);
+    if ( n > 0 ) {
+        shmlog_printf("[shmlog] suppressed %u messages from %s:%d", n, site->file, site->line);
+    }
+}
+
+static void suppress(struct shmlog_site *site)
+{
+    bool listed = false;
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_hdr->suppressed, 1, memory_order_relaxed);
+    // remember the site, so its summary is written even if it is never admitted again
+    if ( atomic_compare_exchange_strong(&site->listed, &listed, true) ) {
+        site->next = atomic_load(&g_sites);
+        while ( !atomic_compare_exchange_weak(&g_sites, &site->next, site) );
+    }
+}
+
+/*
+ * sampling counts the calls of the site, rate limiting is a token bucket in
+ * form of GCRA: a message is admitted if it isn't earlier than tat - (burst-1) * interval,
+ * then tat moves forward by one interval. one CAS, no lock.
+ */
+int shmlog_site_admit(struct shmlog_site *site)
+{
+    unsigned rate, burst, sample;
+    uint64_t now, interval, tau, tat, base;
+    struct timespec ts;
+    if ( FORK_NONE != atomic_load_explicit(&g_fork_state, memory_order_acquire) ) {
+        return 1; // shmlog_printf creates the ring of the forked process
+    }
+    if ( NULL == g_hdr ) {
+        return 1; // let shmlog_printf fail
+    }
+    sample = atomic_load_explicit(&g_hdr->site_sample, memory_order_relaxed);
+    if ( 0 == sample ) {
+        sample = site->sample;
+    }
+    if ( sample > 1 && atomic_fetch_add_explicit(&site->calls, 1, memory_order_relaxed) % sample != 0 ) {
+        suppress(site);
+        return 0;
+    }
+    rate = atomic_load_explicit(&g_hdr->site_rate, memory_order_relaxed);
+    burst = atomic_load_explicit(&g_hdr->site_burst, memory_order_relaxed);
+    if ( 0 == rate ) {
+        rate = site->rate;
+    }
+    if ( 0 == burst ) {
+        burst = site->burst;
+    }
+    if ( rate > 0 ) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        interval = 1000000000ULL / rate;
+        tau = (burst > 1) ? (burst - 1) * interval : 0;
+        tat = atomic_load_explicit(&site->tat, memory_order_relaxed);
+        do {
+            base = (tat > now) ? tat : now;
+            if ( base - now > tau ) {
+                suppress(site);
+                return 0;
+            }
+        } while ( !atomic_compare_exchange_weak(&site->tat, &tat, base + interval) );
+    }
+    if ( atomic_load_explicit(&site->suppressed, memory_order_relaxed) > 0 ) {
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        base = atomic_load_explicit(&site->summary, memory_order_relaxed);
+        if ( now - base >= SITE_SUMMARY_INTERVAL_NS && atomic_compare_exchange_strong(&site->summary, &base, now) ) {
+            write_suppressed(site);
+        }
+    }
+    return 1;
+}
+
+// write the summaries of all sites which have suppressed messages
+void shmlog_flush_suppressed()
+{
+    for ( struct shmlog_site *site = atomic_load(&g_sites); NULL != site; site = site->next ) {
+        write_suppressed(site);
+    }
+}
+
+uint64_t shmlog_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_trace(char phase, const char *name, uint64_t ts, int64_t value)
+{
+    struct shmlog_msg *msg;
+    struct shmlog_trace_rec rec;
+    size_t name_len = (NULL != name) ? strnlen(name, sizeof(rec.name)) : 0;
+    msg = shmlog_reserve();
+    if ( NULL == msg ) {
+        return -1;
+    }
+    if ( 0 == t_tid ) {
+        t_tid = syscall(SYS_gettid);
+    }
+    // the body is not aligned for the record, it's copied in
+    rec.ts = ts;
+    rec.value = value;
+    rec.tid = t_tid;
+    rec.phase = phase;
+    rec.name_len = name_len;
+    rec.reserve = 0;
+    memcpy(msg->body, &rec, offsetof(struct shmlog_trace_rec, name));
+    if ( name_len > 0 ) { // name may be NULL
+        memcpy(msg->body + offsetof(struct shmlog_trace_rec, name), name, name_len);
+    }
+    msg->hdr.type = SHMLOG_MSG_TRACE;
+    shmlog_commit(msg, offsetof(struct shmlog_trace_rec, name) + name_len);
+    return 0;
+}
+
+int shmlog_trace_begin(const char *name)
+{
+    return write_trace(SHMLOG_TRACE_BEGIN, name, shmlog_trace_now(), 0);
+}
+
+int shmlog_trace_end(const char *name)
+{
+    return write_trace(SHMLOG_TRACE_END, name, shmlog_trace_now(), 0);
+}
+
+int shmlog_trace_complete(const char *name, uint64_t start_ns)
+{
+    return write_trace(SHMLOG_TRACE_COMPLETE, name, start_ns, shmlog_trace_now() - start_ns);
+}
+
+int shmlog_trace_counter(const char *name, int64_t value)
+{
+    return write_trace(SHMLOG_TRACE_COUNTER, name, shmlog_trace_now(), value);
+}
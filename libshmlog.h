@@ -1,20 +1,43 @@
 #ifndef __DENGJFZH_SHMLOG_H__
 #define __DENGJFZH_SHMLOG_H__
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#ifdef __cplusplus
+// the same lock-free types as C11 atomic, so the shared memory layout can be used in C++
+#include <atomic>
+using std::atomic_bool;
+using std::atomic_int;
+using std::atomic_uint;
+using std::atomic_ulong;
+using std::atomic_ullong;
+#else
 #include <stdbool.h>
 #include <stdatomic.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
     
 #define SHMLOG_FILE_PREFIX "dengjfzh-shmlog-"
+#define SHMLOG_RING_MAGIC 0x31474c53 // "SLG1"
+#define SHMLOG_NOTIFY_NAME SHMLOG_FILE_PREFIX "%d.notify" // abstract unix socket (leading NUL in sun_path) of the consumer of ring pid
+#define SHMLOG_RESIZED_NAME SHMLOG_FILE_PREFIX "%d.%u"     // a ring of pid created by shmlog_resize, see shmlog_header.next_ring
 #define SHMLOG_MSG_SIZE_LOG2 8
 #define SHMLOG_MSG_SIZE (1<<SHMLOG_MSG_SIZE_LOG2)
+#define SHMLOG_SLOT_TIMEOUT_US (1000*1000) // a slot which no live process is writing or reading is taken after it
+#define SHMLOG_RESIZE_GRACE_US (100*1000)  // consumers keep draining a resized ring this long, for writes started before the switch
+#define SHMLOG_RESIZE_KEEP_US (60*1000*1000) // a resized ring which isn't drained is given up after this long
+
+#define SHMLOG_LEVEL_TRACE 0
+#define SHMLOG_LEVEL_DEBUG 1
+#define SHMLOG_LEVEL_INFO  2
+#define SHMLOG_LEVEL_WARN  3
+#define SHMLOG_LEVEL_ERROR 4
+#define SHMLOG_LEVEL_FATAL 5
 
 /*
  * Note: C11 atomic in shared memory
@@ -56,8 +79,65 @@ struct shmlog_header {
                              // otherwise `push` will be blocked for a moment (about 150ms) if no message is consumed, then the oldest msg will be overwritten.
 
     shmlog_atomic_headtail headtail;
+
+    // statistics of slots abandoned by dead or stuck owners
+    atomic_uint abandoned_writes; // slots skipped by consumers because the producer didn't finish writing
+    atomic_uint abandoned_reads;  // slots taken back by producers because the consumer didn't release them
+
+    atomic_int lease_hold_us;     // how long a producer waits for a slot still held by the consumer, then
+                                  // the slot is overwritten and the consumer's lease becomes invalid. 0: don't wait.
+    atomic_uint overrun_reads;    // leases invalidated by producers
+
+    // limits of call sites, override the ones given by SHMLOG_PRINTF_LIMITED. 0: use the call site's own.
+    atomic_uint site_rate;        // messages per second of each call site
+    atomic_uint site_burst;       // messages which can be written at once by a call site after it has been idle
+    atomic_uint site_sample;      // write 1 in N messages of each call site
+    atomic_uint suppressed;       // messages suppressed by the limits
+
+    // priority lane: a second ring after the main one, for messages at or above prio_level,
+    // so floods of lower levels never overwrite them. consumers drain it first.
+    uint32_t prio_nmsg;           // 0: no priority lane
+    atomic_int prio_level;
+    shmlog_atomic_headtail prio_headtail;
+
+    atomic_uint dedup_ms;         // see shmlog_set_dedup, 0: disabled
+    atomic_uint repeated;         // messages counted as repeats instead of written
+
+    // traffic counters, sampled by `shmlogtail --top`
+    atomic_ullong nwrite;         // messages committed
+    atomic_ullong nbytes;         // bytes committed
+    atomic_ullong noverwrite;     // messages overwritten before they were read
+    atomic_ullong nread;          // messages taken by consumers
+
+    atomic_int notify_armed;      // the consumer waits on its notification socket for the ring to become non-empty,
+                                  // the producer which sees it first sends one datagram, see shmlogclient_get_fd
+
+    uint32_t magic;               // SHMLOG_RING_MAGIC once initialized
+    int32_t pid;                  // pid of the process which writes the ring
+    atomic_int clean;             // persistent rings: 1 after a clean shutdown, 0 while being written
+    uint64_t ring_id;             // identity of the ring, kept by persistent rings across restarts
+
+    atomic_uint resize_nmsg;      // requested by `shmlogtail --resize`, done by the producer at its next heartbeat
+    atomic_ullong moved;          // CLOCK_MONOTONIC ns when the ring was replaced by a resized one, 0: it is current
+    atomic_uint next_ring;        // the ring which has replaced this one, SHMLOG_RESIZED_NAME, until it's drained
+    atomic_int sealed;            // a replaced ring which no writer is in any more, consumers follow once it's drained
 };
 
+/*
+ * sequence number of a message: the k-th message written into a lane is in
+ * slot k%nmsg, and that slot's gen is 2*(k/nmsg+1) once it's committed. so a
+ * consumer knows which message a slot holds, and whether it's been overwritten.
+ */
+static inline uint64_t shmlog_seq(unsigned gen, uint32_t nmsg, uint32_t idx)
+{
+    return (uint64_t)((gen + 1) / 2 - 1) * nmsg + idx;
+}
+
+static inline unsigned shmlog_seq_gen(uint64_t seq, uint32_t nmsg)
+{
+    return (unsigned)(seq / nmsg + 1) * 2;
+}
+
 struct shmlog_fullheader {
     struct shmlog_header hdr;
     uint8_t reserves[SHMLOG_MSG_SIZE-sizeof(struct shmlog_header)];
@@ -72,21 +152,184 @@ struct shmlog_msg_header {
 #else
     #error shmlog message size is too large!
 #endif
+    uint8_t type;     // SHMLOG_MSG_TEXT or SHMLOG_MSG_TRACE
+    atomic_int owner; // pid of the process which is writing the slot, or reading it after it has been filled.
+                      // the slot is abandoned if its owner dies before releasing it.
+    atomic_uint gen;  // generation, increased by 2 for each write and odd while writing.
+                      // a consumer reading in place validates its data by checking that gen is unchanged.
 };
 
 #define SHMLOG_MSG_BODY_SIZE (SHMLOG_MSG_SIZE-sizeof(struct shmlog_msg_header))
 
+#define SHMLOG_MSG_TEXT  0
+#define SHMLOG_MSG_TRACE 1 // body is a struct shmlog_trace_rec, not aligned for it: copy it out
+
 struct shmlog_msg {
     struct shmlog_msg_header hdr;
     uint8_t body[SHMLOG_MSG_BODY_SIZE];
 };
 
+/*
+ * trace records: binary events converted into a timeline by `shmlogtail --trace-out`
+ * the phases are the ones of Chrome trace event format.
+ */
+#define SHMLOG_TRACE_BEGIN    'B'
+#define SHMLOG_TRACE_END      'E'
+#define SHMLOG_TRACE_COMPLETE 'X'
+#define SHMLOG_TRACE_COUNTER  'C'
+
+struct shmlog_trace_rec {
+    uint64_t ts;      // CLOCK_MONOTONIC, ns
+    int64_t value;    // duration (ns) of a complete event, or value of a counter
+    int32_t tid;
+    char phase;
+    uint8_t name_len;
+    uint16_t reserve;
+    char name[SHMLOG_MSG_BODY_SIZE-24]; // not null-terminated
+};
+
     
 int shmlog_init(size_t nmsg, int remove_unused);
 void shmlog_uninit();
+
+struct shmlog_attr {
+    size_t nmsg;
+    int remove_unused;
+    size_t prio_nmsg; // slots of the priority lane, 0: no lane
+    int prio_level;   // messages at or above this level go to the priority lane
+    const char *path; // map the ring from this file instead of shared memory, NULL: shared memory
+};
+
+/*
+ * persistent rings: with shmlog_attr.path the ring is a regular file (or a
+ * file on a DAX filesystem, mapped with MAP_SYNC if supported), so the last
+ * messages survive a crash or a reboot without a consumer, and writes are still
+ * plain memory stores. The file is marked clean at uninit or exit. At the next
+ * init with the same path and size, the messages are kept, and if it wasn't
+ * clean, slots torn by the crash are replaced by a note. Forked children write
+ * into shared memory rings. Read it by `shmlogtail --file` or `--dump`.
+ */
+int shmlog_init_attr(const struct shmlog_attr *attr);
+void shmlog_set_prio_level(int level);
+
+/*
+ * online resize: the main lane gets nmsg slots in a new segment which replaces
+ * the ring under its name. Writers switch to it by one pointer load, the ones
+ * already in the old ring finish there. The old ring is marked moved, and
+ * consumers drain it before they follow to the new one, so no unread message
+ * is lost. Not supported by persistent rings (EOPNOTSUPP).
+ * `shmlogtail --resize` requests it at runtime, then it's done at the next
+ * heartbeat of the producer (every 256 writes of a thread).
+ */
+int shmlog_resize(size_t nmsg);
+
+/*
+ * after fork(), a child writes into its own ring, which is created at its
+ * first write with the same size. SHMLOG_FORK_INHERIT copies the runtime
+ * settings (call site limits) of the parent's ring, SHMLOG_FORK_NEW doesn't,
+ * SHMLOG_FORK_SHARE keeps writing into the parent's ring.
+ */
+#define SHMLOG_FORK_INHERIT 0 // default
+#define SHMLOG_FORK_NEW     1
+#define SHMLOG_FORK_SHARE   2
+void shmlog_set_fork_policy(int policy);
+
 int shmlog_write(const void *data, size_t len);
+// write a message in place: reserve a slot, fill at most SHMLOG_MSG_BODY_SIZE bytes into its body, then commit it.
+// every reserved slot must be committed, otherwise the consumer will wait for it.
+struct shmlog_msg *shmlog_reserve();
+void shmlog_commit(struct shmlog_msg *msg, size_t len);
 int shmlog_printf(const char *fmt, ...);
 int shmlog_vprintf(const char *fmt, va_list ap);
+// leveled writes: the same as above, but go to the priority lane at or above its level
+struct shmlog_msg *shmlog_reserve_level(int level);
+int shmlog_write_level(int level, const void *data, size_t len);
+int shmlog_printf_level(int level, const char *fmt, ...);
+int shmlog_vprintf_level(int level, const char *fmt, va_list ap);
+
+/*
+ * duplicate suppression: a message written by shmlog_write or shmlog_printf
+ * (and their leveled variants) which is identical to the previous one of the
+ * same thread is counted instead of written. A record
+ *   "[shmlog] last message repeated N times, from <first> to <last>"
+ * is written when a different message comes, when the run has lasted window_ms
+ * (by the next call of any thread, if this one doesn't log any more), or when
+ * the thread exits. Messages written in place (shmlog_reserve) are
+ * never suppressed, nor a write from a signal handler which interrupts one of
+ * the same thread. Disabled by default, `shmlogtail --dedup` sets it at runtime,
+ * and costs nothing while disabled.
+ */
+void shmlog_set_dedup(unsigned window_ms); // 0: disable
+void shmlog_flush_repeated();              // write the pending record of the calling thread
+
+/*
+ * call site limits: rate limiting (token bucket) and 1-in-N sampling
+ *
+ *   SHMLOG_PRINTF_LIMITED(100, 10, 1, "x=%d", x); // 100 msg/s, burst of 10, no sampling
+ *   SHMLOG_PRINTF_LIMITED(0, 0, 16, "x=%d", x);   // 1 in 16 messages, no rate limit
+ *
+ * A suppressed call returns 0 before formatting the message. The number of
+ * suppressed messages is written as a summary record, at most once per second,
+ * by the next admitted call of the same site, or by shmlog_flush_suppressed
+ * (called at uninit too).
+ * The limits of all sites can be overridden at runtime by `shmlogtail --limit`.
+ */
+struct shmlog_site {
+    const char *file;
+    int line;
+    unsigned rate, burst, sample; // 0: unlimited
+    atomic_ullong tat;            // theoretical arrival time of the next message (ns), see GCRA
+    atomic_uint calls;
+    atomic_uint suppressed;
+    atomic_ullong summary;        // time of the latest summary record (ns)
+    atomic_bool listed;
+    struct shmlog_site *next;     // list of sites which have suppressed messages
+};
+
+#define SHMLOG_SITE_INIT(rate, burst, sample) { __FILE__, __LINE__, (rate), (burst), (sample) }
+
+int shmlog_site_admit(struct shmlog_site *site); // return 0 if the message should be suppressed
+void shmlog_flush_suppressed();
+
+/*
+ * tracing
+ *
+ *   void handle_rpc() {
+ *       SHMLOG_TRACE_SCOPE("handle_rpc"); // a complete event from here to the end of the scope
+ *       ...
+ *       shmlog_trace_counter("queue", n);
+ *   }
+ *
+ * A record is written in place into one slot, with a cached thread id and a
+ * vDSO clock read, no formatting. Names are truncated to the record size.
+ */
+uint64_t shmlog_trace_now();
+int shmlog_trace_begin(const char *name);
+int shmlog_trace_end(const char *name); // name may be NULL
+int shmlog_trace_complete(const char *name, uint64_t start_ns); // an event from start_ns to now
+int shmlog_trace_counter(const char *name, int64_t value);
+
+struct shmlog_trace_scope {
+    const char *name;
+    uint64_t start;
+};
+
+static inline void shmlog_trace_scope_end(struct shmlog_trace_scope *scope)
+{
+    shmlog_trace_complete(scope->name, scope->start);
+}
+
+#define SHMLOG_TRACE_CONCAT_(a, b) a##b
+#define SHMLOG_TRACE_CONCAT(a, b) SHMLOG_TRACE_CONCAT_(a, b)
+#define SHMLOG_TRACE_SCOPE(name)                                                               \
+    struct shmlog_trace_scope SHMLOG_TRACE_CONCAT(__shmlog_scope_, __LINE__)                   \
+        __attribute__((cleanup(shmlog_trace_scope_end))) = { (name), shmlog_trace_now() }
+
+#define SHMLOG_PRINTF_LIMITED(rate, burst, sample, fmt, arg...)                         \
+    ({                                                                                  \
+        static struct shmlog_site __shmlog_site = SHMLOG_SITE_INIT(rate, burst, sample); \
+        shmlog_site_admit(&__shmlog_site) ? shmlog_printf(fmt, ##arg) : 0;              \
+    })
 
 #ifdef __cplusplus
 }
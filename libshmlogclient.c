@@ -3,8 +3,12 @@
 #include <string.h>
 #include <errno.h>
 #include <threads.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "libshmlogclient.h"
@@ -20,26 +24,18 @@
 #define MAKE_HT(head, tail) SHMLOG_MAKE_HT(head, tail)
 #define INTHEAD_MAX SHMLOG_INTHEAD_MAX
 
+#define SLOT_SPIN_MAX 64     // yield some times before checking the owner of a busy slot
+#define SLOT_SLEEP_US 1000
+#define LEASE_GEN_ABANDONED 1U // generations of acquired slots are even
 
-int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock)
+
+// map the ring of fd, pid <= 0: the writer's pid recorded in the ring
+static int init_fd(int fd, pid_t pid, struct shm_log_client_t *client, int nonblock)
 {
-    char filename[256];
     struct stat statbuf;
-    int errbak, fd;
+    int errbak;
     struct shmlog_header *hdr;
-    
-    if ( NULL == client ) {
-        errno = EINVAL;
-        return -1;
-    }
 
-    // open shm
-    snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", pid);
-    fd = shm_open(filename, O_RDWR, 0666);
-    if ( fd < 0 ) {
-        LOG("Error: shm_open failed! %d:%s\n", errno, strerror(errno));
-        return -1;
-    }
     if ( fstat(fd, &statbuf) < 0 ) {
         LOG("Error: fstat failed! %d:%s\n", errno, strerror(errno));
         errbak = errno;
@@ -54,7 +50,7 @@ int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock)
         return -1;
     }
     hdr = (struct shmlog_header *)mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if ( NULL == hdr ) {
+    if ( MAP_FAILED == hdr ) {
         LOG("Error: mmap failed! %d:%s\n", errno, strerror(errno));
         errbak = errno;
         close(fd);
@@ -64,21 +60,32 @@ int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock)
     close(fd);
 
     // check ring buffer
-    if ( (sizeof(struct shmlog_fullheader) + hdr->nmsg * sizeof(struct shmlog_msg)) > statbuf.st_size ) {
+    if ( (sizeof(struct shmlog_fullheader) + ((size_t)hdr->nmsg + hdr->prio_nmsg) * sizeof(struct shmlog_msg)) > statbuf.st_size ) {
         LOG("Error: invalid shm size %lu\n", statbuf.st_size);
         munmap((void*)hdr, statbuf.st_size);
         errno = ENOMEM;
         return -1;
     }
 
-    client->pid = pid;
+    client->pid = (pid > 0) ? pid : hdr->pid;
     client->size = statbuf.st_size;
     client->hdr = hdr;
     client->msgs = (struct shmlog_msg *)((uint8_t*)hdr + sizeof(struct shmlog_fullheader));
     client->last_head = GET_HEAD(atomic_load(&hdr->headtail));
+    client->prio_last_head = GET_HEAD(atomic_load(&hdr->prio_headtail));
     client->nonblock = nonblock;
     client->pid_self = getpid();
     client->remain = 0;
+    client->notify_fd = -1;
+    client->held = 0;
+    memset(client->replay_seq, 0, sizeof(client->replay_seq));
+    memset(client->replay_end, 0, sizeof(client->replay_end));
+    client->lease_gen = calloc(hdr->nmsg + hdr->prio_nmsg, sizeof(unsigned));
+    if ( NULL == client->lease_gen ) {
+        munmap((void*)hdr, statbuf.st_size);
+        errno = ENOMEM;
+        return -1;
+    }
 
     if ( !nonblock ) {
         // register consumer if there is no one. this will block producer for a moment if queue is full
@@ -89,6 +96,49 @@ int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock)
     return 0;
 }
 
+int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock)
+{
+    char filename[256];
+    int fd;
+
+    if ( NULL == client ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // open shm
+    snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", pid);
+    fd = shm_open(filename, O_RDWR, 0666);
+    if ( fd < 0 ) {
+        LOG("Error: shm_open failed! %d:%s\n", errno, strerror(errno));
+        return -1;
+    }
+    return init_fd(fd, pid, client, nonblock);
+}
+
+int shmlogclient_init_file(const char *path, struct shm_log_client_t *client, int nonblock)
+{
+    struct shmlog_header hdr;
+    int fd;
+
+    if ( NULL == path || NULL == client ) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if ( fd < 0 ) {
+        LOG("Error: open '%s' failed! %d:%s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    if ( pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || SHMLOG_RING_MAGIC != hdr.magic ) {
+        LOG("Error: '%s' is not a shmlog ring!\n", path);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return init_fd(fd, 0, client, nonblock);
+}
+
 void shmlogclient_uninit(struct shm_log_client_t *client)
 {
     struct shmlog_header *hdr;
@@ -99,36 +149,229 @@ void shmlogclient_uninit(struct shm_log_client_t *client)
         // unregister consumer
         int consumer_pid_old = client->pid_self;
         atomic_compare_exchange_strong(&hdr->consumer_pid, &consumer_pid_old, 0);
+        if ( client->notify_fd >= 0 ) {
+            atomic_store(&hdr->notify_armed, 0);
+            close(client->notify_fd);
+            client->notify_fd = -1;
+        }
         //
         munmap((void*)hdr, client->size);
+        free(client->lease_gen);
+        client->lease_gen = NULL;
     }
 }
 
-int shmlogclient_read(struct shm_log_client_t *client, void *buf, size_t size, size_t *lost, int timeout_us)
+int shmlogclient_get_fd(struct shm_log_client_t *client)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int fd, errbak;
+    if ( NULL == client ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( client->notify_fd >= 0 ) {
+        return client->notify_fd;
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if ( fd < 0 ) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 +
+              snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, SHMLOG_NOTIFY_NAME, client->pid);
+    if ( bind(fd, (struct sockaddr *)&addr, addrlen) < 0 ) {
+        LOG("Error: bind notification socket failed! %d:%s\n", errno, strerror(errno));
+        errbak = errno;
+        close(fd);
+        errno = errbak;
+        return -1;
+    }
+    client->notify_fd = fd;
+    return fd;
+}
+
+int shmlogclient_arm(struct shm_log_client_t *client)
 {
     struct shmlog_header *hdr;
-    struct shmlog_msg *msgs;
-    shmlog_int_headtail ht_old, ht_new;
-    shmlog_int_head head, tail, head_new, tail_new;
-    bool empty;
-    int empty_wait, total_wait, len;
+    shmlog_int_headtail ht, prio_ht;
+    char buf[64];
+    if ( NULL == client || client->notify_fd < 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    hdr = client->hdr;
+    while ( recv(client->notify_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0 );
+    atomic_store(&hdr->notify_armed, 1);
+    // pairs with shmlog_commit: either we see the message, or the producer sees it armed
+    ht = atomic_load(&hdr->headtail);
+    prio_ht = atomic_load(&hdr->prio_headtail);
+    // a resized ring isn't written any more, read on to follow the producer
+    if ( GET_HEAD(ht) != GET_TAIL(ht) || GET_HEAD(prio_ht) != GET_TAIL(prio_ht) || atomic_load(&hdr->moved) != 0 ) {
+        atomic_store(&hdr->notify_armed, 0);
+        return 1;
+    }
+    return 0;
+}
+
+int shmlogclient_set_lease_hold(struct shm_log_client_t *client, int hold_us)
+{
+    if ( NULL == client || hold_us < 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&client->hdr->lease_hold_us, hold_us);
+    return 0;
+}
+
+int shmlogclient_set_site_limit(struct shm_log_client_t *client, unsigned rate, unsigned burst, unsigned sample)
+{
     if ( NULL == client ) {
         errno = EINVAL;
         return -1;
     }
-    if ( NULL != lost ) {
-        *lost = 0;
+    atomic_store(&client->hdr->site_rate, rate);
+    atomic_store(&client->hdr->site_burst, burst);
+    atomic_store(&client->hdr->site_sample, sample);
+    return 0;
+}
+
+int shmlogclient_set_dedup(struct shm_log_client_t *client, unsigned window_ms)
+{
+    if ( NULL == client ) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&client->hdr->dedup_ms, window_ms);
+    return 0;
+}
+
+int shmlogclient_resize(struct shm_log_client_t *client, unsigned nmsg)
+{
+    if ( NULL == client || 0 == nmsg ) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&client->hdr->resize_nmsg, nmsg);
+    return 0;
+}
+
+/*
+ * wait for the producer to fill the slot, take the ownership of it and
+ * remember its generation.
+ * return -1 if the producer is dead, the slot is abandoned. a live one is waited
+ * for however long it takes, it may be stopped or debugged: a slot abandoned under
+ * it would be committed late. only a slot which no producer has marked is
+ * abandoned after SHMLOG_SLOT_TIMEOUT_US.
+ */
+static int acquire_slot(struct shm_log_client_t *client, uint32_t id)
+{
+    struct shmlog_msg *msg = &client->msgs[id];
+    int spin = 0, wait = 0;
+    unsigned gen;
+    pid_t owner;
+    client->lease_gen[id] = LEASE_GEN_ABANDONED;
+    while ( !atomic_load(&msg->hdr.filled) ) {
+        if ( spin < SLOT_SPIN_MAX ) {
+            spin++;
+            thrd_yield();
+            continue;
+        }
+        owner = atomic_load(&msg->hdr.owner);
+        if ( (owner > 0 && kill(owner, 0) < 0 && ESRCH == errno) || (owner <= 0 && wait >= SHMLOG_SLOT_TIMEOUT_US) ) {
+            // finish the generation on behalf of the producer, so it still counts writes
+            gen = atomic_load(&msg->hdr.gen);
+            atomic_compare_exchange_strong(&msg->hdr.gen, &gen, (gen & 1) ? gen + 1 : gen + 2);
+            atomic_fetch_add(&client->hdr->abandoned_writes, 1);
+            LOG("Warning: slot %u is abandoned by producer %d!\n", id, owner);
+            return -1;
+        }
+        if ( wait == SHMLOG_SLOT_TIMEOUT_US ) {
+            LOG("Warning: slot %u is still being written by producer %d!\n", id, owner);
+        }
+        usleep(SLOT_SLEEP_US);
+        wait += SLOT_SLEEP_US;
+    }
+    gen = atomic_load(&msg->hdr.gen);
+    owner = atomic_load(&msg->hdr.owner);
+    // fails only if a producer has taken the slot back, we are too slow
+    if ( !atomic_compare_exchange_strong(&msg->hdr.owner, &owner, client->pid_self) ) {
+        return -1;
+    }
+    // the owner may be the same pid as a producer which has just started to overwrite the slot,
+    // then the slot is left to it
+    if ( (gen & 1) || atomic_load(&msg->hdr.gen) != gen ) {
+        return -1;
+    }
+    client->lease_gen[id] = gen;
+    return 0;
+}
+
+// whether data of the slot is still what it was when acquired
+static inline int slot_valid(struct shm_log_client_t *client, uint32_t id)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load(&client->msgs[id].hdr.gen) == client->lease_gen[id];
+}
+
+// return 1 if the slot has been overwritten by a producer, otherwise 0
+static int release_slot(struct shm_log_client_t *client, uint32_t id)
+{
+    struct shmlog_msg *msg = &client->msgs[id];
+    pid_t owner = client->pid_self;
+    if ( LEASE_GEN_ABANDONED == client->lease_gen[id] ) {
+        return 0;
+    }
+    // don't touch the slot if a producer has taken it back
+    if ( atomic_compare_exchange_strong(&msg->hdr.owner, &owner, 0) ) {
+        atomic_store(&msg->hdr.filled, false);
+        return 0;
     }
+    return 1;
+}
+
+// the slots of the priority lane follow the main ones
+static inline uint32_t lane_base(struct shm_log_client_t *client, int lane)
+{
+    return (SHMLOG_LANE_PRIO == lane) ? client->hdr->nmsg : 0;
+}
+
+static inline uint32_t lane_nmsg(struct shm_log_client_t *client, int lane)
+{
+    return (SHMLOG_LANE_PRIO == lane) ? client->hdr->prio_nmsg : client->hdr->nmsg;
+}
+
+/*
+ * remove at most `max` oldest messages from a lane by one CAS and acquire
+ * them, return the number of messages and the index of the first one.
+ * the slots are acquired while they are still in the ring buffer, where
+ * producers only remove the oldest ones when it is full. once removed from the
+ * ring buffer, a slot may be overwritten by a producer at any time, then we
+ * would take its new message which is still in the ring buffer.
+ * abandoned slots are counted in `lost`. return -1 with EAGAIN if the lane is empty.
+ */
+static int take_range(struct shm_log_client_t *client, int lane, int max, uint32_t *first, size_t *lost)
+{
+    struct shmlog_header *hdr;
+    shmlog_atomic_headtail *headtail;
+    shmlog_int_headtail ht_old, ht_new;
+    shmlog_int_head head, tail, head_new, tail_new, n, *last_head;
+    uint32_t start, done, d, nmsg, base;
+    bool retry;
     hdr = client->hdr;
-    msgs = client->msgs;
+    headtail = (SHMLOG_LANE_PRIO == lane) ? &hdr->prio_headtail : &hdr->headtail;
+    last_head = (SHMLOG_LANE_PRIO == lane) ? &client->prio_last_head : &client->last_head;
+    nmsg = lane_nmsg(client, lane);
+    base = lane_base(client, lane);
     if ( !client->nonblock ) {
         // register consumer if there is no one. this will block producer for a moment if queue is full
         int consumer_pid_old = 0;
         atomic_compare_exchange_strong(&hdr->consumer_pid, &consumer_pid_old, client->pid_self);
     }
-    empty_wait = 1;
-    total_wait = 0;
-    ht_old = atomic_load(&hdr->headtail);
+    start = 0; // slots [start, start+done) have been acquired
+    done = 0;
+    ht_old = atomic_load(headtail);
     do {
         head = GET_HEAD(ht_old);
         tail = GET_TAIL(ht_old);
@@ -136,129 +379,480 @@ int shmlogclient_read(struct shm_log_client_t *client, void *buf, size_t size, s
             LOG("[dengjfzh/libshmlogclient] Internal Error: head(%u) > tail(%u)! %s:%d\n", head, tail, __FILE__, __LINE__);
             abort();
         }
+        // slots removed by producers since the last try are theirs now
+        d = (head % nmsg + nmsg - start) % nmsg;
+        done = (d < done) ? done - d : 0;
+        start = head % nmsg;
         if ( head == tail ) { // empty
-            if ( timeout_us >= 0 && total_wait >= timeout_us ) {
-                errno = ETIMEDOUT;
-                return -1;
-            }
-            empty = true;
-            if ( empty_wait < 65536 ) {
-                empty_wait *= 2;
+            errno = EAGAIN;
+            return -1;
+        }
+        retry = false;
+        n = tail - head;
+        if ( n > max ) {
+            n = max;
+        }
+        if ( done < n ) {
+            for ( ; done < n; done++ ) {
+                acquire_slot(client, base + (start + done) % nmsg);
             }
-            usleep(empty_wait);
-            total_wait += empty_wait;
-            ht_old = atomic_load(&hdr->headtail);
+            ht_old = atomic_load(headtail); // it may take a while
+            retry = true; // check the range again
             continue;
         }
-        empty = false;
-        empty_wait = 1;
-        head_new = head + 1;
+        head_new = head + n;
         tail_new = tail;
-        if ( head_new >= hdr->nmsg ) {
-            shmlog_int_head tmp = (head_new / hdr->nmsg) * hdr->nmsg;
+        if ( head_new >= nmsg ) {
+            shmlog_int_head tmp = (head_new / nmsg) * nmsg;
             head_new -= tmp;
             tail_new -= tmp;
         }
         ht_new = MAKE_HT(head_new, tail_new);
-    } while ( empty || !atomic_compare_exchange_weak(&hdr->headtail, &ht_old, ht_new) );
-    if ( NULL != lost ) {
-        *lost = head + ((head<client->last_head) ? hdr->nmsg : 0) - client->last_head;
+    } while ( retry || !atomic_compare_exchange_weak(headtail, &ht_old, ht_new) );
+    atomic_fetch_add_explicit(&hdr->nread, n, memory_order_relaxed);
+    *lost += head + ((head<*last_head) ? nmsg : 0) - *last_head;
+    *last_head = head_new;
+    if ( SHMLOG_LANE_MAIN == lane ) {
+        client->remain = tail_new - head_new;
     }
-    client->last_head = head_new;
-    client->remain = tail_new - head_new;
-    if ( head >= hdr->nmsg ) {
-        head %= hdr->nmsg;
+    *first = base + start;
+    for ( uint32_t i = 0; i < n; i++ ) {
+        if ( LEASE_GEN_ABANDONED == client->lease_gen[base + (start + i) % nmsg] ) {
+            (*lost)++;
+        }
     }
-    while ( !atomic_load(&msgs[head].hdr.filled) ){
-        thrd_yield();
+    return n;
+}
+
+// the producer has moved to a resized ring, and nothing is left in this one
+static int ring_moved(struct shm_log_client_t *client)
+{
+    struct shmlog_header *hdr = client->hdr;
+    const uint64_t moved = atomic_load(&hdr->moved);
+    shmlog_int_headtail ht, prio_ht;
+    struct timespec ts;
+    if ( 0 == moved || client->held > 0 ) {
+        return 0;
     }
-    len = (msgs[head].hdr.len < size) ? (int)(msgs[head].hdr.len) : (int)(size);
-    memcpy(buf, msgs[head].body, len);
-    atomic_store(&msgs[head].hdr.filled, false);
-    return len;
+    ht = atomic_load(&hdr->headtail);
+    prio_ht = atomic_load(&hdr->prio_headtail);
+    if ( GET_HEAD(ht) != GET_TAIL(ht) || GET_HEAD(prio_ht) != GET_TAIL(prio_ht) ) {
+        return 0;
+    }
+    // writers which entered the old ring just before the switch may still be reserving slots in it,
+    // until the producer seals it
+    if ( atomic_load(&hdr->sealed) ) {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - moved >= SHMLOG_RESIZE_GRACE_US * 1000ULL;
 }
 
-int shmlogclient_zerocopy_read(struct shm_log_client_t *client, void **pbuf, size_t *plen, size_t *lost, int timeout_us)
+// map the ring which has replaced the current one, by its own name while it's kept by the producer,
+// otherwise it has been drained and the latest one under the producer's name is followed
+static int follow(struct shm_log_client_t *client)
 {
-    struct shmlog_header *hdr;
-    struct shmlog_msg *msgs;
-    shmlog_int_headtail ht_old, ht_new;
-    shmlog_int_head head, tail, head_new, tail_new;
-    bool empty;
-    int empty_wait, total_wait;
-    if ( NULL == client ) {
-        errno = EINVAL;
+    const unsigned next_ring = atomic_load(&client->hdr->next_ring);
+    struct shm_log_client_t next;
+    char filename[256];
+    int fd = -1, consumer_pid_old;
+    if ( next_ring > 0 ) {
+        snprintf(filename, sizeof(filename), SHMLOG_RESIZED_NAME, client->pid, next_ring);
+        fd = shm_open(filename, O_RDWR, 0666);
+    }
+    if ( fd < 0 ) {
+        snprintf(filename, sizeof(filename), SHMLOG_FILE_PREFIX "%d", client->pid);
+        fd = shm_open(filename, O_RDWR, 0666);
+    }
+    if ( fd < 0 ) {
+        LOG("Error: shm_open resized ring failed! %d:%s\n", errno, strerror(errno));
         return -1;
     }
-    if ( NULL != lost ) {
-        *lost = 0;
+    if ( init_fd(fd, client->pid, &next, client->nonblock) < 0 ) {
+        return -1;
     }
-    hdr = client->hdr;
-    msgs = client->msgs;
-    if ( !client->nonblock ) {
-        // register consumer if there is no one. this will block producer for a moment if queue is full
-        int consumer_pid_old = 0;
-        atomic_compare_exchange_strong(&hdr->consumer_pid, &consumer_pid_old, client->pid_self);
+    // unregister from the old ring, the new one has the same consumer
+    consumer_pid_old = client->pid_self;
+    atomic_compare_exchange_strong(&client->hdr->consumer_pid, &consumer_pid_old, 0);
+    if ( client->notify_fd >= 0 ) {
+        atomic_store(&client->hdr->notify_armed, 0);
+        next.notify_fd = client->notify_fd;
+    }
+    munmap((void*)client->hdr, client->size);
+    free(client->lease_gen);
+    // messages overwritten before following are lost
+    next.last_head = 0;
+    next.prio_last_head = 0;
+    *client = next;
+    return 0;
+}
+
+/*
+ * take_range from the priority lane if it isn't empty, otherwise from the main
+ * one, and wait for both if they are empty. SHMLOG_LANE_ANY is passed in *lane,
+ * and the lane taken is returned in it. once a resized ring is drained, the
+ * new one is followed.
+ */
+static int take_lanes(struct shm_log_client_t *client, int *lane, int max, uint32_t *first, size_t *lost, int timeout_us)
+{
+    const int any = (SHMLOG_LANE_ANY == *lane);
+    int empty_wait, total_wait, n;
+    if ( !any && 0 == lane_nmsg(client, *lane) ) {
+        errno = EINVAL;
+        return -1;
     }
     empty_wait = 1;
     total_wait = 0;
-    ht_old = atomic_load(&hdr->headtail);
-    do {
-        head = GET_HEAD(ht_old);
-        tail = GET_TAIL(ht_old);
-        if ( head > tail ) {
-            LOG("[dengjfzh/libshmlogclient] Internal Error: head(%u) > tail(%u)! %s:%d\n", head, tail, __FILE__, __LINE__);
-            abort();
-        }
-        if ( head == tail ) { // empty
-            if ( timeout_us >= 0 && total_wait >= timeout_us ) {
-                errno = ETIMEDOUT;
-                return -1;
-            }
-            empty = true;
-            if ( empty_wait < 65536 ) {
-                empty_wait *= 2;
+    for ( ;; ) {
+        if ( any && client->hdr->prio_nmsg > 0 ) {
+            *lane = SHMLOG_LANE_PRIO;
+            n = take_range(client, SHMLOG_LANE_PRIO, max, first, lost);
+            if ( n >= 0 || EAGAIN != errno ) {
+                return n;
             }
-            usleep(empty_wait);
-            total_wait += empty_wait;
-            ht_old = atomic_load(&hdr->headtail);
+        }
+        if ( any ) {
+            *lane = SHMLOG_LANE_MAIN;
+        }
+        n = take_range(client, *lane, max, first, lost);
+        if ( n >= 0 || EAGAIN != errno ) {
+            return n;
+        }
+        if ( ring_moved(client) && 0 == follow(client) ) {
+            empty_wait = 1;
             continue;
         }
-        empty = false;
-        empty_wait = 1;
-        head_new = head + 1;
-        tail_new = tail;
-        if ( head_new >= hdr->nmsg ) {
-            shmlog_int_head tmp = (head_new / hdr->nmsg) * hdr->nmsg;
-            head_new -= tmp;
-            tail_new -= tmp;
+        if ( timeout_us >= 0 && total_wait >= timeout_us ) {
+            errno = ETIMEDOUT;
+            return -1;
         }
-        ht_new = MAKE_HT(head_new, tail_new);
-    } while ( empty || !atomic_compare_exchange_weak(&hdr->headtail, &ht_old, ht_new) );
+        if ( empty_wait < 65536 ) {
+            empty_wait *= 2;
+        }
+        usleep(empty_wait);
+        total_wait += empty_wait;
+    }
+}
+
+// remove the oldest message from ring buffer and acquire it, return its index
+static int take_head(struct shm_log_client_t *client, size_t *lost, int timeout_us)
+{
+    size_t lost_local = 0;
+    uint32_t id;
+    int lane;
+    if ( NULL == client ) {
+        errno = EINVAL;
+        return -1;
+    }
+    for ( ;; ) {
+        lane = SHMLOG_LANE_ANY;
+        if ( take_lanes(client, &lane, 1, &id, &lost_local, timeout_us) < 0 ) {
+            break;
+        }
+        if ( LEASE_GEN_ABANDONED != client->lease_gen[id] ) {
+            if ( NULL != lost ) {
+                *lost = lost_local;
+            }
+            return id;
+        }
+    }
     if ( NULL != lost ) {
-        *lost = head + ((head<client->last_head) ? hdr->nmsg : 0) - client->last_head;
+        *lost = lost_local;
     }
-    client->last_head = head_new;
-    client->remain = tail_new - head_new;
-    if ( head >= hdr->nmsg ) {
-        head %= hdr->nmsg;
+    return -1;
+}
+
+int shmlogclient_read(struct shm_log_client_t *client, void *buf, size_t size, size_t *lost, int timeout_us)
+{
+    struct shmlog_msg *msg;
+    size_t lost_local = 0, lost_once;
+    int id, len;
+    for ( ;; ) {
+        id = take_head(client, &lost_once, timeout_us);
+        lost_local += lost_once;
+        if ( id < 0 ) {
+            len = -1;
+            break;
+        }
+        msg = &client->msgs[id];
+        len = (msg->hdr.len < size) ? (int)(msg->hdr.len) : (int)(size);
+        memcpy(buf, msg->body, len);
+        // the copy is torn if a producer overwrote the slot meanwhile
+        if ( slot_valid(client, id) && 0 == release_slot(client, id) ) {
+            break;
+        }
+        lost_local++;
     }
-    while ( !atomic_load(&msgs[head].hdr.filled) ){
-        thrd_yield();
+    if ( NULL != lost ) {
+        *lost = lost_local;
+    }
+    return len;
+}
+
+int shmlogclient_zerocopy_read(struct shm_log_client_t *client, void **pbuf, size_t *plen, size_t *lost, int timeout_us)
+{
+    struct shmlog_msg *msg;
+    int id;
+    id = take_head(client, lost, timeout_us);
+    if ( id < 0 ) {
+        return -1;
     }
+    client->held++;
+    msg = &client->msgs[id];
     if ( NULL != plen )
-        *plen = msgs[head].hdr.len;
+        *plen = msg->hdr.len;
     if ( NULL != pbuf )
-        *pbuf = msgs[head].body;
-    return head;
+        *pbuf = msg->body;
+    return id;
 }
 
 int shmlogclient_zerocopy_free(struct shm_log_client_t *client, shmlog_int_headtail bufid)
 {
-    if ( NULL == client ) {
+    if ( NULL == client || bufid >= (client->hdr->nmsg + client->hdr->prio_nmsg) ) {
         errno = EINVAL;
         return -1;
     }
-    atomic_store(&client->msgs[bufid].hdr.filled, false);
+    client->held--;
+    // a producer has taken the slot, it's not ours to release any more
+    if ( !slot_valid(client, bufid) ) {
+        return SHMLOG_LEASE_INVALIDATED;
+    }
+    return release_slot(client, bufid) ? SHMLOG_LEASE_INVALIDATED : 0;
+}
+
+int shmlogclient_lease_acquire_lane(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int lane, int max, int timeout_us)
+{
+    int n;
+    if ( NULL == client || NULL == lease || max <= 0 || lane < SHMLOG_LANE_ANY || lane > SHMLOG_LANE_PRIO ) {
+        errno = EINVAL;
+        return -1;
+    }
+    lease->count = 0;
+    lease->lane = lane;
+    lease->lost = 0;
+    n = take_lanes(client, &lease->lane, max, &lease->first, &lease->lost, timeout_us);
+    if ( n < 0 ) {
+        return -1;
+    }
+    lease->count = n;
+    client->held++;
+    return n;
+}
+
+int shmlogclient_lease_acquire(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int max, int timeout_us)
+{
+    return shmlogclient_lease_acquire_lane(client, lease, SHMLOG_LANE_ANY, max, timeout_us);
+}
+
+// slot index of the i-th message of a lease
+static inline uint32_t lease_slot(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, int i)
+{
+    const uint32_t base = lane_base(client, lease->lane), nmsg = lane_nmsg(client, lease->lane);
+    return base + (lease->first - base + i) % nmsg;
+}
+
+struct shmlog_msg *shmlogclient_lease_msg(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, int i)
+{
+    uint32_t id = lease_slot(client, lease, i);
+    if ( LEASE_GEN_ABANDONED == client->lease_gen[id] ) {
+        return NULL;
+    }
+    return &client->msgs[id];
+}
+
+int shmlogclient_lease_valid(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, int i)
+{
+    uint32_t id = lease_slot(client, lease, i);
+    return LEASE_GEN_ABANDONED != client->lease_gen[id] && slot_valid(client, id);
+}
+
+int shmlogclient_lease_release(struct shm_log_client_t *client, struct shmlog_lease_t *lease)
+{
+    uint32_t id;
+    int invalidated = 0;
+    if ( NULL == client || NULL == lease ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( lease->count > 0 ) {
+        client->held--;
+    }
+    for ( int i = 0; i < lease->count; i++ ) {
+        id = lease_slot(client, lease, i);
+        if ( LEASE_GEN_ABANDONED == client->lease_gen[id] ) {
+            continue;
+        }
+        // an overwritten slot is the producer's, even if the owner is the same pid
+        if ( !slot_valid(client, id) ) {
+            invalidated++;
+        } else {
+            invalidated += release_slot(client, id);
+        }
+    }
+    lease->count = 0;
+    return invalidated;
+}
+
+// sequence number of the message at the head of a lane, headtail is returned in *pht
+static uint64_t lane_head_seq(struct shm_log_client_t *client, int lane, shmlog_int_headtail *pht)
+{
+    shmlog_atomic_headtail *headtail = (SHMLOG_LANE_PRIO == lane) ? &client->hdr->prio_headtail : &client->hdr->headtail;
+    const uint32_t nmsg = lane_nmsg(client, lane), base = lane_base(client, lane);
+    shmlog_int_headtail ht;
+    shmlog_int_head head, tail;
+    uint32_t last;
+    unsigned gen;
+    // the latest reserved slot tells the sequence, read it again if it's been passed meanwhile
+    do {
+        ht = atomic_load(headtail);
+        head = GET_HEAD(ht);
+        tail = GET_TAIL(ht);
+        last = (tail + nmsg - 1) % nmsg;
+        gen = atomic_load(&client->msgs[base + last].hdr.gen);
+    } while ( atomic_load(headtail) != ht );
+    *pht = ht;
+    if ( gen < 2 && !(gen & 1) ) { // never written
+        return 0;
+    }
+    return shmlog_seq(gen, nmsg, last) + 1 - (tail - head);
+}
+
+int shmlogclient_checkpoint_init(struct shm_log_client_t *client, struct shmlog_checkpoint_t *ckpt)
+{
+    shmlog_int_headtail ht;
+    if ( NULL == client || NULL == ckpt ) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(ckpt, 0, sizeof(*ckpt));
+    ckpt->magic = SHMLOG_CHECKPOINT_MAGIC;
+    ckpt->pid = client->pid;
+    ckpt->ring_id = client->hdr->ring_id;
+    ckpt->seq[SHMLOG_LANE_MAIN] = lane_head_seq(client, SHMLOG_LANE_MAIN, &ht);
+    if ( client->hdr->prio_nmsg > 0 ) {
+        ckpt->seq[SHMLOG_LANE_PRIO] = lane_head_seq(client, SHMLOG_LANE_PRIO, &ht);
+    }
+    return 0;
+}
+
+int shmlogclient_lease_seq(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, uint64_t *seq)
+{
+    const uint32_t nmsg = lane_nmsg(client, lease->lane), base = lane_base(client, lease->lane);
+    uint32_t id;
+    // messages of a lease are consecutive, any acquired one tells the sequence of all
+    for ( int i = 0; i < lease->count; i++ ) {
+        id = lease_slot(client, lease, i);
+        if ( LEASE_GEN_ABANDONED != client->lease_gen[id] ) {
+            *seq = shmlog_seq(client->lease_gen[id], nmsg, id - base) - i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void shmlogclient_checkpoint_update(struct shm_log_client_t *client, struct shmlog_checkpoint_t *ckpt, const struct shmlog_lease_t *lease)
+{
+    uint64_t next;
+    // the producer has moved to a resized ring, sequences start over in it
+    if ( ckpt->ring_id != client->hdr->ring_id ) {
+        ckpt->ring_id = client->hdr->ring_id;
+        memset(ckpt->seq, 0, sizeof(ckpt->seq));
+    }
+    if ( shmlogclient_lease_seq(client, lease, &next) == 0 && next + lease->count > ckpt->seq[lease->lane] ) {
+        ckpt->seq[lease->lane] = next + lease->count;
+    }
+}
+
+int shmlogclient_resume(struct shm_log_client_t *client, const struct shmlog_checkpoint_t *ckpt, uint64_t *gap)
+{
+    shmlog_int_headtail ht;
+    uint64_t start, end;
+    uint32_t nmsg;
+    if ( NULL == client || NULL == ckpt || NULL == gap ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( SHMLOG_CHECKPOINT_MAGIC != ckpt->magic || ckpt->pid != client->pid || ckpt->ring_id != client->hdr->ring_id ) {
+        errno = ESTALE;
+        return -1;
+    }
+    *gap = 0;
+    for ( int lane = SHMLOG_LANE_MAIN; lane <= SHMLOG_LANE_PRIO; lane++ ) {
+        nmsg = lane_nmsg(client, lane);
+        if ( 0 == nmsg ) {
+            continue;
+        }
+        // messages before the head have been taken, the ones after the checkpoint haven't been output.
+        // only the latest nmsg ones may be still in their slots
+        end = lane_head_seq(client, lane, &ht);
+        start = (ckpt->seq[lane] < end) ? ckpt->seq[lane] : end;
+        if ( end - start > nmsg ) {
+            *gap += end - nmsg - start;
+            start = end - nmsg;
+        }
+        client->replay_seq[lane] = start;
+        client->replay_end[lane] = end;
+        if ( SHMLOG_LANE_PRIO == lane ) {
+            client->prio_last_head = GET_HEAD(ht);
+        } else {
+            client->last_head = GET_HEAD(ht);
+        }
+    }
+    return 0;
+}
+
+// acquire a slot out of the ring if it still holds the message of generation `gen`
+static int acquire_replay(struct shm_log_client_t *client, uint32_t id, unsigned gen)
+{
+    struct shmlog_msg *msg = &client->msgs[id];
+    pid_t owner;
+    client->lease_gen[id] = LEASE_GEN_ABANDONED;
+    if ( atomic_load(&msg->hdr.gen) != gen ) {
+        return -1;
+    }
+    // the owner is the previous consumer, or none if it has been released
+    owner = atomic_load(&msg->hdr.owner);
+    if ( !atomic_compare_exchange_strong(&msg->hdr.owner, &owner, client->pid_self) ) {
+        return -1;
+    }
+    // a producer may have started to overwrite it, gen is changed before owner
+    if ( atomic_load(&msg->hdr.gen) != gen ) {
+        return -1;
+    }
+    client->lease_gen[id] = gen;
+    return 0;
+}
+
+int shmlogclient_lease_resume(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int max)
+{
+    uint64_t seq;
+    uint32_t nmsg, base;
+    int n;
+    if ( NULL == client || NULL == lease || max <= 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    lease->count = 0;
+    lease->lost = 0;
+    for ( int lane = SHMLOG_LANE_PRIO; lane >= SHMLOG_LANE_MAIN; lane-- ) {
+        seq = client->replay_seq[lane];
+        if ( seq >= client->replay_end[lane] ) {
+            continue;
+        }
+        nmsg = lane_nmsg(client, lane);
+        base = lane_base(client, lane);
+        n = (client->replay_end[lane] - seq < (uint64_t)max) ? (int)(client->replay_end[lane] - seq) : max;
+        for ( int i = 0; i < n; i++ ) {
+            if ( acquire_replay(client, base + (seq + i) % nmsg, shmlog_seq_gen(seq + i, nmsg)) < 0 ) {
+                lease->lost++;
+            }
+        }
+        client->replay_seq[lane] += n;
+        lease->lane = lane;
+        lease->first = base + seq % nmsg;
+        lease->count = n;
+        client->held++;
+        return n;
+    }
     return 0;
 }
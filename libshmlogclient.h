@@ -1,31 +1,135 @@
 #ifndef __DENGJFZH_SHMLOGCLIENT_H__
 #define __DENGJFZH_SHMLOGCLIENT_H__
 
+#include <sys/types.h>
+#include "libshmlog.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#include <sys/types.h>
-#include "libshmlog.h"
-
 struct shm_log_client_t {
     pid_t pid;
     size_t size;
     struct shmlog_header *hdr;
     struct shmlog_msg *msgs;
     shmlog_int_head last_head;
+    shmlog_int_head prio_last_head; // last_head of the priority lane
     int nonblock;
     pid_t pid_self;
-    shmlog_int_head remain; // the number of remaining message in buffer after reading
+    shmlog_int_head remain; // the number of remaining message in the main lane after reading
+    unsigned *lease_gen;    // generations of acquired slots, to check if they are overwritten by producers
+    int notify_fd;          // see shmlogclient_get_fd, -1 if not created
+    uint64_t replay_seq[2]; // messages [replay_seq, replay_end) of each lane are left to replay, see shmlogclient_resume
+    uint64_t replay_end[2];
+    int held;               // leases and zero-copy buffers not released, a resized ring isn't left until they are
+};
+
+/*
+ * lease: zero-copy read of a range of messages
+ *
+ * Messages are removed from the ring buffer by one CAS and stay in place until
+ * the lease is released. Producers don't wait for leased slots (unless a hold
+ * time is set by shmlogclient_set_lease_hold), they overwrite them when the
+ * ring buffer wraps, then the lease is invalidated. Check a message with
+ * shmlogclient_lease_valid after processing it, and the release returns the
+ * number of invalidated messages.
+ */
+#define SHMLOG_LEASE_INVALIDATED 1
+
+// lanes of a ring, see shmlog_init_attr. the priority lane is always drained first
+#define SHMLOG_LANE_ANY  -1
+#define SHMLOG_LANE_MAIN 0
+#define SHMLOG_LANE_PRIO 1
+
+struct shmlog_lease_t {
+    uint32_t first; // slot index of the first message, use shmlogclient_lease_msg to get the i-th one
+    int count;      // the number of messages
+    int lane;       // SHMLOG_LANE_MAIN or SHMLOG_LANE_PRIO
+    size_t lost;    // messages lost before and in this lease (slots abandoned by dead producers)
 };
 
+/*
+ * notification: wait for many rings in one poll/epoll loop
+ *
+ *   fd = shmlogclient_get_fd(client);    // add it to epoll, EPOLLIN
+ *   for ( ;; ) {
+ *       while ( shmlogclient_read(client, buf, size, &lost, 0) >= 0 ) { ... }
+ *       if ( shmlogclient_arm(client) == 0 )
+ *           epoll_wait(...);              // readable when the ring becomes non-empty
+ *   }
+ *
+ * The fd is an abstract unix datagram socket named after the ring. Producers
+ * only check a flag in the ring header on commit, and the first one which sees
+ * it armed sends one datagram, so there is no syscall while the consumer is busy.
+ * One consumer per ring.
+ */
+int shmlogclient_get_fd(struct shm_log_client_t *client); // return the fd or -1 on error
+// drain the fd and arm it, return 0 if the ring is empty then the fd becomes readable
+// when it isn't, or 1 if it isn't empty already, or -1 on error
+int shmlogclient_arm(struct shm_log_client_t *client);
+
 int shmlogclient_init(pid_t pid, struct shm_log_client_t *client, int nonblock);
+// a persistent ring, see shmlog_attr.path
+int shmlogclient_init_file(const char *path, struct shm_log_client_t *client, int nonblock);
 void shmlogclient_uninit(struct shm_log_client_t *client);
 int shmlogclient_read(struct shm_log_client_t *client, void *buf, size_t size, size_t *lost, int timeout_us);
 
 // zero-copy read (return buffer address)
 int shmlogclient_zerocopy_read(struct shm_log_client_t *client, void **pbuf, size_t *plen, size_t *lost, int timeout_us); // return buffer id on success or -1 on error
-int shmlogclient_zerocopy_free(struct shm_log_client_t *client, shmlog_int_headtail bufid);
+int shmlogclient_zerocopy_free(struct shm_log_client_t *client, shmlog_int_headtail bufid); // return SHMLOG_LEASE_INVALIDATED if the buffer has been overwritten
+
+// how long producers wait for leased slots before overwriting them, 0 by default
+int shmlogclient_set_lease_hold(struct shm_log_client_t *client, int hold_us);
+// override the limits of all call sites of the producer (see SHMLOG_PRINTF_LIMITED), 0: use the call site's own
+int shmlogclient_set_site_limit(struct shm_log_client_t *client, unsigned rate, unsigned burst, unsigned sample);
+// suppress repeated messages of the producer, see shmlog_set_dedup. 0: disable
+int shmlogclient_set_dedup(struct shm_log_client_t *client, unsigned window_ms);
+// ask the producer to resize its ring to nmsg messages, see shmlog_resize. it's done at the
+// producer's next writes, then reads follow the new ring once the old one is drained
+int shmlogclient_resize(struct shm_log_client_t *client, unsigned nmsg);
+int shmlogclient_lease_acquire(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int max, int timeout_us); // return the number of messages or -1 on error
+// the same as above, but only from one lane, or SHMLOG_LANE_ANY
+int shmlogclient_lease_acquire_lane(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int lane, int max, int timeout_us);
+struct shmlog_msg *shmlogclient_lease_msg(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, int i); // NULL if the slot is abandoned
+int shmlogclient_lease_valid(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, int i);
+int shmlogclient_lease_release(struct shm_log_client_t *client, struct shmlog_lease_t *lease); // return the number of invalidated messages
+// the sequence number of the first message in its lane of the ring (see shmlog_seq), the others follow it.
+// return -1 if no message of the lease could be acquired
+int shmlogclient_lease_seq(struct shm_log_client_t *client, const struct shmlog_lease_t *lease, uint64_t *seq);
+
+/*
+ * checkpoint: resume after a restart of the consumer without loss or duplication
+ *
+ *   if ( read the checkpoint file failed || shmlogclient_resume(client, &ckpt, &gap) < 0 )
+ *       shmlogclient_checkpoint_init(client, &ckpt); // start at the head
+ *   while ( (n = shmlogclient_lease_resume(client, &lease, max)) > 0 ) { output, update, release }
+ *   for ( ;; ) {
+ *       shmlogclient_lease_acquire(client, &lease, max, timeout);
+ *       output the lease;
+ *       shmlogclient_checkpoint_update(client, &ckpt, &lease); // and write it, before releasing the lease
+ *       shmlogclient_lease_release(client, &lease);
+ *   }
+ *
+ * Messages taken but not output by the previous consumer are still in their
+ * slots until producers overwrite them, the sequence numbers (see shmlog_seq)
+ * tell which ones are. The ones overwritten are counted as the gap.
+ */
+#define SHMLOG_CHECKPOINT_MAGIC 0x4b43474c // "LGCK"
+
+struct shmlog_checkpoint_t {
+    uint32_t magic;
+    int32_t pid;      // of the ring
+    uint64_t ring_id; // see shmlog_header.ring_id
+    uint64_t seq[2];  // sequence number of the next message to output, of each lane
+};
+
+int shmlogclient_checkpoint_init(struct shm_log_client_t *client, struct shmlog_checkpoint_t *ckpt); // the head of the ring
+void shmlogclient_checkpoint_update(struct shm_log_client_t *client, struct shmlog_checkpoint_t *ckpt, const struct shmlog_lease_t *lease);
+// prepare to replay messages after the checkpoint, return -1 (ESTALE) if it's of another ring,
+// gap: the number of messages lost since the checkpoint, more may be found while replaying
+int shmlogclient_resume(struct shm_log_client_t *client, const struct shmlog_checkpoint_t *ckpt, uint64_t *gap);
+int shmlogclient_lease_resume(struct shm_log_client_t *client, struct shmlog_lease_t *lease, int max); // return 0 if all replayed
     
 #ifdef __cplusplus
 }
@@ -0,0 +1,357 @@
+#ifndef __DENGJFZH_SHMLOG_HPP__
+#define __DENGJFZH_SHMLOG_HPP__
+
+/*
+ * Header-only C++17/20 front end of libshmlog
+ *
+ *   shmlog::info("x={} y={}", x, y);          // C++20: format string is checked at compile time
+ *   SHMLOG_INFO("x={} y={}", x, y);           // C++17 and later: checked at compile time, and
+ *                                             // the arguments are not evaluated if the level is disabled
+ *
+ * Placeholders are "{}", "{{" and "}}" are literal braces. The message is
+ * formatted directly into the reserved ring slot, without any heap allocation,
+ * and is truncated to SHMLOG_MSG_BODY_SIZE bytes.
+ *
+ * Levels below SHMLOG_ACTIVE_LEVEL are compiled away. Define it before
+ * including this header, e.g. -DSHMLOG_ACTIVE_LEVEL=SHMLOG_LEVEL_INFO.
+ *
+ * Trace spans: shmlog::span s("handle_rpc"); writes a complete event when s
+ * goes out of scope, see shmlog_trace_* in libshmlog.h.
+ *
+ * Other types can be logged by specializing shmlog::encoder<T>:
+ *   template<> struct shmlog::encoder<point> {
+ *       static char *encode(char *p, char *end, const point &v) { ... return p; }
+ *   };
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "libshmlog.h"
+
+#ifndef SHMLOG_ACTIVE_LEVEL
+#define SHMLOG_ACTIVE_LEVEL SHMLOG_LEVEL_TRACE
+#endif
+
+namespace shmlog {
+
+enum class level : int {
+    trace = SHMLOG_LEVEL_TRACE,
+    debug = SHMLOG_LEVEL_DEBUG,
+    info  = SHMLOG_LEVEL_INFO,
+    warn  = SHMLOG_LEVEL_WARN,
+    error = SHMLOG_LEVEL_ERROR,
+    fatal = SHMLOG_LEVEL_FATAL,
+};
+
+constexpr bool enabled(level lv)
+{
+    return static_cast<int>(lv) >= SHMLOG_ACTIVE_LEVEL;
+}
+
+/*
+ * argument encoders: write the value into [p, end), truncate it if there is
+ * not enough space, and return the end of written data
+ */
+
+namespace detail {
+
+inline char *copy(char *p, char *end, const char *s, size_t len)
+{
+    if ( len > static_cast<size_t>(end - p) ) {
+        len = end - p;
+    }
+    std::memcpy(p, s, len);
+    return p + len;
+}
+
+template<typename T>
+inline char *to_chars(char *p, char *end, T v)
+{
+    char tmp[64];
+    std::to_chars_result ret = std::to_chars(p, end, v);
+    if ( ret.ec == std::errc() ) {
+        return ret.ptr;
+    }
+    // not enough space: format it aside and truncate
+    ret = std::to_chars(tmp, tmp + sizeof(tmp), v);
+    return copy(p, end, tmp, ret.ptr - tmp);
+}
+
+} // namespace detail
+
+template<typename T, typename Enable = void>
+struct encoder {
+    static_assert(sizeof(T) == 0, "shmlog: no encoder for this argument type, specialize shmlog::encoder<T>");
+};
+
+template<>
+struct encoder<bool> {
+    static char *encode(char *p, char *end, bool v)
+    {
+        return v ? detail::copy(p, end, "true", 4) : detail::copy(p, end, "false", 5);
+    }
+};
+
+template<>
+struct encoder<char> {
+    static char *encode(char *p, char *end, char v)
+    {
+        return detail::copy(p, end, &v, 1);
+    }
+};
+
+template<typename T>
+struct encoder<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>>> {
+    static char *encode(char *p, char *end, T v)
+    {
+        return detail::to_chars(p, end, v);
+    }
+};
+
+template<typename T>
+struct encoder<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static char *encode(char *p, char *end, T v)
+    {
+        return detail::to_chars(p, end, v);
+    }
+};
+
+template<typename T>
+struct encoder<T, std::enable_if_t<std::is_enum_v<T>>> {
+    static char *encode(char *p, char *end, T v)
+    {
+        return detail::to_chars(p, end, static_cast<std::underlying_type_t<T>>(v));
+    }
+};
+
+template<>
+struct encoder<std::string_view> {
+    static char *encode(char *p, char *end, std::string_view v)
+    {
+        return detail::copy(p, end, v.data(), v.size());
+    }
+};
+
+template<>
+struct encoder<std::string> {
+    static char *encode(char *p, char *end, const std::string &v)
+    {
+        return detail::copy(p, end, v.data(), v.size());
+    }
+};
+
+template<>
+struct encoder<const char *> {
+    static char *encode(char *p, char *end, const char *v)
+    {
+        if ( nullptr == v ) {
+            return detail::copy(p, end, "(null)", 6);
+        }
+        return detail::copy(p, end, v, strnlen(v, end - p));
+    }
+};
+
+template<>
+struct encoder<char *> : encoder<const char *> {};
+
+template<size_t N>
+struct encoder<char[N]> {
+    static char *encode(char *p, char *end, const char (&v)[N])
+    {
+        return detail::copy(p, end, v, strnlen(v, N));
+    }
+};
+
+template<typename T>
+struct encoder<T *, std::enable_if_t<!std::is_same_v<std::remove_cv_t<T>, char>>> {
+    static char *encode(char *p, char *end, const T *v)
+    {
+        p = detail::copy(p, end, "0x", 2);
+        std::to_chars_result ret = std::to_chars(p, end, reinterpret_cast<uintptr_t>(v), 16);
+        return (ret.ec == std::errc()) ? ret.ptr : end;
+    }
+};
+
+/*
+ * format string
+ */
+
+namespace detail {
+
+// the number of placeholders, or -1 if the format string is malformed
+constexpr int count_placeholders(std::string_view fmt)
+{
+    int n = 0;
+    for ( size_t i = 0; i < fmt.size(); i++ ) {
+        if ( '{' == fmt[i] ) {
+            if ( i + 1 < fmt.size() && '{' == fmt[i+1] ) {
+                i++;
+            } else if ( i + 1 < fmt.size() && '}' == fmt[i+1] ) {
+                i++;
+                n++;
+            } else {
+                return -1;
+            }
+        } else if ( '}' == fmt[i] ) {
+            if ( i + 1 < fmt.size() && '}' == fmt[i+1] ) {
+                i++;
+            } else {
+                return -1;
+            }
+        }
+    }
+    return n;
+}
+
+// copy literal text until the next placeholder, and skip the placeholder
+inline char *copy_literal(char *p, char *end, const char *&fmt, const char *fmt_end)
+{
+    while ( fmt < fmt_end && p < end ) {
+        if ( '{' == *fmt || '}' == *fmt ) {
+            if ( fmt + 1 < fmt_end && '}' == fmt[1] && '{' == *fmt ) {
+                fmt += 2;
+                return p;
+            }
+            fmt++; // escaped brace, compile time checking ensures the next one is the same
+        }
+        *p++ = *fmt++;
+    }
+    return p;
+}
+
+// the number of arguments, used in unevaluated context: sizeof(count_args(...)) - 1
+template<typename... Args>
+char (&count_args(const Args &...))[sizeof...(Args) + 1];
+
+template<typename T>
+using encoder_of = encoder<std::remove_cv_t<std::remove_reference_t<T>>>;
+
+template<typename... Args>
+inline size_t format_to(char *begin, char *end, std::string_view fmt, const Args &... args)
+{
+    const char *f = fmt.data(), *f_end = fmt.data() + fmt.size();
+    char *p = begin;
+    ((p = copy_literal(p, end, f, f_end), p = encoder_of<Args>::encode(p, end, args)), ...);
+    p = copy_literal(p, end, f, f_end);
+    return p - begin;
+}
+
+} // namespace detail
+
+#if defined(__cpp_consteval) && __cpp_consteval >= 201811L
+template<typename... Args>
+struct basic_format_string {
+    std::string_view str;
+
+    template<size_t N>
+    consteval basic_format_string(const char (&s)[N]) : str(s, N - 1)
+    {
+        const int n = detail::count_placeholders(str);
+        if ( n < 0 ) {
+            invalid_format_string("shmlog: malformed format string");
+        }
+        if ( n != static_cast<int>(sizeof...(Args)) ) {
+            invalid_format_string("shmlog: the number of placeholders doesn't match the number of arguments");
+        }
+    }
+
+private:
+    // not constexpr: calling it makes the compile time evaluation fail, with the message in diagnostics
+    static void invalid_format_string(const char *) {}
+};
+
+template<typename... Args>
+using format_string = basic_format_string<std::type_identity_t<Args>...>;
+#define SHMLOG_HAS_FORMAT_STRING 1
+#endif
+
+// format the message into a reserved ring slot, return the length or -1 if shmlog is not initialized.
+// the slot is in the priority lane if the ring has one and lv is at or above its level
+template<typename... Args>
+inline int write_level(int lv, std::string_view fmt, const Args &... args)
+{
+    struct shmlog_msg *msg = shmlog_reserve_level(lv);
+    if ( nullptr == msg ) {
+        return -1;
+    }
+    char *body = reinterpret_cast<char *>(msg->body);
+    const size_t len = detail::format_to(body, body + SHMLOG_MSG_BODY_SIZE, fmt, args...);
+    shmlog_commit(msg, len);
+    return static_cast<int>(len);
+}
+
+template<typename... Args>
+inline int write(std::string_view fmt, const Args &... args)
+{
+    return write_level(SHMLOG_LEVEL_TRACE, fmt, args...);
+}
+
+template<level Lv, typename... Args>
+inline int log(std::string_view fmt, const Args &... args)
+{
+    if constexpr ( enabled(Lv) ) {
+        return write_level(static_cast<int>(Lv), fmt, args...);
+    } else {
+        return 0;
+    }
+}
+
+#ifdef SHMLOG_HAS_FORMAT_STRING
+#define SHMLOG_DEFINE_LEVEL_FUNCTION(name)                                       \
+    template<typename... Args>                                                   \
+    inline int name(format_string<Args...> fmt, const Args &... args)            \
+    {                                                                            \
+        return log<level::name>(fmt.str, args...);                               \
+    }
+SHMLOG_DEFINE_LEVEL_FUNCTION(trace)
+SHMLOG_DEFINE_LEVEL_FUNCTION(debug)
+SHMLOG_DEFINE_LEVEL_FUNCTION(info)
+SHMLOG_DEFINE_LEVEL_FUNCTION(warn)
+SHMLOG_DEFINE_LEVEL_FUNCTION(error)
+SHMLOG_DEFINE_LEVEL_FUNCTION(fatal)
+#undef SHMLOG_DEFINE_LEVEL_FUNCTION
+#endif
+
+// scoped trace span: a complete event from construction to destruction
+class span {
+public:
+    explicit span(const char *name) : name_(name), start_(shmlog_trace_now()) {}
+    ~span() { shmlog_trace_complete(name_, start_); }
+    span(const span &) = delete;
+    span &operator=(const span &) = delete;
+
+private:
+    const char *name_;
+    uint64_t start_;
+};
+
+} // namespace shmlog
+
+/*
+ * macros, work with C++17: the format string must be a literal
+ */
+#define SHMLOG_LOG(lv, fmt, ...)                                                                    \
+    do {                                                                                            \
+        if constexpr ( ::shmlog::enabled(lv) ) {                                                    \
+            static_assert(::shmlog::detail::count_placeholders(fmt) >= 0,                           \
+                          "shmlog: malformed format string");                                       \
+            static_assert(::shmlog::detail::count_placeholders(fmt) ==                              \
+                          static_cast<int>(sizeof(::shmlog::detail::count_args(__VA_ARGS__)) - 1),  \
+                          "shmlog: the number of placeholders doesn't match the number of arguments"); \
+            ::shmlog::write_level(static_cast<int>(lv), fmt, ##__VA_ARGS__);                        \
+        }                                                                                           \
+    } while ( 0 )
+
+#define SHMLOG_TRACE(fmt, ...) SHMLOG_LOG(::shmlog::level::trace, fmt, ##__VA_ARGS__)
+#define SHMLOG_DEBUG(fmt, ...) SHMLOG_LOG(::shmlog::level::debug, fmt, ##__VA_ARGS__)
+#define SHMLOG_INFO(fmt, ...)  SHMLOG_LOG(::shmlog::level::info, fmt, ##__VA_ARGS__)
+#define SHMLOG_WARN(fmt, ...)  SHMLOG_LOG(::shmlog::level::warn, fmt, ##__VA_ARGS__)
+#define SHMLOG_ERROR(fmt, ...) SHMLOG_LOG(::shmlog::level::error, fmt, ##__VA_ARGS__)
+#define SHMLOG_FATAL(fmt, ...) SHMLOG_LOG(::shmlog::level::fatal, fmt, ##__VA_ARGS__)
+
+#endif/*__DENGJFZH_SHMLOG_HPP__*/
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shmlogarchive.h"
+
+#if 1
+#define LOG(fmt, arg...) fprintf(stderr, "<%s:%d> " fmt, __FILE__, __LINE__, ##arg)
+#else
+#define LOG(fmt, arg...)
+#endif
+
+#define SEG_NAME_FMT "shmlog-%d-%" PRIu64
+#define JOBS_MAX 64
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int shmlogarchive_open(struct shmlog_archive_t *arc, const char *dir, pid_t pid, size_t seg_size)
+{
+    if ( NULL == arc || NULL == dir || strlen(dir) >= sizeof(arc->dir) ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( mkdir(dir, 0755) < 0 && EEXIST != errno ) {
+        LOG("Error: create directory '%s' failed! %d:%s\n", dir, errno, strerror(errno));
+        return -1;
+    }
+    memset(arc, 0, sizeof(struct shmlog_archive_t));
+    strcpy(arc->dir, dir);
+    arc->pid = pid;
+    arc->seg_size = (seg_size > 0) ? seg_size : SHMLOG_ARCHIVE_SEG_SIZE_DEFAULT;
+    return 0;
+}
+
+static void close_segment(struct shmlog_archive_t *arc)
+{
+    if ( NULL != arc->seg ) {
+        fclose(arc->seg);
+        arc->seg = NULL;
+    }
+    if ( NULL != arc->idx ) {
+        fclose(arc->idx);
+        arc->idx = NULL;
+    }
+}
+
+static int open_segment(struct shmlog_archive_t *arc, uint64_t start)
+{
+    char filename[512];
+    struct shmlog_archive_filehdr fhdr;
+    memset(&fhdr, 0, sizeof(fhdr));
+    fhdr.version = SHMLOG_ARCHIVE_VERSION;
+    fhdr.pid = arc->pid;
+    fhdr.start = start;
+    // segment
+    snprintf(filename, sizeof(filename), "%s/" SEG_NAME_FMT ".seg", arc->dir, arc->pid, start);
+    arc->seg = fopen(filename, "wx");
+    if ( NULL == arc->seg ) {
+        LOG("Error: create segment '%s' failed! %d:%s\n", filename, errno, strerror(errno));
+        return -1;
+    }
+    memcpy(fhdr.magic, SHMLOG_ARCHIVE_MAGIC_SEG, sizeof(fhdr.magic));
+    if ( fwrite(&fhdr, sizeof(fhdr), 1, arc->seg) != 1 ) {
+        goto FAILED;
+    }
+    // index
+    snprintf(filename, sizeof(filename), "%s/" SEG_NAME_FMT ".idx", arc->dir, arc->pid, start);
+    arc->idx = fopen(filename, "wx");
+    if ( NULL == arc->idx ) {
+        LOG("Error: create index '%s' failed! %d:%s\n", filename, errno, strerror(errno));
+        goto FAILED;
+    }
+    memcpy(fhdr.magic, SHMLOG_ARCHIVE_MAGIC_IDX, sizeof(fhdr.magic));
+    if ( fwrite(&fhdr, sizeof(fhdr), 1, arc->idx) != 1 ) {
+        goto FAILED;
+    }
+    arc->seg_off = sizeof(fhdr);
+    arc->idx_off = 0;
+    return 0;
+FAILED:
+    close_segment(arc);
+    return -1;
+}
+
+void shmlogarchive_close(struct shmlog_archive_t *arc)
+{
+    if ( NULL != arc ) {
+        close_segment(arc);
+    }
+}
+
+int shmlogarchive_write(struct shmlog_archive_t *arc, uint64_t seq, const void *msg, size_t len)
+{
+    struct shmlog_archive_rec rec;
+    struct shmlog_archive_idx idx;
+    if ( NULL == arc ) {
+        errno = EINVAL;
+        return -1;
+    }
+    rec.ts = now_ns();
+    if ( rec.ts < arc->last_ts ) { // the index is searched by time, so it must not go back
+        rec.ts = arc->last_ts;
+    }
+    rec.seq = seq;
+    rec.len = len;
+    rec.reserve = 0;
+    // rotate segment
+    if ( NULL != arc->seg && arc->seg_off >= arc->seg_size ) {
+        close_segment(arc);
+    }
+    if ( NULL == arc->seg ) {
+        if ( open_segment(arc, rec.ts) < 0 ) {
+            return -1;
+        }
+    }
+    // sparse index
+    if ( 0 == arc->idx_off || (arc->seg_off - arc->idx_off) >= SHMLOG_ARCHIVE_INDEX_INTERVAL ) {
+        idx.ts = rec.ts;
+        idx.seq = rec.seq;
+        idx.off = arc->seg_off;
+        if ( fwrite(&idx, sizeof(idx), 1, arc->idx) != 1 ) {
+            return -1;
+        }
+        arc->idx_off = arc->seg_off;
+    }
+    if ( fwrite(&rec, sizeof(rec), 1, arc->seg) != 1 || (len > 0 && fwrite(msg, 1, len, arc->seg) != len) ) {
+        return -1;
+    }
+    arc->seg_off += sizeof(rec) + len;
+    arc->last_ts = rec.ts;
+    return len;
+}
+
+int shmlogarchive_flush(struct shmlog_archive_t *arc)
+{
+    if ( NULL == arc ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // data first, so an index entry never points beyond the segment
+    if ( NULL != arc->seg && fflush(arc->seg) != 0 ) {
+        return -1;
+    }
+    if ( NULL != arc->idx && fflush(arc->idx) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * query
+ */
+
+struct segment_t {
+    pid_t pid;
+    uint64_t start;
+    char *name; // without extension
+    // output of the segment, filled by a worker in parallel mode
+    char *buf;
+    size_t len;
+    int done;
+    int failed; // no memory for the output
+};
+
+struct query_ctx_t {
+    const struct shmlog_archive_query_t *query;
+    struct segment_t *segs;
+    int nseg;
+    atomic_int next;
+    mtx_t mtx;
+    cnd_t cnd;
+};
+
+static int compare_segment(const void *a, const void *b)
+{
+    const struct segment_t *sa = a, *sb = b;
+    if ( sa->start != sb->start ) {
+        return (sa->start < sb->start) ? -1 : 1;
+    }
+    return sa->pid - sb->pid;
+}
+
+static void *map_file(const char *dir, const char *name, const char *ext, size_t *size)
+{
+    char filename[512];
+    struct stat statbuf;
+    void *addr;
+    int fd;
+    snprintf(filename, sizeof(filename), "%s/%s%s", dir, name, ext);
+    fd = open(filename, O_RDONLY);
+    if ( fd < 0 ) {
+        LOG("Error: open '%s' failed! %d:%s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    if ( fstat(fd, &statbuf) < 0 || statbuf.st_size < sizeof(struct shmlog_archive_filehdr) ) {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( MAP_FAILED == addr ) {
+        LOG("Error: mmap '%s' failed! %d:%s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    *size = statbuf.st_size;
+    return addr;
+}
+
+static void print_record(FILE *out, pid_t pid, const struct shmlog_archive_rec *rec)
+{
+    char timestr[32];
+    struct tm tm;
+    time_t sec = rec->ts / 1000000000ULL;
+    localtime_r(&sec, &tm);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%d %s.%09u ", pid, timestr, (unsigned)(rec->ts % 1000000000ULL));
+    fwrite(rec + 1, 1, rec->len, out);
+    fputc('\n', out);
+}
+
+static int query_segment(const struct shmlog_archive_query_t *query, const struct segment_t *seg, FILE *out)
+{
+    const struct shmlog_archive_idx *idx;
+    const struct shmlog_archive_rec *rec;
+    const uint8_t *data;
+    size_t seg_size, idx_size, nidx, lo, hi, mid;
+    uint64_t off;
+    void *seg_addr, *idx_addr;
+    idx_addr = map_file(query->dir, seg->name, ".idx", &idx_size);
+    if ( NULL == idx_addr ) {
+        return -1;
+    }
+    seg_addr = map_file(query->dir, seg->name, ".seg", &seg_size);
+    if ( NULL == seg_addr ) {
+        munmap(idx_addr, idx_size);
+        return -1;
+    }
+    idx = (const struct shmlog_archive_idx *)((uint8_t*)idx_addr + sizeof(struct shmlog_archive_filehdr));
+    nidx = (idx_size - sizeof(struct shmlog_archive_filehdr)) / sizeof(struct shmlog_archive_idx);
+    data = seg_addr;
+    if ( nidx > 0 && idx[0].ts <= query->to ) {
+        // find the last index entry before `from`
+        lo = 0;
+        hi = nidx;
+        while ( hi - lo > 1 ) {
+            mid = lo + (hi - lo) / 2;
+            if ( idx[mid].ts < query->from ) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        off = idx[lo].off;
+        // scan records in range, a record being written may be incomplete
+        while ( off + sizeof(struct shmlog_archive_rec) <= seg_size ) {
+            rec = (const struct shmlog_archive_rec *)(data + off);
+            if ( off + sizeof(struct shmlog_archive_rec) + rec->len > seg_size || rec->ts > query->to ) {
+                break;
+            }
+            if ( rec->ts >= query->from ) {
+                print_record(out, seg->pid, rec);
+            }
+            off += sizeof(struct shmlog_archive_rec) + rec->len;
+        }
+    }
+    munmap(seg_addr, seg_size);
+    munmap(idx_addr, idx_size);
+    return 0;
+}
+
+static int query_worker(void *arg)
+{
+    struct query_ctx_t *ctx = arg;
+    struct segment_t *seg;
+    FILE *out;
+    int i;
+    while ( (i = atomic_fetch_add(&ctx->next, 1)) < ctx->nseg ) {
+        seg = &ctx->segs[i];
+        out = open_memstream(&seg->buf, &seg->len);
+        if ( NULL != out ) {
+            query_segment(ctx->query, seg, out);
+            fclose(out);
+        } else {
+            LOG("Error: open memory stream for '%s' failed! %d:%s\n", seg->name, errno, strerror(errno));
+            seg->failed = 1;
+        }
+        mtx_lock(&ctx->mtx);
+        seg->done = 1;
+        cnd_broadcast(&ctx->cnd);
+        mtx_unlock(&ctx->mtx);
+    }
+    return 0;
+}
+
+int shmlogarchive_query(const struct shmlog_archive_query_t *query)
+{
+    struct query_ctx_t ctx;
+    struct segment_t *segs = NULL, *tmp;
+    thrd_t threads[JOBS_MAX];
+    DIR *dir;
+    struct dirent *dent;
+    char ext[8];
+    pid_t pid;
+    uint64_t start;
+    int nseg = 0, cap = 0, jobs, nthread, i, ret = 0;
+    if ( NULL == query || NULL == query->dir || NULL == query->out ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // collect segments
+    dir = opendir(query->dir);
+    if ( NULL == dir ) {
+        LOG("Error: open directory '%s' failed! %d:%s\n", query->dir, errno, strerror(errno));
+        return -1;
+    }
+    while ( (dent = readdir(dir)) != NULL ) {
+        if ( sscanf(dent->d_name, SEG_NAME_FMT "%7s", &pid, &start, ext) != 3 || strcmp(ext, ".seg") != 0 ) {
+            continue;
+        }
+        if ( (query->pid > 0 && pid != query->pid) || start > query->to ) {
+            continue;
+        }
+        if ( nseg >= cap ) {
+            cap = (cap > 0) ? cap * 2 : 64;
+            tmp = realloc(segs, cap * sizeof(struct segment_t));
+            if ( NULL == tmp ) {
+                ret = -1;
+                break;
+            }
+            segs = tmp;
+        }
+        memset(&segs[nseg], 0, sizeof(struct segment_t));
+        segs[nseg].pid = pid;
+        segs[nseg].start = start;
+        segs[nseg].name = strndup(dent->d_name, strlen(dent->d_name) - 4);
+        if ( NULL == segs[nseg].name ) {
+            ret = -1;
+            break;
+        }
+        nseg++;
+    }
+    closedir(dir);
+    if ( ret < 0 ) {
+        LOG("Error: collect segments of '%s' failed! %d:%s\n", query->dir, ENOMEM, strerror(ENOMEM));
+        for ( i = 0; i < nseg; i++ ) {
+            free(segs[i].name);
+        }
+        free(segs);
+        errno = ENOMEM;
+        return -1;
+    }
+    qsort(segs, nseg, sizeof(struct segment_t), compare_segment);
+    // search segments in order, or in parallel and output in order
+    jobs = (query->jobs < JOBS_MAX) ? query->jobs : JOBS_MAX;
+    if ( jobs <= 1 || nseg <= 1 ) {
+        for ( i = 0; i < nseg; i++ ) {
+            query_segment(query, &segs[i], query->out);
+        }
+    } else {
+        ctx.query = query;
+        ctx.segs = segs;
+        ctx.nseg = nseg;
+        atomic_init(&ctx.next, 0);
+        mtx_init(&ctx.mtx, mtx_plain);
+        cnd_init(&ctx.cnd);
+        for ( nthread = 0; nthread < jobs && nthread < nseg; nthread++ ) {
+            if ( thrd_create(&threads[nthread], query_worker, &ctx) != thrd_success ) {
+                break;
+            }
+        }
+        if ( 0 == nthread ) {
+            query_worker(&ctx);
+        }
+        for ( i = 0; i < nseg; i++ ) {
+            mtx_lock(&ctx.mtx);
+            while ( !segs[i].done ) {
+                cnd_wait(&ctx.cnd, &ctx.mtx);
+            }
+            mtx_unlock(&ctx.mtx);
+            if ( NULL != segs[i].buf ) {
+                fwrite(segs[i].buf, 1, segs[i].len, query->out);
+                free(segs[i].buf);
+            }
+            if ( segs[i].failed ) {
+                ret = -1;
+            }
+        }
+        for ( i = 0; i < nthread; i++ ) {
+            thrd_join(threads[i], NULL);
+        }
+        cnd_destroy(&ctx.cnd);
+        mtx_destroy(&ctx.mtx);
+    }
+    for ( i = 0; i < nseg; i++ ) {
+        free(segs[i].name);
+    }
+    free(segs);
+    if ( ret < 0 ) {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+int shmlogarchive_parse_time(const char *str, uint64_t *ns)
+{
+    struct tm tm;
+    time_t now, sec;
+    const char *p;
+    char *end;
+    uint64_t frac = 0, scale = 100000000ULL;
+    if ( NULL == str || NULL == ns ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( '@' == str[0] ) {
+        sec = strtoll(str+1, &end, 10);
+        p = end;
+    } else {
+        now = time(NULL);
+        localtime_r(&now, &tm);
+        p = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+        if ( NULL == p ) {
+            p = strptime(str, "%H:%M:%S", &tm);
+        }
+        if ( NULL == p ) {
+            errno = EINVAL;
+            return -1;
+        }
+        tm.tm_isdst = -1;
+        sec = mktime(&tm);
+    }
+    if ( '.' == *p ) {
+        for ( p++; *p >= '0' && *p <= '9'; p++ ) {
+            frac += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if ( '\0' != *p || sec < 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    *ns = (uint64_t)sec * 1000000000ULL + frac;
+    return 0;
+}
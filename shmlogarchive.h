@@ -0,0 +1,82 @@
+#ifndef __DENGJFZH_SHMLOGARCHIVE_H__
+#define __DENGJFZH_SHMLOGARCHIVE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Archive segments
+ *
+ * Messages of one process are appended to segment files in a directory:
+ *   shmlog-<pid>-<start time in ns>.seg  records: header + body
+ *   shmlog-<pid>-<start time in ns>.idx  sparse index: time and sequence to file offset
+ * An index entry is added every SHMLOG_ARCHIVE_INDEX_INTERVAL bytes of records,
+ * so a query only scans a few kilobytes around the boundaries of its range.
+ */
+
+#define SHMLOG_ARCHIVE_MAGIC_SEG "SHMLGSEG"
+#define SHMLOG_ARCHIVE_MAGIC_IDX "SHMLGIDX"
+#define SHMLOG_ARCHIVE_VERSION 1
+#define SHMLOG_ARCHIVE_INDEX_INTERVAL (16*1024)
+#define SHMLOG_ARCHIVE_SEG_SIZE_DEFAULT (64*1024*1024)
+
+struct shmlog_archive_filehdr {
+    char magic[8];
+    uint32_t version;
+    int32_t pid;
+    uint64_t start; // time of the first record, ns since epoch
+};
+
+struct shmlog_archive_rec {
+    uint64_t ts;  // time of receiving, ns since epoch
+    uint64_t seq; // sequence number of the message in its lane of the ring, see shmlogclient_lease_seq
+    uint32_t len; // body length
+    uint32_t reserve;
+};
+
+struct shmlog_archive_idx {
+    uint64_t ts;
+    uint64_t seq;
+    uint64_t off; // offset of the record in segment file
+};
+
+struct shmlog_archive_t {
+    char dir[256];
+    pid_t pid;
+    size_t seg_size;   // rotate segment when it exceeds this size
+    FILE *seg;
+    FILE *idx;
+    uint64_t seg_off;  // current size of segment
+    uint64_t idx_off;  // offset of the last index entry
+    uint64_t last_ts;  // keep time monotonic in a segment
+};
+
+int shmlogarchive_open(struct shmlog_archive_t *arc, const char *dir, pid_t pid, size_t seg_size);
+void shmlogarchive_close(struct shmlog_archive_t *arc);
+int shmlogarchive_write(struct shmlog_archive_t *arc, uint64_t seq, const void *msg, size_t len);
+int shmlogarchive_flush(struct shmlog_archive_t *arc);
+
+struct shmlog_archive_query_t {
+    const char *dir;
+    pid_t pid;     // <= 0: all processes
+    uint64_t from; // ns since epoch
+    uint64_t to;   // ns since epoch, inclusive
+    int jobs;      // the number of segments searched in parallel
+    FILE *out;
+};
+
+int shmlogarchive_query(const struct shmlog_archive_query_t *query);
+
+// parse "HH:MM:SS[.frac]" (today), "YYYY-mm-dd HH:MM:SS[.frac]" or "@<seconds since epoch>[.frac]"
+int shmlogarchive_parse_time(const char *str, uint64_t *ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*__DENGJFZH_SHMLOGARCHIVE_H__*/
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "shmlogmetrics.h"
+
+#if 1
+#define LOG(fmt, arg...) fprintf(stderr, "<%s:%d> " fmt, __FILE__, __LINE__, ##arg)
+#else
+#define LOG(fmt, arg...)
+#endif
+
+static const char *g_type_names[] = { "counter", "gauge", "histogram", NULL };
+
+// next word of a rule, a quoted one may contain spaces. return 0 at the end of line
+static int next_token(char **pos, char *buf, size_t size)
+{
+    char *p = *pos;
+    size_t len = 0;
+    char quote = 0;
+    while ( isspace((unsigned char)*p) ) {
+        p++;
+    }
+    if ( '\0' == *p ) {
+        return 0;
+    }
+    if ( '"' == *p ) {
+        quote = *p++;
+    }
+    while ( '\0' != *p && (quote ? (*p != quote) : !isspace((unsigned char)*p)) ) {
+        if ( len + 1 < size ) {
+            buf[len++] = *p;
+        }
+        p++;
+    }
+    if ( quote && '\0' != *p ) {
+        p++;
+    }
+    buf[len] = '\0';
+    *pos = p;
+    return 1;
+}
+
+static int valid_name(const char *name)
+{
+    if ( !isalpha((unsigned char)name[0]) && '_' != name[0] && ':' != name[0] ) {
+        return 0;
+    }
+    for ( const char *p = name; '\0' != *p; p++ ) {
+        if ( !isalnum((unsigned char)*p) && '_' != *p && ':' != *p ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int parse_bounds(struct shmlog_metric_t *m, char *str)
+{
+    char *end;
+    for ( char *tok = strtok(str, ","); NULL != tok; tok = strtok(NULL, ",") ) {
+        if ( m->nbound >= SHMLOG_METRICS_BUCKET_MAX ) {
+            return -1;
+        }
+        m->bounds[m->nbound] = strtod(tok, &end);
+        if ( end == tok || '\0' != *end || (m->nbound > 0 && m->bounds[m->nbound] <= m->bounds[m->nbound-1]) ) {
+            return -1;
+        }
+        m->nbound++;
+    }
+    return (m->nbound > 0) ? 0 : -1;
+}
+
+static int parse_rule(struct shmlog_metric_t *m, char *line)
+{
+    char type[16], match[sizeof(m->match)], field[sizeof(m->field)-1], bounds[512];
+    int t;
+    memset(m, 0, sizeof(struct shmlog_metric_t));
+    if ( !next_token(&line, type, sizeof(type)) || !next_token(&line, m->name, sizeof(m->name)) ||
+         !next_token(&line, match, sizeof(match)) ) {
+        return -1;
+    }
+    for ( t = 0; NULL != g_type_names[t] && strcmp(g_type_names[t], type) != 0; t++ );
+    if ( NULL == g_type_names[t] || !valid_name(m->name) ) {
+        return -1;
+    }
+    m->type = (enum shmlog_metric_type)t;
+    if ( strcmp(match, "-") != 0 ) {
+        strcpy(m->match, match);
+        m->match_len = strlen(match);
+    }
+    if ( next_token(&line, field, sizeof(field)) ) {
+        m->field_len = snprintf(m->field, sizeof(m->field), "%s=", field);
+    } else if ( SHMLOG_METRIC_COUNTER != m->type ) {
+        return -1;
+    }
+    if ( SHMLOG_METRIC_HISTOGRAM == m->type ) {
+        if ( !next_token(&line, bounds, sizeof(bounds)) || parse_bounds(m, bounds) < 0 ) {
+            return -1;
+        }
+    }
+    return next_token(&line, bounds, sizeof(bounds)) ? -1 : 0;
+}
+
+int shmlogmetrics_load(struct shmlog_metrics_t *metrics, const char *rules)
+{
+    struct shmlog_metric_t *tmp;
+    char line[1024];
+    FILE *fp;
+    int lineno = 0, cap = 0;
+    if ( NULL == metrics || NULL == rules ) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(metrics, 0, sizeof(struct shmlog_metrics_t));
+    fp = fopen(rules, "r");
+    if ( NULL == fp ) {
+        LOG("Error: open rules '%s' failed! %d:%s\n", rules, errno, strerror(errno));
+        return -1;
+    }
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        char *p = line;
+        lineno++;
+        while ( isspace((unsigned char)*p) ) {
+            p++;
+        }
+        if ( '\0' == *p || '#' == *p ) {
+            continue;
+        }
+        if ( metrics->nmetric >= cap ) {
+            cap = (cap > 0) ? cap * 2 : 16;
+            tmp = realloc(metrics->metrics, cap * sizeof(struct shmlog_metric_t));
+            if ( NULL == tmp ) {
+                goto FAILED;
+            }
+            metrics->metrics = tmp;
+        }
+        if ( parse_rule(&metrics->metrics[metrics->nmetric], p) < 0 ) {
+            LOG("Error: invalid rule at %s:%d!\n", rules, lineno);
+            errno = EINVAL;
+            goto FAILED;
+        }
+        metrics->nmetric++;
+    }
+    fclose(fp);
+    return 0;
+FAILED:
+    fclose(fp);
+    shmlogmetrics_free(metrics);
+    return -1;
+}
+
+void shmlogmetrics_free(struct shmlog_metrics_t *metrics)
+{
+    if ( NULL != metrics ) {
+        free(metrics->metrics);
+        metrics->metrics = NULL;
+        metrics->nmetric = 0;
+    }
+}
+
+// the number after the first "<field>=" which has one, and which isn't the tail of another word
+static int field_value(const struct shmlog_metric_t *m, const char *msg, size_t len, double *value)
+{
+    const char *p = msg, *end = msg + len;
+    char buf[32], *endp;
+    size_t n;
+    while ( (p = memmem(p, end - p, m->field, m->field_len)) != NULL ) {
+        if ( p == msg || (!isalnum((unsigned char)p[-1]) && '_' != p[-1]) ) {
+            p += m->field_len;
+            for ( n = 0; n + 1 < sizeof(buf) && p + n < end && NULL != strchr("0123456789+-.eE", p[n]); n++ ) {
+                buf[n] = p[n];
+            }
+            buf[n] = '\0';
+            *value = strtod(buf, &endp);
+            if ( endp != buf ) {
+                return 0;
+            }
+            continue; // e.g. "lat=? ... lat=12"
+        }
+        p++;
+    }
+    return -1;
+}
+
+void shmlogmetrics_feed(struct shmlog_metrics_t *metrics, const void *msg, size_t len)
+{
+    struct shmlog_metric_t *m;
+    double value = 1;
+    int b;
+    metrics->nmsg++;
+    for ( int i = 0; i < metrics->nmetric; i++ ) {
+        m = &metrics->metrics[i];
+        if ( m->match_len > 0 && NULL == memmem(msg, len, m->match, m->match_len) ) {
+            continue;
+        }
+        if ( m->field_len > 0 && field_value(m, msg, len, &value) < 0 ) {
+            continue;
+        }
+        m->count++;
+        switch ( m->type ) {
+            case SHMLOG_METRIC_COUNTER:
+                m->value += (m->field_len > 0) ? value : 1;
+                break;
+            case SHMLOG_METRIC_GAUGE:
+                m->value = value;
+                break;
+            case SHMLOG_METRIC_HISTOGRAM:
+                m->value += value;
+                for ( b = 0; b < m->nbound && value > m->bounds[b]; b++ );
+                if ( b < m->nbound ) {
+                    m->buckets[b]++;
+                }
+                break;
+        }
+    }
+}
+
+int shmlogmetrics_write(const struct shmlog_metrics_t *metrics, pid_t pid, const char *path)
+{
+    const struct shmlog_metric_t *m;
+    char tmp[4096];
+    uint64_t cumulative;
+    FILE *fp;
+    int ret;
+    if ( NULL == metrics || NULL == path || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) ) {
+        errno = EINVAL;
+        return -1;
+    }
+    fp = fopen(tmp, "w");
+    if ( NULL == fp ) {
+        return -1;
+    }
+    fprintf(fp, "# TYPE shmlog_metrics_messages_total counter\nshmlog_metrics_messages_total{pid=\"%d\"} %" PRIu64 "\n",
+            pid, metrics->nmsg);
+    for ( int i = 0; i < metrics->nmetric; i++ ) {
+        m = &metrics->metrics[i];
+        fprintf(fp, "# TYPE %s %s\n", m->name, g_type_names[m->type]);
+        if ( SHMLOG_METRIC_HISTOGRAM != m->type ) {
+            fprintf(fp, "%s{pid=\"%d\"} %.17g\n", m->name, pid, m->value);
+            continue;
+        }
+        cumulative = 0;
+        for ( int b = 0; b < m->nbound; b++ ) {
+            cumulative += m->buckets[b];
+            fprintf(fp, "%s_bucket{pid=\"%d\",le=\"%.17g\"} %" PRIu64 "\n", m->name, pid, m->bounds[b], cumulative);
+        }
+        fprintf(fp, "%s_bucket{pid=\"%d\",le=\"+Inf\"} %" PRIu64 "\n", m->name, pid, m->count);
+        fprintf(fp, "%s_sum{pid=\"%d\"} %.17g\n", m->name, pid, m->value);
+        fprintf(fp, "%s_count{pid=\"%d\"} %" PRIu64 "\n", m->name, pid, m->count);
+    }
+    ret = ferror(fp) ? -1 : 0;
+    if ( fclose(fp) != 0 || ret < 0 || rename(tmp, path) < 0 ) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
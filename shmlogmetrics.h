@@ -0,0 +1,67 @@
+#ifndef __DENGJFZH_SHMLOGMETRICS_H__
+#define __DENGJFZH_SHMLOGMETRICS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Metrics extraction
+ *
+ * Rules are read from a file, one per line:
+ *   counter   <name> <match> [<field>]
+ *   gauge     <name> <match> <field>
+ *   histogram <name> <match> <field> <bound>[,<bound>]...
+ * A message is taken by a rule if it contains <match> ("-" matches all,
+ * double quotes allow spaces), the value of <field> is the number after
+ * "<field>=" in the message. A counter counts messages or sums the field,
+ * a gauge keeps the latest value, a histogram counts values by upper bounds.
+ * Lines starting with '#' are comments.
+ *
+ * Snapshots are written in Prometheus text format to a temporary file which
+ * is renamed over the target, so a scraper (e.g. node_exporter's textfile
+ * collector) never sees a partial one.
+ */
+
+#define SHMLOG_METRICS_BUCKET_MAX 32
+
+enum shmlog_metric_type {
+    SHMLOG_METRIC_COUNTER = 0,
+    SHMLOG_METRIC_GAUGE,
+    SHMLOG_METRIC_HISTOGRAM,
+};
+
+struct shmlog_metric_t {
+    enum shmlog_metric_type type;
+    char name[64];
+    char match[128];
+    size_t match_len;  // 0: match all
+    char field[64];    // "<field>="
+    size_t field_len;  // 0: no field
+    int nbound;
+    double bounds[SHMLOG_METRICS_BUCKET_MAX];
+    uint64_t buckets[SHMLOG_METRICS_BUCKET_MAX]; // not cumulative, the ones above all bounds are count - sum(buckets)
+    double value;      // counter: total, gauge: latest, histogram: sum
+    uint64_t count;    // messages taken
+};
+
+struct shmlog_metrics_t {
+    int nmetric;
+    struct shmlog_metric_t *metrics;
+    uint64_t nmsg;     // messages fed
+};
+
+int shmlogmetrics_load(struct shmlog_metrics_t *metrics, const char *rules);
+void shmlogmetrics_free(struct shmlog_metrics_t *metrics);
+void shmlogmetrics_feed(struct shmlog_metrics_t *metrics, const void *msg, size_t len);
+int shmlogmetrics_write(const struct shmlog_metrics_t *metrics, pid_t pid, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*__DENGJFZH_SHMLOGMETRICS_H__*/
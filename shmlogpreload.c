@@ -0,0 +1,645 @@
+/*
+ * libshmlogpreload.so: route the log output of unmodified binaries into shmlog
+ *
+ *   LD_PRELOAD=libshmlogpreload.so some-daemon ...
+ *   shmlogtail <pid of some-daemon>
+ *
+ * write/writev/dprintf to the configured fds, stdio on their streams and syslog
+ * are intercepted, split into lines and written into the ring of the process.
+ * stdout and stderr of configured fds are replaced by streams which write into
+ * the ring, so stdio calls which glibc makes without going through the hooks
+ * (perror, error, err/warn, psignal, assert, the *_unlocked ones) are taken too.
+ * The real call is made if the ring isn't available. An fd which the process
+ * closes or replaces by dup2/dup3 isn't intercepted any more.
+ * Not taken: raw write syscalls, glibc's fatal messages (e.g. "stack smashing
+ * detected"), which go to the fd without stdio, and streams the process opens
+ * on the fd itself by fdopen or freopen, except by the hooked stdio calls.
+ * Environment:
+ *   SHMLOG_PRELOAD_FDS       fds to intercept, comma separated (default "2")
+ *   SHMLOG_PRELOAD_NMSG      slots of the ring (default 4096)
+ *   SHMLOG_PRELOAD_PRIO_NMSG slots of the priority lane, which takes syslog
+ *                            messages of LOG_ERR and above (default 0: no lane)
+ *   SHMLOG_PRELOAD_PATH      map a persistent ring from this file
+ *   SHMLOG_PRELOAD_SYSLOG    0: don't intercept syslog
+ *   SHMLOG_PRELOAD_TEE       1: make the real call too
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <threads.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include "libshmlog.h"
+
+#define PRELOAD_FD_MAX 16
+#define PRELOAD_NMSG_DEFAULT 4096
+#define PRELOAD_FORMAT_SIZE 1024 // formatted on stack up to this size, otherwise on heap
+
+struct line_buf {
+    size_t len;
+    char buf[SHMLOG_MSG_BODY_SIZE];
+};
+
+static int g_ready = 0;
+static int g_nfd = 0;
+static atomic_int g_fds[PRELOAD_FD_MAX]; // -1: closed or replaced by the process
+static int g_syslog = 1;
+static int g_tee = 0;
+static const char *g_ident = NULL;
+static pthread_key_t g_lines_key; // flushes partial lines at thread exit
+static thread_local struct line_buf t_lines[PRELOAD_FD_MAX];
+static thread_local int t_busy = 0; // in a hook, calls from libshmlog itself go to the real functions
+
+// the stream which replaces stdout or stderr of a hooked fd, its cookie
+struct preload_stream {
+    FILE *fp; // NULL: not replaced
+    int fd;   // the fd it writes once the fd isn't hooked any more
+};
+static struct preload_stream g_streams[PRELOAD_FD_MAX];
+
+// threads may look it up at the same time, they all get the same one
+#define REAL(name) ({                                                                           \
+    static _Atomic(__typeof__(name) *) real_##name = NULL;                                      \
+    __typeof__(name) *fn_##name = atomic_load_explicit(&real_##name, memory_order_acquire);     \
+    if ( NULL == fn_##name ) {                                                                  \
+        fn_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name);                                \
+        atomic_store_explicit(&real_##name, fn_##name, memory_order_release);                   \
+    }                                                                                           \
+    fn_##name;                                                                                  \
+})
+
+static int hooked_fd(int fd)
+{
+    if ( !g_ready || t_busy ) {
+        return -1;
+    }
+    for ( int i = 0; i < g_nfd; i++ ) {
+        if ( atomic_load_explicit(&g_fds[i], memory_order_relaxed) == fd ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct preload_stream *own_stream(FILE *stream)
+{
+    for ( int i = 0; i < g_nfd && NULL != stream; i++ ) {
+        if ( g_streams[i].fp == stream ) {
+            return &g_streams[i];
+        }
+    }
+    return NULL;
+}
+
+// the replaced streams take what is written to them in stream_write
+static int hooked_stream(FILE *stream)
+{
+    return (NULL != stream && g_ready && !t_busy && NULL == own_stream(stream)) ? hooked_fd(fileno(stream)) : -1;
+}
+
+// write a line into the ring, or by the real write if it's not available
+static void emit_line(int idx, const char *line, size_t len)
+{
+    const struct iovec iov[2] = { { (void*)line, len }, { "\n", 1 } };
+    const int fd = atomic_load(&g_fds[idx]);
+    int ret;
+    t_busy = 1;
+    ret = shmlog_write(line, len);
+    t_busy = 0;
+    if ( ret < 0 && !g_tee && fd >= 0 ) {
+        REAL(writev)(fd, iov, 2);
+    }
+}
+
+static void feed(int idx, const char *data, size_t len)
+{
+    struct line_buf *lb = &t_lines[idx];
+    const char *nl;
+    size_t n, chunk;
+    while ( len > 0 ) {
+        nl = memchr(data, '\n', len);
+        n = (NULL != nl) ? (size_t)(nl - data) : len;
+        // a line longer than a message is split
+        while ( n > 0 ) {
+            chunk = sizeof(lb->buf) - lb->len;
+            if ( chunk > n ) {
+                chunk = n;
+            }
+            memcpy(lb->buf + lb->len, data, chunk);
+            lb->len += chunk;
+            data += chunk;
+            len -= chunk;
+            n -= chunk;
+            if ( sizeof(lb->buf) == lb->len ) {
+                emit_line(idx, lb->buf, lb->len);
+                lb->len = 0;
+            }
+        }
+        if ( NULL != nl ) {
+            emit_line(idx, lb->buf, lb->len);
+            lb->len = 0;
+            data++;
+            len--;
+        }
+    }
+}
+
+static void flush_lines(void *arg)
+{
+    for ( int i = 0; i < g_nfd; i++ ) {
+        if ( t_lines[i].len > 0 ) {
+            emit_line(i, t_lines[i].buf, t_lines[i].len);
+            t_lines[i].len = 0;
+        }
+    }
+}
+
+static void onexit()
+{
+    for ( int i = 0; i < g_nfd; i++ ) {
+        if ( NULL != g_streams[i].fp ) {
+            fflush(g_streams[i].fp);
+        }
+    }
+    flush_lines(NULL); // thread-specific destructors don't run at exit
+}
+
+static int vfeed(int idx, const char *fmt, va_list ap)
+{
+    char buf[PRELOAD_FORMAT_SIZE], *str = buf;
+    va_list ap2;
+    int len;
+    va_copy(ap2, ap);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if ( len >= (int)sizeof(buf) && vasprintf(&str, fmt, ap2) < 0 ) {
+        str = buf;
+        len = sizeof(buf) - 1;
+    }
+    va_end(ap2);
+    if ( len > 0 ) {
+        feed(idx, str, len);
+    }
+    if ( str != buf ) {
+        free(str);
+    }
+    return len;
+}
+
+/*
+ * the replaced stdout/stderr: unbuffered, so lines come in the order of the
+ * calls, whichever way they are written
+ */
+static ssize_t stream_write(void *cookie, const char *buf, size_t size)
+{
+    struct preload_stream *stream = (struct preload_stream *)cookie;
+    const int idx = stream - g_streams;
+    if ( t_busy || atomic_load(&g_fds[idx]) < 0 ) {
+        return REAL(write)(stream->fd, buf, size);
+    }
+    pthread_setspecific(g_lines_key, t_lines);
+    feed(idx, buf, size);
+    return g_tee ? REAL(write)(stream->fd, buf, size) : (ssize_t)size;
+}
+
+static int stream_close(void *cookie)
+{
+    return REAL(close)(((struct preload_stream *)cookie)->fd);
+}
+
+static void replace_stream(int idx, FILE **std)
+{
+    const cookie_io_functions_t funcs = { .write = stream_write, .close = stream_close };
+    struct preload_stream *stream = &g_streams[idx];
+    stream->fd = atomic_load(&g_fds[idx]);
+    stream->fp = fopencookie(stream, "w", funcs);
+    if ( NULL == stream->fp ) {
+        return; // the hooked stdio calls still take most of it
+    }
+    setvbuf(stream->fp, NULL, _IONBF, 0);
+    fflush(*std);
+    *std = stream->fp;
+}
+
+__attribute__((constructor))
+static void preload_init()
+{
+    struct shmlog_attr attr = {
+        .nmsg = PRELOAD_NMSG_DEFAULT, .remove_unused = 1, .prio_nmsg = 0, .prio_level = SHMLOG_LEVEL_ERROR,
+    };
+    const char *env;
+    char *end;
+    long val;
+    env = getenv("SHMLOG_PRELOAD_FDS");
+    for ( env = (NULL != env) ? env : "2"; '\0' != *env && g_nfd < PRELOAD_FD_MAX; env = ('\0' != *end) ? end + 1 : end ) {
+        val = strtol(env, &end, 10);
+        if ( end == env || val < 0 ) {
+            break;
+        }
+        atomic_init(&g_fds[g_nfd++], val);
+    }
+    if ( (env = getenv("SHMLOG_PRELOAD_NMSG")) != NULL && (val = atol(env)) > 0 ) {
+        attr.nmsg = val;
+    }
+    if ( (env = getenv("SHMLOG_PRELOAD_PRIO_NMSG")) != NULL && (val = atol(env)) > 0 ) {
+        attr.prio_nmsg = val;
+    }
+    attr.path = getenv("SHMLOG_PRELOAD_PATH");
+    if ( (env = getenv("SHMLOG_PRELOAD_SYSLOG")) != NULL ) {
+        g_syslog = atoi(env);
+    }
+    if ( (env = getenv("SHMLOG_PRELOAD_TEE")) != NULL ) {
+        g_tee = atoi(env);
+    }
+    t_busy = 1;
+    if ( shmlog_init_attr(&attr) < 0 ) {
+        t_busy = 0;
+        return; // everything goes to the real calls
+    }
+    t_busy = 0;
+    pthread_key_create(&g_lines_key, flush_lines);
+    atexit(onexit); // before libshmlog's one, so the lines are in the ring when it's marked clean
+    g_ready = 1;
+    for ( int i = 0; i < g_nfd; i++ ) {
+        if ( STDOUT_FILENO == atomic_load(&g_fds[i]) && NULL == own_stream(stdout) ) {
+            replace_stream(i, &stdout);
+        } else if ( STDERR_FILENO == atomic_load(&g_fds[i]) && NULL == own_stream(stderr) ) {
+            replace_stream(i, &stderr);
+        }
+    }
+}
+
+/*
+ * write(2)
+ */
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    const int idx = hooked_fd(fd);
+    if ( idx < 0 ) {
+        return REAL(write)(fd, buf, count);
+    }
+    pthread_setspecific(g_lines_key, t_lines);
+    feed(idx, buf, count);
+    return g_tee ? REAL(write)(fd, buf, count) : (ssize_t)count;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    const int idx = hooked_fd(fd);
+    ssize_t total = 0;
+    if ( idx < 0 ) {
+        return REAL(writev)(fd, iov, iovcnt);
+    }
+    pthread_setspecific(g_lines_key, t_lines);
+    for ( int i = 0; i < iovcnt; i++ ) {
+        feed(idx, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return g_tee ? REAL(writev)(fd, iov, iovcnt) : total;
+}
+
+/*
+ * close(2), dup2(2), dup3(2): the fd isn't the one which was hooked any more,
+ * its writes go to the real calls, and fail as they should once it's closed
+ */
+static void drop_fd(int fd)
+{
+    if ( !g_ready || t_busy ) {
+        return;
+    }
+    for ( int i = 0; i < g_nfd; i++ ) {
+        if ( atomic_load(&g_fds[i]) == fd ) {
+            if ( t_lines[i].len > 0 ) {
+                emit_line(i, t_lines[i].buf, t_lines[i].len);
+                t_lines[i].len = 0;
+            }
+            atomic_store(&g_fds[i], -1);
+        }
+    }
+}
+
+int close(int fd)
+{
+    drop_fd(fd);
+    return REAL(close)(fd);
+}
+
+int dup2(int oldfd, int newfd)
+{
+    const int ret = REAL(dup2)(oldfd, newfd);
+    if ( ret >= 0 && oldfd != newfd ) {
+        drop_fd(newfd);
+    }
+    return ret;
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    const int ret = REAL(dup3)(oldfd, newfd, flags);
+    if ( ret >= 0 ) {
+        drop_fd(newfd);
+    }
+    return ret;
+}
+
+int fclose(FILE *stream)
+{
+    struct preload_stream *own = own_stream(stream);
+    if ( NULL != stream ) {
+        drop_fd(fileno(stream));
+    }
+    if ( NULL != own ) {
+        own->fp = NULL; // the address may be reused by another stream
+    }
+    return REAL(fclose)(stream);
+}
+
+// a replaced stream has the fd of the one it replaces, e.g. for isatty(fileno(stderr))
+int fileno(FILE *stream)
+{
+    const struct preload_stream *own = own_stream(stream);
+    return (NULL != own) ? own->fd : REAL(fileno)(stream);
+}
+
+int fileno_unlocked(FILE *stream)
+{
+    const struct preload_stream *own = own_stream(stream);
+    return (NULL != own) ? own->fd : REAL(fileno_unlocked)(stream);
+}
+
+/*
+ * dprintf(3) writes the fd without the write hook
+ */
+int vdprintf(int fd, const char *fmt, va_list ap)
+{
+    const int idx = hooked_fd(fd);
+    if ( idx < 0 || g_tee ) {
+        va_list ap2;
+        int ret;
+        va_copy(ap2, ap);
+        ret = REAL(vdprintf)(fd, fmt, ap2);
+        va_end(ap2);
+        if ( idx < 0 ) {
+            return ret;
+        }
+    }
+    pthread_setspecific(g_lines_key, t_lines);
+    return vfeed(idx, fmt, ap);
+}
+
+int dprintf(int fd, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vdprintf(fd, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int __vdprintf_chk(int fd, int flag, const char *fmt, va_list ap)
+{
+    return vdprintf(fd, fmt, ap);
+}
+
+int __dprintf_chk(int fd, int flag, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vdprintf(fd, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/*
+ * stdio, the calls which compilers may turn printf-like ones into are hooked too
+ */
+#define STDIO_HOOK(stream, real_call, feed_call, ret)   \
+    do {                                                \
+        const int idx = hooked_stream(stream);          \
+        if ( idx < 0 || g_tee ) {                       \
+            ret = real_call;                            \
+            if ( idx < 0 ) {                            \
+                break;                                  \
+            }                                           \
+        }                                               \
+        pthread_setspecific(g_lines_key, t_lines);      \
+        feed_call;                                      \
+    } while ( 0 )
+
+int vfprintf(FILE *stream, const char *fmt, va_list ap)
+{
+    const int idx = hooked_stream(stream);
+    if ( idx < 0 || g_tee ) {
+        va_list ap2;
+        int ret;
+        va_copy(ap2, ap);
+        ret = REAL(vfprintf)(stream, fmt, ap2);
+        va_end(ap2);
+        if ( idx < 0 ) {
+            return ret;
+        }
+    }
+    pthread_setspecific(g_lines_key, t_lines);
+    return vfeed(idx, fmt, ap);
+}
+
+int fprintf(FILE *stream, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vfprintf(stream, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int __vfprintf_chk(FILE *stream, int flag, const char *fmt, va_list ap)
+{
+    return vfprintf(stream, fmt, ap);
+}
+
+int __fprintf_chk(FILE *stream, int flag, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vfprintf(stream, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int vprintf(const char *fmt, va_list ap)
+{
+    return vfprintf(stdout, fmt, ap);
+}
+
+int printf(const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int __vprintf_chk(int flag, const char *fmt, va_list ap)
+{
+    return vfprintf(stdout, fmt, ap);
+}
+
+int __printf_chk(int flag, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+    va_start(ap, fmt);
+    ret = vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int fputs(const char *s, FILE *stream)
+{
+    int ret = 0;
+    STDIO_HOOK(stream, REAL(fputs)(s, stream), feed(idx, s, strlen(s)), ret);
+    return ret;
+}
+
+int puts(const char *s)
+{
+    int ret = 0;
+    STDIO_HOOK(stdout, REAL(puts)(s), (feed(idx, s, strlen(s)), feed(idx, "\n", 1)), ret);
+    return ret;
+}
+
+int fputc(int c, FILE *stream)
+{
+    const char ch = c;
+    int ret = (unsigned char)c;
+    STDIO_HOOK(stream, REAL(fputc)(c, stream), feed(idx, &ch, 1), ret);
+    return ret;
+}
+
+int putc(int c, FILE *stream)
+{
+    return fputc(c, stream);
+}
+
+int putchar(int c)
+{
+    return fputc(c, stdout);
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    size_t ret = nmemb;
+    STDIO_HOOK(stream, REAL(fwrite)(ptr, size, nmemb, stream), feed(idx, ptr, size * nmemb), ret);
+    return ret;
+}
+
+/*
+ * syslog: one message per call, errors and above go to the priority lane
+ */
+static int syslog_level(int priority)
+{
+    switch ( LOG_PRI(priority) ) {
+        case LOG_EMERG:
+        case LOG_ALERT:
+        case LOG_CRIT:
+            return SHMLOG_LEVEL_FATAL;
+        case LOG_ERR:
+            return SHMLOG_LEVEL_ERROR;
+        case LOG_WARNING:
+            return SHMLOG_LEVEL_WARN;
+        case LOG_DEBUG:
+            return SHMLOG_LEVEL_DEBUG;
+        default:
+            return SHMLOG_LEVEL_INFO;
+    }
+}
+
+void openlog(const char *ident, int option, int facility)
+{
+    g_ident = ident;
+    REAL(openlog)(ident, option, facility);
+}
+
+void vsyslog(int priority, const char *fmt, va_list ap)
+{
+    const int errno_bak = errno;
+    char efmt[PRELOAD_FORMAT_SIZE], msg[SHMLOG_MSG_BODY_SIZE+1];
+    const char *err;
+    size_t n = 0, len = 0;
+    va_list ap2;
+    int ret = -1;
+    if ( g_syslog && g_ready && !t_busy ) {
+        // %m is the message of errno, which vsnprintf doesn't know
+        for ( const char *p = fmt; '\0' != *p && n + 1 < sizeof(efmt); p++ ) {
+            if ( '%' == p[0] && 'm' == p[1] ) {
+                for ( err = strerror(errno_bak); '\0' != *err && n + 2 < sizeof(efmt); err++ ) {
+                    if ( '%' == *err ) {
+                        efmt[n++] = '%';
+                    }
+                    efmt[n++] = *err;
+                }
+                p++;
+            } else {
+                efmt[n++] = *p;
+                if ( '%' == p[0] && '%' == p[1] && n + 1 < sizeof(efmt) ) {
+                    efmt[n++] = *++p;
+                }
+            }
+        }
+        efmt[n] = '\0';
+        if ( NULL != g_ident ) {
+            len = snprintf(msg, sizeof(msg), "%s: ", g_ident);
+        }
+        if ( len < sizeof(msg) ) {
+            va_copy(ap2, ap);
+            len += vsnprintf(msg + len, sizeof(msg) - len, efmt, ap2);
+            va_end(ap2);
+        }
+        if ( len >= sizeof(msg) ) {
+            len = sizeof(msg) - 1;
+        }
+        while ( len > 0 && '\n' == msg[len-1] ) {
+            len--;
+        }
+        t_busy = 1;
+        ret = shmlog_write_level(syslog_level(priority), msg, len);
+        t_busy = 0;
+        if ( ret >= 0 && !g_tee ) {
+            return;
+        }
+        errno = errno_bak;
+    }
+    REAL(vsyslog)(priority, fmt, ap);
+}
+
+void syslog(int priority, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsyslog(priority, fmt, ap);
+    va_end(ap);
+}
+
+void __vsyslog_chk(int priority, int flag, const char *fmt, va_list ap)
+{
+    vsyslog(priority, fmt, ap);
+}
+
+void __syslog_chk(int priority, int flag, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsyslog(priority, fmt, ap);
+    va_end(ap);
+}
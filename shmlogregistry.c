@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "shmlogregistry.h"
+
+#if 1
+#define LOG(fmt, arg...) fprintf(stderr, fmt, ##arg)
+#else
+#define LOG(fmt, arg...)
+#endif
+
+
+struct shmlog_registry *shmlogregistry_open(int create)
+{
+    const size_t size = sizeof(struct shmlog_registry);
+    struct shmlog_registry *reg;
+    struct stat statbuf;
+    unsigned magic = 0;
+    int fd;
+    fd = shm_open(SHMLOG_REGISTRY_NAME, create ? (O_CREAT|O_RDWR) : O_RDWR, 0666);
+    if ( fd < 0 ) {
+        return NULL;
+    }
+    if ( fstat(fd, &statbuf) < 0 ) {
+        close(fd);
+        return NULL;
+    }
+    if ( statbuf.st_size < size ) {
+        // a zero-filled registry is empty, so whoever comes first sets the size
+        if ( !create || ftruncate(fd, size) < 0 ) {
+            close(fd);
+            return NULL;
+        }
+        fchmod(fd, 0666); // all users register into it
+    }
+    reg = (struct shmlog_registry *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( MAP_FAILED == reg ) {
+        return NULL;
+    }
+    if ( !atomic_compare_exchange_strong(&reg->magic, &magic, SHMLOG_REGISTRY_MAGIC) && SHMLOG_REGISTRY_MAGIC != magic ) {
+        LOG("[dengjfzh/libshmlog] Error: invalid registry magic 0x%08x! %s:%d\n", magic, __FILE__, __LINE__);
+        munmap(reg, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    reg->nentry = SHMLOG_REGISTRY_NENTRY;
+    return reg;
+}
+
+void shmlogregistry_close(struct shmlog_registry *reg)
+{
+    if ( NULL != reg ) {
+        munmap(reg, sizeof(struct shmlog_registry));
+    }
+}
+
+static void read_cmdline(char *buf, size_t size)
+{
+    ssize_t len;
+    int fd;
+    buf[0] = '\0';
+    fd = open("/proc/self/cmdline", O_RDONLY);
+    if ( fd < 0 ) {
+        return;
+    }
+    len = read(fd, buf, size-1);
+    close(fd);
+    if ( len < 0 ) {
+        len = 0;
+    }
+    for ( ssize_t i = 0; i < (len-1); i++ ) {
+        if ( '\0' == buf[i] )
+            buf[i] = ' ';
+    }
+    buf[len] = '\0';
+}
+
+int shmlogregistry_add(struct shmlog_registry *reg, pid_t pid, pid_t ppid, const char *name, uint32_t nmsg, uint64_t size)
+{
+    struct shmlog_registry_entry *ent;
+    int idx, expected;
+    if ( NULL == reg ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // claim a free entry, or the stale one of the same pid, even if it was left half registered
+    for ( idx = 0; idx < SHMLOG_REGISTRY_NENTRY; idx++ ) {
+        ent = &reg->entries[idx];
+        expected = atomic_load(&ent->pid);
+        if ( (0 == expected || pid == expected || -pid == expected) &&
+             atomic_compare_exchange_strong(&ent->pid, &expected, -pid) ) {
+            break;
+        }
+    }
+    if ( idx >= SHMLOG_REGISTRY_NENTRY ) {
+        errno = ENOSPC;
+        return -1;
+    }
+    ent->nmsg = nmsg;
+    ent->size = size;
+    ent->start_time = time(NULL);
+    atomic_store(&ent->heartbeat, ent->start_time);
+    ent->uid = getuid();
+    ent->ppid = ppid;
+    strncpy(ent->name, name, sizeof(ent->name)-1);
+    ent->name[sizeof(ent->name)-1] = '\0';
+    read_cmdline(ent->cmdline, sizeof(ent->cmdline));
+    // publish
+    atomic_store(&ent->pid, pid);
+    return idx;
+}
+
+void shmlogregistry_remove(struct shmlog_registry *reg, int idx, pid_t pid)
+{
+    if ( NULL == reg || idx < 0 || idx >= SHMLOG_REGISTRY_NENTRY ) {
+        return;
+    }
+    atomic_compare_exchange_strong(&reg->entries[idx].pid, &pid, 0);
+}
+
+struct shmlog_registry_entry *shmlogregistry_find(struct shmlog_registry *reg, pid_t pid)
+{
+    if ( NULL == reg || pid <= 0 ) {
+        return NULL;
+    }
+    for ( int idx = 0; idx < SHMLOG_REGISTRY_NENTRY; idx++ ) {
+        if ( atomic_load(&reg->entries[idx].pid) == pid ) {
+            return &reg->entries[idx];
+        }
+    }
+    return NULL;
+}
+
+int shmlogregistry_remove_dead(struct shmlog_registry *reg)
+{
+    struct shmlog_registry_entry *ent;
+    char name[sizeof(ent->name)];
+    int removed = 0;
+    pid_t pid;
+    if ( NULL == reg ) {
+        errno = EINVAL;
+        return -1;
+    }
+    for ( int idx = 0; idx < SHMLOG_REGISTRY_NENTRY; idx++ ) {
+        ent = &reg->entries[idx];
+        pid = atomic_load(&ent->pid);
+        if ( 0 == pid || kill((pid > 0) ? pid : -pid, 0) == 0 || ESRCH != errno ) {
+            continue;
+        }
+        if ( pid > 0 ) {
+            memcpy(name, ent->name, sizeof(name));
+        } else { // crashed while registering, the name may not have been written
+            snprintf(name, sizeof(name), SHMLOG_FILE_PREFIX "%d", -pid);
+        }
+        // who removes the entry unlinks the segment
+        if ( atomic_compare_exchange_strong(&ent->pid, &pid, 0) ) {
+            LOG("found shm with pid %d, but process is not exist!\n", (pid > 0) ? pid : -pid);
+            if ( shm_unlink(name) >= 0 ) {
+                LOG("file '%s' has been deleted.\n", name);
+            }
+            removed++;
+        }
+    }
+    return removed;
+}
@@ -0,0 +1,54 @@
+#ifndef __DENGJFZH_SHMLOGREGISTRY_H__
+#define __DENGJFZH_SHMLOGREGISTRY_H__
+
+#include <sys/types.h>
+#include "libshmlog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Registry: a well-known shared memory segment where rings register and
+ * deregister themselves, so discovery, stale cleanup and listing scan one
+ * small mapping instead of /dev/shm and /proc.
+ */
+
+#define SHMLOG_REGISTRY_NAME SHMLOG_FILE_PREFIX "registry"
+#define SHMLOG_REGISTRY_MAGIC 0x3247474c // "LGG2"
+#define SHMLOG_REGISTRY_NENTRY 1024
+#define SHMLOG_REGISTRY_HEARTBEAT_MASK 0xff // producers update the heartbeat every 256 writes
+
+struct shmlog_registry_entry {
+    atomic_int pid;          // 0: free, < 0: being registered by -pid
+    uint32_t nmsg;
+    uint64_t size;           // size of the ring segment
+    uint64_t start_time;     // seconds since epoch
+    atomic_ullong heartbeat; // seconds since epoch of the latest activity
+    int32_t uid;
+    int32_t ppid;            // pid of the process which the ring's owner is forked from, 0 if it isn't forked
+    char name[40];           // name of the ring segment
+    char cmdline[172];
+};
+
+struct shmlog_registry {
+    atomic_uint magic;
+    uint32_t nentry;
+    uint8_t reserves[SHMLOG_MSG_SIZE-2*sizeof(uint32_t)];
+    struct shmlog_registry_entry entries[SHMLOG_REGISTRY_NENTRY];
+};
+
+struct shmlog_registry *shmlogregistry_open(int create); // return NULL on error
+void shmlogregistry_close(struct shmlog_registry *reg);
+// register a ring, return the entry index or -1 if the registry is full
+int shmlogregistry_add(struct shmlog_registry *reg, pid_t pid, pid_t ppid, const char *name, uint32_t nmsg, uint64_t size);
+void shmlogregistry_remove(struct shmlog_registry *reg, int idx, pid_t pid);
+struct shmlog_registry_entry *shmlogregistry_find(struct shmlog_registry *reg, pid_t pid); // NULL if not found
+// remove the entries and ring segments of dead processes, return the number of removed
+int shmlogregistry_remove_dead(struct shmlog_registry *reg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*__DENGJFZH_SHMLOGREGISTRY_H__*/
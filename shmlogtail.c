@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
@@ -8,9 +12,18 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
 #include "libshmlogclient.h"
+#include "shmlogarchive.h"
+#include "shmlogregistry.h"
+#include "shmlogmetrics.h"
 
 #define GET_HEAD(ht) SHMLOG_GET_HEAD(ht)
 #define GET_TAIL(ht) SHMLOG_GET_TAIL(ht)
@@ -18,8 +31,13 @@
 #define INTHEAD_MAX SHMLOG_INTHEAD_MAX
 
 #define SHMLOG_FILE_PATH "/dev/shm"
+#define LIST_DEPTH_MAX 16 // of the tree of forked processes
 
-static int g_requestExit = 0;
+#define OUTPUT_BATCH_MAX (IOV_MAX/2) // every message takes two iovec: body and '\n'
+#define OUTPUT_PENDING_MAX 4         // batches which are still referenced by the pipe (splice mode)
+#define OUTPUT_ARCHIVE_CKPT_MS 1000  // the archive is flushed and checkpointed this often under load
+
+static atomic_int g_requestExit = 0; // set by the signal handler, read by the pipeline threads too
 
 void sig_handle(int sig)
 {
@@ -113,13 +131,29 @@ int get_process_info(pid_t pid, struct process_info_t *info)
     return 0;
 }
 
-int list()
+static void format_size(size_t size, char *size_str, size_t len)
+{
+    if ( size < 1024 ) {
+        snprintf(size_str, len, "%d", (int)size);
+    } else if ( size < 1024*10 ) {
+        snprintf(size_str, len, "%.1fK", size/1024.0F);
+    } else if ( size < 1024*1024 ) {
+        snprintf(size_str, len, "%dK", (int)(size/1024));
+    } else if ( size < 1024*1024*10 ) {
+        snprintf(size_str, len, "%.1fM", size/1048576.0F);
+    } else {
+        snprintf(size_str, len, "%dM", (int)(size/1048576));
+    }
+}
+
+// list rings by scanning shared memory directory, the ones which aren't in the registry if there is one
+static int list_dir(struct shmlog_registry *reg)
 {
     char size_str[16];
     struct stat statbuf;
     DIR *dir;
     struct dirent *dent;
-    int pid, ret;
+    int pid, ret, n;
     dir = opendir(SHMLOG_FILE_PATH);
     if ( NULL == dir ) {
         return -1;
@@ -127,25 +161,17 @@ int list()
     while ( (dent = readdir(dir)) != NULL ) {
         if ( DT_REG == dent->d_type ) {
             //fprintf(stderr, "\tfind shm: %s, type=0x%x\n", dent->d_name, dent->d_type);
-            if ( sscanf(dent->d_name, SHMLOG_FILE_PREFIX "%d", &pid) == 1 && pid > 0 ) {
+            // not the rings replaced by a resize, "<pid>.<n>"
+            n = 0;
+            if ( sscanf(dent->d_name, SHMLOG_FILE_PREFIX "%d%n", &pid, &n) == 1 && pid > 0 && '\0' == dent->d_name[n] &&
+                 NULL == shmlogregistry_find(reg, pid) ) {
                 // get shared memory size
                 ret = fstatat(dirfd(dir), dent->d_name, &statbuf, 0);
                 if ( ret < 0 ) {
                     fprintf(stderr, "Error: get shared memory size failed, %d:%s\n", errno, strerror(errno));
                     size_str[0] = '\0';
                 } else {
-                    int size = (int)statbuf.st_size;
-                    if ( size < 1024 ) {
-                        snprintf(size_str, sizeof(size_str), "%d", size);
-                    } else if ( size < 1024*10 ) {
-                        snprintf(size_str, sizeof(size_str), "%.1fK", size/1024.0F);
-                    } else if ( size < 1024*1024 ) {
-                        snprintf(size_str, sizeof(size_str), "%dK", size/1024);
-                    } else if ( size < 1024*1024*10 ) {
-                        snprintf(size_str, sizeof(size_str), "%.1fM", size/1048576.0F);
-                    } else {
-                        snprintf(size_str, sizeof(size_str), "%dM", size/1048576);
-                    }
+                    format_size(statbuf.st_size, size_str, sizeof(size_str));
                 }
                 printf("%d  %s  ", pid, size_str);
                 // get process info
@@ -167,6 +193,61 @@ int list()
     return 0;
 }
 
+static void list_entry(struct shmlog_registry_entry *ent, pid_t pid, int depth, time_t now)
+{
+    char size_str[16], username[16];
+    struct passwd *pwd;
+    format_size(ent->size, size_str, sizeof(size_str));
+    printf("%*s%d  %d  %s  ", depth * 2, "", pid, ent->ppid, size_str);
+    if ( kill(pid, 0) < 0 && ESRCH == errno ) {
+        printf("Process not found!\n");
+        return;
+    }
+    pwd = getpwuid(ent->uid);
+    if ( NULL == pwd ) {
+        snprintf(username, sizeof(username), "Uid:%d", ent->uid);
+    } else {
+        snprintf(username, sizeof(username), "%s", pwd->pw_name);
+    }
+    printf("%s  %lds  %s\n", username, (long)(now - (time_t)atomic_load(&ent->heartbeat)), ent->cmdline);
+}
+
+// list rings whose parent is `ppid`, and their children under them
+static void list_children(struct shmlog_registry *reg, pid_t ppid, int depth, time_t now)
+{
+    struct shmlog_registry_entry *ent;
+    pid_t pid;
+    for ( int idx = 0; idx < reg->nentry; idx++ ) {
+        ent = &reg->entries[idx];
+        pid = atomic_load(&ent->pid);
+        if ( pid <= 0 || pid == ppid ) {
+            continue;
+        }
+        // the root level: rings which aren't forked, or whose parent has no ring
+        if ( (0 == depth) ? (ent->ppid > 0 && NULL != shmlogregistry_find(reg, ent->ppid)) : (ent->ppid != ppid) ) {
+            continue;
+        }
+        list_entry(ent, pid, depth, now);
+        if ( depth < LIST_DEPTH_MAX ) { // pids may be reused
+            list_children(reg, pid, depth + 1, now);
+        }
+    }
+}
+
+int list()
+{
+    struct shmlog_registry *reg;
+    int ret;
+    reg = shmlogregistry_open(0);
+    if ( NULL != reg ) {
+        list_children(reg, 0, 0, time(NULL));
+    }
+    // rings of old versions, or of processes which found the registry full
+    ret = list_dir(reg);
+    shmlogregistry_close(reg);
+    return ret;
+}
+
 int info(pid_t pid)
 {
     struct shm_log_client_t client;
@@ -191,6 +272,24 @@ int info(pid_t pid)
     }
 
     printf("nmsg: %d\n", client.hdr->nmsg);
+
+    // parent and children of forked processes
+    struct shmlog_registry *reg = shmlogregistry_open(0);
+    if ( NULL != reg ) {
+        struct shmlog_registry_entry *ent = shmlogregistry_find(reg, pid);
+        if ( NULL != ent && ent->ppid > 0 ) {
+            printf("parent: %d\n", ent->ppid);
+        }
+        printf("children:");
+        for ( int idx = 0; idx < reg->nentry; idx++ ) {
+            pid_t child = atomic_load(&reg->entries[idx].pid);
+            if ( child > 0 && child != pid && reg->entries[idx].ppid == pid ) {
+                printf(" %d", child);
+            }
+        }
+        printf("\n");
+        shmlogregistry_close(reg);
+    }
     
     consumer_pid = atomic_load(&client.hdr->consumer_pid);
     printf("consumer: %d", consumer_pid);
@@ -216,172 +315,1674 @@ int info(pid_t pid)
     return 0;
 }
 
-int main(int argc, char *argv[])
+int stats(pid_t pid)
 {
-    static const char *usage = "Usage: dtracetail [options]... [pid]\n" \
-            "output the last party of dtrace ring buffer.\n\n"          \
-            "options:\n"                                                \
-            "  -h,--help\n"                                             \
-            "  -p,--pid <number>\n"                                     \
-            "  -b,--block         Start in blocking mode.\n"            \
-            "                     Note: log messages are not lost, but write performance may be reduced!\n" \
-            "  -d,--drop          Drop some messages to speed up processing When the buffer will be full.\n" \
-            "  -l,--list          List the PID of all the processes that open shmlog and exit.\n" \
-            "  -i,--info          Displays shmlog information for the specified PID process and exits.\n" \
-            "";
-    static struct option opts[] = {
-        {"help", 0, NULL, 'h'},
-        {"pid", 1, NULL, 'p'},
-        {"block", 0, NULL, 'b'},
-        {"drop", 0, NULL, 'd'},
-        {"list", 0, NULL, 'l'},
-        {"info", 0, NULL, 'i'},
-        {NULL, 0, NULL, 0}
-    };
-    pid_t pid = -1;
-    int block = 0, drop_in_emergency = 0;
-    int o, ret;
     struct shm_log_client_t client;
-    size_t lost;
-    int64_t total_read, total_lost, total_lost_cnt, total_drop;
-    char buf[1024];
+    shmlog_int_headtail headtail;
+    int ret;
 
-    // test
-    printf("shmlogtail: ");
-    for ( ret = 0; ret < argc; ret++ ) {
-        printf("%s ", argv[ret]);
-    }
-    printf("\n");
-    // test end
-    
-    // command line parse
-    opterr = 0;
-    while ( (o = getopt_long(argc, argv, ":hp:bdli:", opts, NULL)) != EOF ) {
-        switch ( o ) {
-            case 'h':
-                puts(usage);
-                return 0;
-            case 'p':
-                if ( sscanf(optarg, "%d", &pid) != 1 || pid <= 0 ) {
-                    fprintf(stderr, "Error: invalid pid '%s'!\n", optarg);
-                    return 1;
-                }
-                break;
-            case 'b':
-                block = 1;
-                break;
-            case 'd':
-                drop_in_emergency = 1;
-                break;
-            case 'l':
-                return list();
-            case 'i':
-                if ( sscanf(optarg, "%d", &pid) != 1 || pid <= 0 ) {
-                    fprintf(stderr, "Error: invalid pid '%s'!\n", optarg);
-                    return 1;
-                }
-                return info(pid);
-            case ':':
-                fprintf(stderr, "Error: missing option argument for option '%s'!\n", argv[optind-1]);
-                return 1;
-            case '?':
-                fprintf(stderr, "Error: unknown options '%s'!\n", argv[optind-1]);
-                return 1;
-            default:
-                fprintf(stderr, "Warning: unknown options '%c'!\n", o);
-        }
+    ret = shmlogclient_init(pid, &client, 1);
+    if ( ret < 0 ) {
+        fprintf(stderr, "Error: initialize failed! %d:%s\n", errno, strerror(errno));
+        return 1;
     }
-    if ( optind < argc ) {
-        pid_t pid2;
-        if ( sscanf(argv[optind], "%d", &pid2) != 1 || pid2 <= 0 ) {
-            fprintf(stderr, "Error: invalid pid '%s'!\n", argv[optind]);
-            return 1;
-        }
-        if ( pid > 0 ) {
-            fprintf(stderr, "Warning: Previous pid '%d' are overwritten!\n", pid);
-        }
-        pid = pid2;
-        if ( (optind+1) < argc ) {
-            fprintf(stderr, "Error: unknown argument '%s'!\n", argv[optind+1]);
-            return 1;
-        }
+
+    headtail = atomic_load(&client.hdr->headtail);
+    printf("pid: %d\n", pid);
+    printf("nmsg: %d\n", client.hdr->nmsg);
+    printf("used: %d\n", GET_TAIL(headtail) - GET_HEAD(headtail));
+    if ( client.hdr->prio_nmsg > 0 ) {
+        headtail = atomic_load(&client.hdr->prio_headtail);
+        printf("priority lane: %u messages, used %d, level >= %d\n", client.hdr->prio_nmsg,
+               GET_TAIL(headtail) - GET_HEAD(headtail), atomic_load(&client.hdr->prio_level));
     }
-    if ( pid <= 0 ) {
-        fprintf(stderr, "pid is not specify!\n");
+    printf("abandoned writes: %u\n", atomic_load(&client.hdr->abandoned_writes));
+    printf("abandoned reads: %u\n", atomic_load(&client.hdr->abandoned_reads));
+    printf("overrun reads: %u\n", atomic_load(&client.hdr->overrun_reads));
+    printf("suppressed: %u\n", atomic_load(&client.hdr->suppressed));
+    printf("site limit: rate %u/s, burst %u, sample 1/%u\n", atomic_load(&client.hdr->site_rate),
+           atomic_load(&client.hdr->site_burst), atomic_load(&client.hdr->site_sample));
+    printf("repeated: %u\n", atomic_load(&client.hdr->repeated));
+    printf("dedup window: %ums\n", atomic_load(&client.hdr->dedup_ms));
+
+    shmlogclient_uninit(&client);
+
+    return 0;
+}
+
+// set the limits of all call sites, a negative value keeps the current one
+int set_site_limit(pid_t pid, int64_t rate, int64_t burst, int64_t sample)
+{
+    struct shm_log_client_t client;
+    int ret;
+
+    ret = shmlogclient_init(pid, &client, 1);
+    if ( ret < 0 ) {
+        fprintf(stderr, "Error: initialize failed! %d:%s\n", errno, strerror(errno));
         return 1;
     }
-    fprintf(stderr, "pid = %d\n", pid);
+    if ( rate < 0 ) {
+        rate = atomic_load(&client.hdr->site_rate);
+        burst = atomic_load(&client.hdr->site_burst);
+    }
+    if ( sample < 0 ) {
+        sample = atomic_load(&client.hdr->site_sample);
+    }
+    shmlogclient_set_site_limit(&client, rate, burst, sample);
+    printf("site limit of %d: rate %u/s, burst %u, sample 1/%u\n", pid, (unsigned)rate, (unsigned)burst, (unsigned)sample);
+    shmlogclient_uninit(&client);
 
-    // open shm
-    ret = shmlogclient_init(pid, &client, !block);
+    return 0;
+}
+
+int set_dedup(pid_t pid, unsigned window_ms)
+{
+    struct shm_log_client_t client;
+    int ret;
+
+    ret = shmlogclient_init(pid, &client, 1);
     if ( ret < 0 ) {
         fprintf(stderr, "Error: initialize failed! %d:%s\n", errno, strerror(errno));
         return 1;
     }
+    shmlogclient_set_dedup(&client, window_ms);
+    printf("dedup of %d: %s, window %ums\n", pid, window_ms ? "enabled" : "disabled", window_ms);
+    shmlogclient_uninit(&client);
 
-    // install signal handle
-    signal(SIGINT, sig_handle);
+    return 0;
+}
 
-    // core loop
-    total_read = 0;
-    total_lost = 0;
-    total_lost_cnt = 0;
-    total_drop = 0;
-    while ( !g_requestExit ) {
+// the producer resizes its ring at its next writes, wait a moment for it
+int resize(pid_t pid, unsigned nmsg)
+{
+    struct shm_log_client_t client;
+    int ret, wait_ms;
 
-        ret = shmlogclient_read(&client, buf, sizeof(buf), &lost, 1000*500);
-        if ( ret < 0 ) {
-            if ( ETIMEDOUT == errno ) {
-                usleep(1000*10);
-            } else  {
-                fprintf(stderr, "Error: read message! %d:%s\n", errno, strerror(errno));
-                break;
-            }
+    ret = shmlogclient_init(pid, &client, 1);
+    if ( ret < 0 ) {
+        fprintf(stderr, "Error: initialize failed! %d:%s\n", errno, strerror(errno));
+        return 1;
+    }
+    if ( client.hdr->nmsg == nmsg ) {
+        printf("ring of %d: %u messages already\n", pid, nmsg);
+        shmlogclient_uninit(&client);
+        return 0;
+    }
+    shmlogclient_resize(&client, nmsg);
+    for ( wait_ms = 0; wait_ms < 2000 && 0 == atomic_load(&client.hdr->moved); wait_ms += 10 ) {
+        usleep(10 * 1000);
+    }
+    if ( 0 != atomic_load(&client.hdr->moved) ) {
+        printf("ring of %d: resized from %u to %u messages\n", pid, client.hdr->nmsg, nmsg);
+    } else {
+        fprintf(stderr, "Warning: ring of %d isn't resized yet, it will be at the next writes of the producer\n", pid);
+    }
+    shmlogclient_uninit(&client);
+
+    return 0;
+}
+
+/*
+ * dump: print the messages of a persistent ring offline, without touching it,
+ * e.g. after a crash or a reboot
+ */
+static void dump_lane(const char *lane, shmlog_int_headtail headtail, uint32_t nmsg, const struct shmlog_msg *msgs,
+                      unsigned *torn, unsigned *trace)
+{
+    const shmlog_int_head head = GET_HEAD(headtail), tail = GET_TAIL(headtail);
+    const struct shmlog_msg *msg;
+    if ( head > tail || tail - head > nmsg ) {
+        fprintf(stderr, "Warning: invalid %s lane, head %u tail %u!\n", lane, head, tail);
+        return;
+    }
+    for ( shmlog_int_head i = head; i < tail; i++ ) {
+        msg = &msgs[i % nmsg];
+        if ( !atomic_load(&msg->hdr.filled) || (atomic_load(&msg->hdr.gen) & 1) || msg->hdr.len > SHMLOG_MSG_BODY_SIZE ) {
+            (*torn)++;
+        } else if ( SHMLOG_MSG_TEXT != msg->hdr.type ) {
+            (*trace)++;
         } else {
-            // stat.
-            total_read++;
-            total_lost += lost;
-            if ( lost > 0 ) {
-                total_lost_cnt++;
-            }
-            // output message or drop message to speed up
-            if ( drop_in_emergency && (client.remain * 3) > (client.hdr->nmsg * 2) ) {
-                // drop some message to speed up processing
-                int drop_cnt = 0;
-                while ( (client.remain * 3) >= (client.hdr->nmsg) ) {
-                    ret = shmlogclient_zerocopy_read(&client, NULL, NULL, &lost, 0);
-                    if ( ret < 0 ) {
-                        if ( ETIMEDOUT == errno ) {
-                            break;
-                        } else {
-                            fprintf(stderr, "Error: read message! %d:%s\n", errno, strerror(errno));
-                            break;
-                        }
-                    }
-                    shmlogclient_zerocopy_free(&client, ret);
-                    drop_cnt++;
-                    total_read++;
-                    total_lost += lost;
-                    if ( lost > 0 ) {
-                        total_lost_cnt++;
-                    }
-                }
-                if ( ret < 0 && ETIMEDOUT != errno )
-                    break;
-                fprintf(stderr, "Warning: drop %d messages!\n", drop_cnt);
-                total_drop += drop_cnt;
-            } else {
-                // output message
-                if ( ret > 0 ) {
-                    fwrite(buf, 1, ret, stdout);
+            printf("%.*s\n", (int)msg->hdr.len, msg->body);
+        }
+    }
+}
+
+int dump(const char *path)
+{
+    const struct shmlog_header *hdr;
+    struct stat statbuf;
+    unsigned torn = 0, trace = 0;
+    void *addr;
+    int fd;
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 || fstat(fd, &statbuf) < 0 ) {
+        fprintf(stderr, "Error: open '%s' failed! %d:%s\n", path, errno, strerror(errno));
+        return 1;
+    }
+    addr = (statbuf.st_size >= sizeof(struct shmlog_fullheader)) ?
+           mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if ( MAP_FAILED == addr ) {
+        fprintf(stderr, "Error: '%s' is not a shmlog ring!\n", path);
+        return 1;
+    }
+    hdr = (const struct shmlog_header *)addr;
+    if ( SHMLOG_RING_MAGIC != hdr->magic ||
+         sizeof(struct shmlog_fullheader) + ((size_t)hdr->nmsg + hdr->prio_nmsg) * SHMLOG_MSG_SIZE > statbuf.st_size ) {
+        fprintf(stderr, "Error: '%s' is not a shmlog ring!\n", path);
+        munmap(addr, statbuf.st_size);
+        return 1;
+    }
+    fprintf(stderr, "ring of pid %d, nmsg %u, %s\n", hdr->pid, hdr->nmsg,
+            atomic_load(&hdr->clean) ? "shut down cleanly" : "not shut down cleanly (crashed or still running)");
+    const struct shmlog_msg *msgs = (const struct shmlog_msg *)((const uint8_t *)addr + sizeof(struct shmlog_fullheader));
+    if ( hdr->prio_nmsg > 0 ) {
+        dump_lane("priority", atomic_load(&hdr->prio_headtail), hdr->prio_nmsg, msgs + hdr->nmsg, &torn, &trace);
+    }
+    dump_lane("main", atomic_load(&hdr->headtail), hdr->nmsg, msgs, &torn, &trace);
+    if ( torn > 0 || trace > 0 ) {
+        fprintf(stderr, "%u torn messages, %u trace records skipped\n", torn, trace);
+    }
+    munmap(addr, statbuf.st_size);
+    return 0;
+}
+
+/*
+ * top: sample the counters of every registered ring at an interval, without
+ * consuming from them, and show the rates of the interval
+ */
+enum top_sort {
+    TOP_SORT_MSGS = 0,
+    TOP_SORT_BYTES,
+    TOP_SORT_FILL,
+    TOP_SORT_OVERWRITE,
+    TOP_SORT_PID,
+};
+
+static const char *g_top_sort_names[] = { "msgs", "bytes", "fill", "overwrite", "pid", NULL };
+
+struct top_entry {
+    pid_t pid;
+    struct shm_log_client_t client;
+    int seen;
+    uint64_t nwrite, nbytes, noverwrite, nread, nsuppressed; // the latest sample
+    double msg_rate, byte_rate, overwrite_rate, read_rate, suppressed_rate;
+    double fill; // percent of the main lane
+    pid_t consumer_pid;
+    char cmdline[64];
+};
+
+static struct top_entry g_top[SHMLOG_REGISTRY_NENTRY];
+static int g_top_count = 0;
+static enum top_sort g_top_sort = TOP_SORT_MSGS;
+
+// sample a ring, the rates are of the `dt` seconds since the previous sample
+static void top_sample(struct top_entry *ent, double dt)
+{
+    struct shmlog_header *hdr = ent->client.hdr;
+    shmlog_int_headtail headtail = atomic_load(&hdr->headtail);
+    uint64_t nwrite = atomic_load(&hdr->nwrite), nbytes = atomic_load(&hdr->nbytes);
+    uint64_t noverwrite = atomic_load(&hdr->noverwrite), nread = atomic_load(&hdr->nread);
+    uint64_t nsuppressed = (uint64_t)atomic_load(&hdr->suppressed) + atomic_load(&hdr->repeated);
+    if ( dt > 0 ) {
+        ent->msg_rate = (nwrite - ent->nwrite) / dt;
+        ent->byte_rate = (nbytes - ent->nbytes) / dt;
+        ent->overwrite_rate = (noverwrite - ent->noverwrite) / dt;
+        ent->read_rate = (nread - ent->nread) / dt;
+        ent->suppressed_rate = (nsuppressed - ent->nsuppressed) / dt;
+    }
+    ent->nwrite = nwrite;
+    ent->nbytes = nbytes;
+    ent->noverwrite = noverwrite;
+    ent->nread = nread;
+    ent->nsuppressed = nsuppressed;
+    ent->fill = 100.0 * (GET_TAIL(headtail) - GET_HEAD(headtail)) / hdr->nmsg;
+    ent->consumer_pid = atomic_load(&hdr->consumer_pid);
+}
+
+// open the rings registered since the previous refresh, close the ones gone
+static void top_update(struct shmlog_registry *reg, double dt)
+{
+    struct top_entry *ent;
+    pid_t pid;
+    int i;
+    for ( i = 0; i < g_top_count; i++ ) {
+        g_top[i].seen = 0;
+    }
+    for ( int idx = 0; idx < reg->nentry; idx++ ) {
+        pid = atomic_load(&reg->entries[idx].pid);
+        if ( pid <= 0 ) {
+            continue;
+        }
+        for ( i = 0; i < g_top_count && g_top[i].pid != pid; i++ );
+        ent = &g_top[i];
+        if ( i < g_top_count ) {
+            // resized, the counters go on in the new ring
+            if ( 0 != atomic_load(&ent->client.hdr->moved) ) {
+                shmlogclient_uninit(&ent->client);
+                if ( shmlogclient_init(pid, &ent->client, 1) < 0 ) {
+                    g_top[i] = g_top[--g_top_count];
+                    continue;
                 }
-                fwrite("\n", 1, 1, stdout);
             }
+            ent->seen = 1;
+            top_sample(ent, dt);
+            continue;
+        }
+        if ( g_top_count >= SHMLOG_REGISTRY_NENTRY || shmlogclient_init(pid, &ent->client, 1) < 0 ) {
+            continue;
+        }
+        g_top_count++;
+        ent->pid = pid;
+        ent->seen = 1;
+        snprintf(ent->cmdline, sizeof(ent->cmdline), "%.*s", (int)sizeof(ent->cmdline) - 1, reg->entries[idx].cmdline);
+        top_sample(ent, 0); // rates are known at the next refresh
+        ent->msg_rate = ent->byte_rate = ent->overwrite_rate = ent->read_rate = ent->suppressed_rate = 0;
+    }
+    for ( i = 0; i < g_top_count; ) {
+        if ( g_top[i].seen ) {
+            i++;
+            continue;
         }
+        shmlogclient_uninit(&g_top[i].client);
+        g_top[i] = g_top[--g_top_count];
     }
+}
 
-    // finish
+static int top_compare(const void *a, const void *b)
+{
+    const struct top_entry *x = (const struct top_entry *)a, *y = (const struct top_entry *)b;
+    double dx, dy;
+    switch ( g_top_sort ) {
+        case TOP_SORT_BYTES:
+            dx = x->byte_rate, dy = y->byte_rate;
+            break;
+        case TOP_SORT_FILL:
+            dx = x->fill, dy = y->fill;
+            break;
+        case TOP_SORT_OVERWRITE:
+            dx = x->overwrite_rate, dy = y->overwrite_rate;
+            break;
+        case TOP_SORT_PID:
+            return x->pid - y->pid;
+        default:
+            dx = x->msg_rate, dy = y->msg_rate;
+    }
+    // descending, then by pid
+    return (dx < dy) ? 1 : (dx > dy) ? -1 : x->pid - y->pid;
+}
+
+static void top_print(int interval_ms)
+{
+    char consumer[16], rate[16];
+    struct top_entry *ent;
+    if ( isatty(STDOUT_FILENO) ) {
+        printf("\033[H\033[2J");
+    }
+    printf("shmlog top: %d rings, every %.1fs, sorted by %s\n\n", g_top_count, interval_ms / 1000.0,
+           g_top_sort_names[g_top_sort]);
+    printf("%8s %7s %6s %9s %7s %9s %9s %9s %9s  %s\n",
+           "PID", "NMSG", "FILL%", "MSG/s", "B/s", "OVWR/s", "SUPP/s", "READ/s", "CONSUMER", "COMMAND");
+    qsort(g_top, g_top_count, sizeof(g_top[0]), top_compare);
+    for ( int i = 0; i < g_top_count; i++ ) {
+        ent = &g_top[i];
+        if ( ent->consumer_pid <= 0 ) {
+            snprintf(consumer, sizeof(consumer), "-");
+        } else if ( kill(ent->consumer_pid, 0) < 0 && ESRCH == errno ) {
+            snprintf(consumer, sizeof(consumer), "%d!", ent->consumer_pid); // dead, producers wait for it
+        } else {
+            snprintf(consumer, sizeof(consumer), "%d", ent->consumer_pid);
+        }
+        format_size((size_t)ent->byte_rate, rate, sizeof(rate));
+        printf("%8d %7u %6.1f %9.0f %7s %9.0f %9.0f %9.0f %9s  %s\n", ent->pid, ent->client.hdr->nmsg, ent->fill,
+               ent->msg_rate, rate, ent->overwrite_rate, ent->suppressed_rate, ent->read_rate, consumer, ent->cmdline);
+    }
+    fflush(stdout);
+}
+
+int top(int interval_ms, int count)
+{
+    struct shmlog_registry *reg;
+    struct timespec prev, now;
+    double dt = 0;
+    reg = shmlogregistry_open(0);
+    if ( NULL == reg ) {
+        fprintf(stderr, "Error: open registry failed! %d:%s\n", errno, strerror(errno));
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &prev);
+    for ( int i = 0; !g_requestExit && (count <= 0 || i <= count); i++ ) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        dt = (now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+        prev = now;
+        top_update(reg, dt);
+        if ( i > 0 ) { // the first sample is the baseline
+            top_print(interval_ms);
+        }
+        if ( count <= 0 || i < count ) {
+            usleep(interval_ms * 1000);
+        }
+    }
+    for ( int i = 0; i < g_top_count; i++ ) {
+        shmlogclient_uninit(&g_top[i].client);
+    }
+    g_top_count = 0;
+    shmlogregistry_close(reg);
+    return 0;
+}
+
+/*
+ * output engine
+ *
+ * Messages are leased from the ring buffer in batches by one CAS, then a
+ * batch is written out by one writev() (or vmsplice() when stdout is a pipe),
+ * and the lease is released only after the kernel has taken the data:
+ *   - writev: as soon as the call returns, the data has been copied;
+ *   - splice: the pipe references the pages of the ring buffer, so the batch
+ *             is released after the reader of the pipe has consumed it.
+ * Line mode writes every message through stdio and flushes it at once, it's
+ * used for terminals. Archive mode appends messages to indexed segment files.
+ * Trace records are never output as text, they are converted into Chrome
+ * trace events (JSON) if a trace file is given.
+ */
+enum output_mode {
+    OUTPUT_LINE = 0,
+    OUTPUT_WRITEV,
+    OUTPUT_SPLICE,
+    OUTPUT_ARCHIVE,
+};
+
+struct output_batch {
+    struct shmlog_lease_t lease;
+    int niov;
+    struct iovec iov[OUTPUT_BATCH_MAX*2];
+    uint64_t end; // stream offset after this batch (splice only)
+};
+
+struct output_engine {
+    enum output_mode mode;
+    int fd;
+    struct shm_log_client_t *client;
+    struct shmlog_archive_t *arc; // archive mode only
+    int batch_max; // the number of messages leased in one batch
+    int held_max;  // the number of messages allowed to hold, the remains are left for producers
+    int held;
+    uint64_t spliced; // total bytes have been spliced into pipe
+    struct output_batch batches[OUTPUT_PENDING_MAX];
+    int first, count; // batches[first] is the oldest one, batches[(first+count)%OUTPUT_PENDING_MAX] is the current
+    int64_t overrun;  // messages overwritten by producers while being output
+    FILE *trace;      // Chrome trace event file
+    int64_t ntrace;
+    struct shmlog_checkpoint_t *ckpt; // advanced over every batch output
+    int ckpt_fd;
+    struct timespec ckpt_last; // the last flush of archive with its checkpoint
+    int failed;       // don't checkpoint after an output error
+    const char *match; // output only messages containing it, if not NULL
+    size_t match_len;
+    struct shmlog_metrics_t *metrics; // extracted from every text message, matched or not
+    const char *metrics_out;
+    int metrics_interval_ms;
+    struct timespec metrics_last;
+};
+
+static const char g_newline[1] = {'\n'};
+
+static int output_init(struct output_engine *out, enum output_mode mode, struct shm_log_client_t *client, struct shmlog_archive_t *arc, FILE *trace)
+{
+    struct stat statbuf;
+    memset(out, 0, sizeof(struct output_engine));
+    out->fd = STDOUT_FILENO;
+    out->ckpt_fd = -1;
+    out->client = client;
+    out->arc = arc;
+    out->trace = trace;
+    if ( NULL != trace ) {
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", trace);
+    }
+    if ( OUTPUT_SPLICE == mode ) {
+        if ( fstat(out->fd, &statbuf) < 0 || !S_ISFIFO(statbuf.st_mode) ) {
+            fprintf(stderr, "Warning: stdout is not a pipe, use writev instead of vmsplice!\n");
+            mode = OUTPUT_WRITEV;
+        }
+    }
+    out->mode = mode;
+    // hold half of the ring buffer at most, so producers don't catch up with us
+    out->held_max = client->hdr->nmsg / 2;
+    if ( out->held_max < 1 ) {
+        out->held_max = 1;
+    }
+    out->batch_max = (out->held_max < OUTPUT_BATCH_MAX) ? out->held_max : OUTPUT_BATCH_MAX;
+    if ( OUTPUT_SPLICE == mode && out->batch_max > out->held_max / OUTPUT_PENDING_MAX ) {
+        out->batch_max = out->held_max / OUTPUT_PENDING_MAX;
+        if ( out->batch_max < 1 ) {
+            out->batch_max = 1;
+        }
+    }
+    if ( OUTPUT_LINE == mode ) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    } else {
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static inline struct output_batch *output_current(struct output_engine *out)
+{
+    return &out->batches[(out->first + out->count) % OUTPUT_PENDING_MAX];
+}
+
+// lease of the current batch, to be filled by shmlogclient_lease_acquire
+static inline struct shmlog_lease_t *output_lease(struct output_engine *out)
+{
+    return &output_current(out)->lease;
+}
+
+static void output_checkpoint(struct output_engine *out)
+{
+    if ( pwrite(out->ckpt_fd, out->ckpt, sizeof(*out->ckpt), 0) != sizeof(*out->ckpt) ) {
+        fprintf(stderr, "Error: write checkpoint! %d:%s\n", errno, strerror(errno));
+    }
+}
+
+// archived messages must be flushed before they are checkpointed, which is done every
+// OUTPUT_ARCHIVE_CKPT_MS while the ring is never idle. other outputs are checkpointed every batch
+static int output_batch_checkpoint(struct output_engine *out)
+{
+    struct timespec now;
+    if ( OUTPUT_ARCHIVE != out->mode ) {
+        output_checkpoint(out);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ( (now.tv_sec - out->ckpt_last.tv_sec) * 1000 + (now.tv_nsec - out->ckpt_last.tv_nsec) / 1000000 < OUTPUT_ARCHIVE_CKPT_MS ) {
+        return 0;
+    }
+    out->ckpt_last = now;
+    if ( shmlogarchive_flush(out->arc) < 0 ) {
+        fprintf(stderr, "Error: flush archive! %d:%s\n", errno, strerror(errno));
+        return -1;
+    }
+    output_checkpoint(out);
+    return 0;
+}
+
+// write a snapshot of metrics if the interval has passed, or at once if force
+static void output_metrics(struct output_engine *out, int force)
+{
+    struct timespec now;
+    if ( NULL == out->metrics ) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ( !force && (now.tv_sec - out->metrics_last.tv_sec) * 1000 + (now.tv_nsec - out->metrics_last.tv_nsec) / 1000000 < out->metrics_interval_ms ) {
+        return;
+    }
+    out->metrics_last = now;
+    if ( shmlogmetrics_write(out->metrics, out->client->pid, out->metrics_out) < 0 ) {
+        fprintf(stderr, "Error: write metrics '%s'! %d:%s\n", out->metrics_out, errno, strerror(errno));
+    }
+}
+
+static void output_release(struct output_engine *out, struct output_batch *batch)
+{
+    out->held -= batch->lease.count;
+    out->overrun += shmlogclient_lease_release(out->client, &batch->lease);
+    batch->niov = 0;
+}
+
+// release batches which have been consumed by the reader of pipe.
+// wait_us: 0 - don't wait, -1 - wait until a batch is released or exit is requested
+static int output_reap(struct output_engine *out, int wait_us)
+{
+    struct output_batch *batch;
+    int inpipe, total_wait = 0;
+    while ( out->count > 0 ) {
+        if ( ioctl(out->fd, FIONREAD, &inpipe) < 0 ) {
+            fprintf(stderr, "Error: ioctl(FIONREAD) on stdout! %d:%s\n", errno, strerror(errno));
+            return -1;
+        }
+        batch = &out->batches[out->first];
+        if ( (out->spliced - inpipe) < batch->end ) {
+            if ( 0 == wait_us || (wait_us < 0 && g_requestExit) || (wait_us > 0 && total_wait >= wait_us) ) {
+                break;
+            }
+            usleep(100);
+            total_wait += 100;
+            continue;
+        }
+        output_release(out, batch);
+        out->first = (out->first + 1) % OUTPUT_PENDING_MAX;
+        out->count--;
+    }
+    return 0;
+}
+
+// make room for the next batch
+static int output_prepare(struct output_engine *out)
+{
+    if ( OUTPUT_SPLICE != out->mode || 0 == out->count ) {
+        return 0;
+    }
+    while ( out->count > 0 && (out->count >= (OUTPUT_PENDING_MAX-1) || (out->held + out->batch_max) > out->held_max) ) {
+        if ( output_reap(out, -1) < 0 ) {
+            return -1;
+        }
+        if ( g_requestExit ) {
+            break;
+        }
+    }
+    return output_reap(out, 0);
+}
+
+static int output_writev(struct output_engine *out, struct output_batch *batch)
+{
+    struct iovec *iov = batch->iov;
+    int niov = batch->niov;
+    ssize_t ret;
+    while ( niov > 0 ) {
+        if ( OUTPUT_SPLICE == out->mode ) {
+            ret = vmsplice(out->fd, iov, niov, 0);
+        } else {
+            ret = writev(out->fd, iov, niov);
+        }
+        if ( ret < 0 ) {
+            if ( EINTR == errno && !g_requestExit ) {
+                continue;
+            }
+            fprintf(stderr, "Error: write to stdout! %d:%s\n", errno, strerror(errno));
+            return -1;
+        }
+        out->spliced += ret;
+        // skip the written part
+        while ( niov > 0 && (size_t)ret >= iov->iov_len ) {
+            ret -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if ( ret > 0 ) {
+            iov->iov_base = (uint8_t*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void output_trace(struct output_engine *out, const struct shmlog_msg *msg)
+{
+    struct shmlog_trace_rec trace, *rec = &trace;
+    size_t name_len;
+    if ( msg->hdr.len < offsetof(struct shmlog_trace_rec, name) ) {
+        return;
+    }
+    memcpy(&trace, msg->body, msg->hdr.len); // the body is not aligned for the record
+    name_len = msg->hdr.len - offsetof(struct shmlog_trace_rec, name);
+    if ( name_len > rec->name_len ) {
+        name_len = rec->name_len;
+    }
+    fprintf(out->trace, "%s{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03u,\"name\":\"",
+            (out->ntrace > 0) ? ",\n" : "", rec->phase, out->client->pid, rec->tid,
+            rec->ts / 1000, (unsigned)(rec->ts % 1000));
+    for ( size_t i = 0; i < name_len; i++ ) {
+        const unsigned char c = rec->name[i];
+        if ( '"' == c || '\\' == c ) {
+            fprintf(out->trace, "\\%c", c);
+        } else if ( c < 0x20 ) {
+            fprintf(out->trace, "\\u%04x", c);
+        } else {
+            fputc(c, out->trace);
+        }
+    }
+    fputc('"', out->trace);
+    if ( SHMLOG_TRACE_COMPLETE == rec->phase ) {
+        fprintf(out->trace, ",\"dur\":%" PRId64 ".%03u", rec->value / 1000, (unsigned)(rec->value % 1000));
+    } else if ( SHMLOG_TRACE_COUNTER == rec->phase ) {
+        fprintf(out->trace, ",\"args\":{\"value\":%" PRId64 "}", rec->value);
+    }
+    fputc('}', out->trace);
+    out->ntrace++;
+}
+
+// output the current batch
+static int output_write(struct output_engine *out)
+{
+    struct output_batch *batch = output_current(out);
+    struct shmlog_lease_t *lease = &batch->lease;
+    struct shmlog_msg *msg;
+    uint64_t seq = 0; // of the ring, so archives of a restarted consumer go on with the same numbers
+    int ret = 0;
+    shmlogclient_lease_seq(out->client, lease, &seq); // messages are numbered only if acquired
+    out->held += lease->count;
+    batch->niov = 0;
+    for ( int i = 0; i < lease->count; i++ ) {
+        msg = shmlogclient_lease_msg(out->client, lease, i);
+        if ( NULL == msg || !shmlogclient_lease_valid(out->client, lease, i) ) {
+            continue;
+        }
+        if ( SHMLOG_MSG_TRACE == msg->hdr.type ) {
+            if ( NULL != out->trace ) {
+                output_trace(out, msg);
+            }
+            continue;
+        }
+        if ( NULL != out->metrics ) {
+            shmlogmetrics_feed(out->metrics, msg->body, msg->hdr.len);
+        }
+        if ( NULL != out->match && NULL == memmem(msg->body, msg->hdr.len, out->match, out->match_len) ) {
+            continue;
+        }
+        if ( OUTPUT_ARCHIVE == out->mode ) {
+            if ( shmlogarchive_write(out->arc, seq + i, msg->body, msg->hdr.len) < 0 ) {
+                fprintf(stderr, "Error: write archive! %d:%s\n", errno, strerror(errno));
+                ret = -1;
+                break;
+            }
+        } else if ( OUTPUT_LINE == out->mode ) {
+            fwrite(msg->body, 1, msg->hdr.len, stdout);
+            fwrite(g_newline, 1, 1, stdout);
+        } else {
+            if ( msg->hdr.len > 0 ) {
+                batch->iov[batch->niov].iov_base = msg->body;
+                batch->iov[batch->niov].iov_len = msg->hdr.len;
+                batch->niov++;
+            }
+            batch->iov[batch->niov].iov_base = (void*)g_newline;
+            batch->iov[batch->niov].iov_len = 1;
+            batch->niov++;
+        }
+    }
+    if ( 0 == ret && batch->niov > 0 ) {
+        ret = output_writev(out, batch);
+    }
+    // the batch is in the kernel (or in the pipe, splice mode), so it needn't be replayed after a restart
+    if ( 0 == ret && NULL != out->ckpt && !out->failed ) {
+        shmlogclient_checkpoint_update(out->client, out->ckpt, lease);
+        ret = output_batch_checkpoint(out);
+    }
+    output_metrics(out, 0);
+    if ( 0 == ret && OUTPUT_SPLICE == out->mode ) {
+        batch->end = out->spliced;
+        out->count++;
+        return 0;
+    }
+    if ( ret < 0 ) {
+        out->failed = 1;
+    }
+    output_release(out, batch);
+    return ret;
+}
+
+static int output_flush(struct output_engine *out)
+{
+    output_metrics(out, 0);
+    if ( NULL != out->trace ) {
+        fflush(out->trace);
+    }
+    if ( OUTPUT_ARCHIVE == out->mode ) {
+        if ( shmlogarchive_flush(out->arc) < 0 ) {
+            out->failed = 1;
+            return -1;
+        }
+        if ( NULL != out->ckpt && !out->failed ) {
+            output_checkpoint(out);
+        }
+        return 0;
+    }
+    return fflush(stdout);
+}
+
+static void output_finish(struct output_engine *out)
+{
+    if ( OUTPUT_SPLICE == out->mode ) {
+        output_reap(out, 1000*1000);
+    }
+    // release all leases whatever happens
+    while ( out->count > 0 ) {
+        output_release(out, &out->batches[out->first]);
+        out->first = (out->first + 1) % OUTPUT_PENDING_MAX;
+        out->count--;
+    }
+    if ( NULL != out->trace ) {
+        fputs("\n]}\n", out->trace);
+    }
+    output_metrics(out, 1);
+    output_flush(out);
+}
+
+/*
+ * Pipelined output (--pipeline): a drain thread only copies leased messages
+ * into batches and releases the leases at once, so the ring is drained at
+ * the rate of memcpy whatever the speed of the sink. Batches flow through
+ * lock-free single-producer single-consumer queues:
+ *   drain --> render worker (k % n) --> sink (main thread) --> free --> drain
+ * Render workers filter (--match) and format the k-th batch into text, the
+ * sink takes batches from the workers in the order of k, so the output keeps
+ * the order of the ring. The drain thread stalls only if the sink holds all
+ * batches, then it drops leases of the main lane in an emergency (--drop).
+ */
+#define PIPELINE_WORKER_MAX 16
+#define PIPELINE_DEPTH_DEFAULT 8
+
+struct spsc_queue {
+    atomic_uint head; // next to pop, written by the consumer
+    atomic_uint tail; // next to push, written by the producer
+    uint32_t mask;
+    void **items;
+    // stats: the depth seen by every push, and waits of both ends
+    uint32_t depth_max;
+    uint64_t depth_sum, npush;
+    uint64_t nwait_full, nwait_empty;
+};
+
+struct pipe_batch {
+    uint64_t k;
+    int count;
+    uint64_t seq;         // sequence number of the first message in its lane (archive), see shmlogclient_lease_seq
+    struct shmlog_checkpoint_t ckpt; // checkpoint after this batch, the ring may have been followed after a resize
+    uint8_t *keep;        // 0: invalid, 1: filtered out, 2: to output
+    struct shmlog_msg *msgs;
+    char *text;           // rendered messages of text mode
+    size_t text_len;
+};
+
+struct pipe_worker {
+    struct pipeline *pl;
+    thrd_t thread;
+    struct spsc_queue in, out;
+};
+
+struct pipeline {
+    struct output_engine *out;
+    int drop_in_emergency;
+    int nworker;
+    struct pipe_worker workers[PIPELINE_WORKER_MAX];
+    thrd_t drain;
+    struct spsc_queue free;
+    int nbatch;
+    struct pipe_batch *batches;
+    struct shmlog_checkpoint_t ckpt; // the drain's copy, out->ckpt belongs to the sink
+    // counted by the drain thread
+    int64_t total_read, total_lost, total_lost_cnt, total_drop, overrun;
+    uint64_t stalls;
+};
+
+static int spsc_init(struct spsc_queue *q, uint32_t size)
+{
+    uint32_t cap = 1;
+    while ( cap < size ) {
+        cap <<= 1;
+    }
+    memset(q, 0, sizeof(struct spsc_queue));
+    q->items = calloc(cap, sizeof(void*));
+    if ( NULL == q->items ) {
+        return -1;
+    }
+    q->mask = cap - 1;
+    return 0;
+}
+
+static void spsc_wait(int *spins)
+{
+    if ( ++*spins < 64 ) {
+        thrd_yield();
+    } else {
+        usleep(50);
+    }
+}
+
+// wait while the queue is full, the consumer always drains it
+static void spsc_push(struct spsc_queue *q, void *item)
+{
+    const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t depth;
+    int spins = 0;
+    while ( tail - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask ) {
+        if ( 0 == spins ) {
+            q->nwait_full++;
+        }
+        spsc_wait(&spins);
+    }
+    q->items[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    depth = tail + 1 - atomic_load_explicit(&q->head, memory_order_relaxed);
+    if ( depth > q->depth_max ) {
+        q->depth_max = depth;
+    }
+    q->depth_sum += depth;
+    q->npush++;
+}
+
+// timeout_us: 0 - don't wait, -1 - wait forever. return -1 on timeout
+static int spsc_pop(struct spsc_queue *q, void **item, int timeout_us)
+{
+    const uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct timespec start, now;
+    int spins = 0;
+    while ( atomic_load_explicit(&q->tail, memory_order_acquire) == head ) {
+        if ( 0 == timeout_us ) {
+            return -1;
+        }
+        if ( 0 == spins ) {
+            q->nwait_empty++;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        } else if ( timeout_us > 0 ) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ( (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 >= timeout_us ) {
+                return -1;
+            }
+        }
+        spsc_wait(&spins);
+    }
+    *item = q->items[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
+
+static void spsc_report(const struct spsc_queue *q, const char *name)
+{
+    fprintf(stderr, "  %-18s depth mean %.1f max %u of %u, producer waited %" PRIu64 " times, consumer waited %" PRIu64 " times\n",
+            name, (q->npush > 0) ? (double)q->depth_sum / q->npush : 0.0, q->depth_max, q->mask + 1,
+            q->nwait_full, q->nwait_empty);
+}
+
+static int pipeline_drain(void *arg)
+{
+    struct pipeline *pl = arg;
+    struct shm_log_client_t *client = pl->out->client;
+    struct shmlog_lease_t lease;
+    struct pipe_batch *batch;
+    struct shmlog_msg *msg;
+    uint64_t k = 0;
+    size_t len;
+    int ret;
+    while ( !g_requestExit ) {
+        ret = shmlogclient_lease_acquire(client, &lease, pl->out->batch_max, 1000*500);
+        if ( ret < 0 ) {
+            if ( ETIMEDOUT != errno ) {
+                fprintf(stderr, "Error: read message! %d:%s\n", errno, strerror(errno));
+                g_requestExit = 1;
+            }
+            continue;
+        }
+        pl->total_read += ret;
+        pl->total_lost += lease.lost;
+        if ( lease.lost > 0 ) {
+            pl->total_lost_cnt++;
+        }
+        if ( spsc_pop(&pl->free, (void**)&batch, 0) < 0 ) {
+            // the sink holds all batches
+            if ( pl->drop_in_emergency && SHMLOG_LANE_MAIN == lease.lane && (client->remain * 3) > (client->hdr->nmsg * 2) ) {
+                if ( NULL != pl->out->ckpt ) { // dropped on purpose, don't replay them
+                    shmlogclient_checkpoint_update(client, &pl->ckpt, &lease);
+                }
+                shmlogclient_lease_release(client, &lease);
+                pl->total_drop += ret;
+                continue;
+            }
+            pl->stalls++;
+            spsc_pop(&pl->free, (void**)&batch, -1);
+        }
+        batch->k = k;
+        batch->count = ret;
+        batch->seq = 0;
+        shmlogclient_lease_seq(client, &lease, &batch->seq);
+        for ( int i = 0; i < ret; i++ ) {
+            msg = shmlogclient_lease_msg(client, &lease, i);
+            batch->keep[i] = 0;
+            if ( NULL == msg ) {
+                continue;
+            }
+            len = msg->hdr.len;
+            if ( len > SHMLOG_MSG_BODY_SIZE ) {
+                len = SHMLOG_MSG_BODY_SIZE;
+            }
+            memcpy(&batch->msgs[i], msg, offsetof(struct shmlog_msg, body) + len);
+            batch->msgs[i].hdr.len = len;
+            // the copy is good if the slot hasn't been overwritten meanwhile
+            batch->keep[i] = shmlogclient_lease_valid(client, &lease, i) ? 2 : 0;
+        }
+        if ( NULL != pl->out->ckpt ) {
+            shmlogclient_checkpoint_update(client, &pl->ckpt, &lease);
+            batch->ckpt = pl->ckpt;
+        }
+        pl->overrun += shmlogclient_lease_release(client, &lease);
+        spsc_push(&pl->workers[k % pl->nworker].in, batch);
+        k++;
+    }
+    for ( int i = 0; i < pl->nworker; i++ ) {
+        spsc_push(&pl->workers[i].in, NULL);
+    }
+    return 0;
+}
+
+static int pipeline_render(void *arg)
+{
+    struct pipe_worker *w = arg;
+    const struct output_engine *out = w->pl->out;
+    struct pipe_batch *batch;
+    struct shmlog_msg *msg;
+    for ( ;; ) {
+        spsc_pop(&w->in, (void**)&batch, -1);
+        if ( NULL == batch ) {
+            break;
+        }
+        batch->text_len = 0;
+        for ( int i = 0; i < batch->count; i++ ) {
+            msg = &batch->msgs[i];
+            if ( !batch->keep[i] || SHMLOG_MSG_TRACE == msg->hdr.type ) {
+                continue;
+            }
+            if ( NULL != out->match && NULL == memmem(msg->body, msg->hdr.len, out->match, out->match_len) ) {
+                batch->keep[i] = 1;
+                continue;
+            }
+            if ( OUTPUT_ARCHIVE != out->mode ) {
+                memcpy(batch->text + batch->text_len, msg->body, msg->hdr.len);
+                batch->text_len += msg->hdr.len;
+                batch->text[batch->text_len++] = '\n';
+            }
+        }
+        spsc_push(&w->out, batch);
+    }
+    spsc_push(&w->out, NULL);
+    return 0;
+}
+
+// sink: write a rendered batch
+static int pipeline_write(struct pipeline *pl, struct pipe_batch *batch)
+{
+    struct output_engine *out = pl->out;
+    struct shmlog_msg *msg;
+    size_t off = 0;
+    ssize_t ret;
+    for ( int i = 0; i < batch->count; i++ ) {
+        msg = &batch->msgs[i];
+        if ( !batch->keep[i] ) {
+            continue;
+        }
+        if ( NULL != out->metrics && SHMLOG_MSG_TRACE != msg->hdr.type ) {
+            shmlogmetrics_feed(out->metrics, msg->body, msg->hdr.len);
+        }
+        if ( batch->keep[i] < 2 ) {
+            continue;
+        }
+        if ( SHMLOG_MSG_TRACE == msg->hdr.type ) {
+            if ( NULL != out->trace ) {
+                output_trace(out, msg);
+            }
+        } else if ( OUTPUT_ARCHIVE == out->mode ) {
+            if ( shmlogarchive_write(out->arc, batch->seq + i, msg->body, msg->hdr.len) < 0 ) {
+                fprintf(stderr, "Error: write archive! %d:%s\n", errno, strerror(errno));
+                return -1;
+            }
+        }
+    }
+    if ( OUTPUT_LINE == out->mode ) {
+        fwrite(batch->text, 1, batch->text_len, stdout);
+    } else if ( OUTPUT_ARCHIVE != out->mode ) {
+        while ( off < batch->text_len ) {
+            ret = write(out->fd, batch->text + off, batch->text_len - off);
+            if ( ret < 0 ) {
+                if ( EINTR == errno && !g_requestExit ) {
+                    continue;
+                }
+                fprintf(stderr, "Error: write to stdout! %d:%s\n", errno, strerror(errno));
+                return -1;
+            }
+            off += ret;
+        }
+    }
+    if ( NULL != out->ckpt ) {
+        *out->ckpt = batch->ckpt;
+        if ( output_batch_checkpoint(out) < 0 ) {
+            return -1;
+        }
+    }
+    output_metrics(out, 0);
+    return 0;
+}
+
+static void pipeline_free(struct pipeline *pl)
+{
+    for ( int i = 0; i < pl->nworker; i++ ) {
+        free(pl->workers[i].in.items);
+        free(pl->workers[i].out.items);
+    }
+    free(pl->free.items);
+    if ( NULL != pl->batches ) {
+        for ( int i = 0; i < pl->nbatch; i++ ) {
+            free(pl->batches[i].keep);
+            free(pl->batches[i].msgs);
+            free(pl->batches[i].text);
+        }
+        free(pl->batches);
+    }
+}
+
+static int pipeline_init(struct pipeline *pl, struct output_engine *out, int nworker, int depth, int drop_in_emergency)
+{
+    struct pipe_batch *batch;
+    memset(pl, 0, sizeof(struct pipeline));
+    pl->out = out;
+    pl->drop_in_emergency = drop_in_emergency;
+    pl->nworker = nworker;
+    if ( NULL != out->ckpt ) {
+        pl->ckpt = *out->ckpt;
+    }
+    // enough batches to fill every queue, and one in hand of each stage
+    pl->nbatch = 2 * depth * nworker + nworker + 2;
+    pl->batches = calloc(pl->nbatch, sizeof(struct pipe_batch));
+    if ( NULL == pl->batches || spsc_init(&pl->free, pl->nbatch) < 0 ) {
+        goto fail;
+    }
+    for ( int i = 0; i < nworker; i++ ) {
+        pl->workers[i].pl = pl;
+        if ( spsc_init(&pl->workers[i].in, depth) < 0 || spsc_init(&pl->workers[i].out, depth) < 0 ) {
+            goto fail;
+        }
+    }
+    for ( int i = 0; i < pl->nbatch; i++ ) {
+        batch = &pl->batches[i];
+        batch->keep = malloc(out->batch_max);
+        batch->msgs = malloc(out->batch_max * sizeof(struct shmlog_msg));
+        batch->text = malloc(out->batch_max * (SHMLOG_MSG_BODY_SIZE + 1));
+        if ( NULL == batch->keep || NULL == batch->msgs || NULL == batch->text ) {
+            goto fail;
+        }
+        spsc_push(&pl->free, batch);
+    }
+    pl->free.depth_max = 0;
+    pl->free.depth_sum = 0;
+    pl->free.npush = 0;
+    return 0;
+fail:
+    pipeline_free(pl);
+    errno = ENOMEM;
+    return -1;
+}
+
+// run the pipeline until exit is requested, the calling thread is the sink
+static int pipeline_run(struct pipeline *pl)
+{
+    struct pipe_batch *batch;
+    char name[32];
+    uint64_t k = 0;
+    int nworker = 0, ret = 0;
+    for ( ; nworker < pl->nworker; nworker++ ) {
+        if ( thrd_create(&pl->workers[nworker].thread, pipeline_render, &pl->workers[nworker]) != thrd_success ) {
+            break;
+        }
+    }
+    if ( nworker < pl->nworker || thrd_create(&pl->drain, pipeline_drain, pl) != thrd_success ) {
+        fprintf(stderr, "Error: create pipeline threads failed!\n");
+        g_requestExit = 1;
+        // let the started workers exit
+        for ( int i = 0; i < nworker; i++ ) {
+            spsc_push(&pl->workers[i].in, NULL);
+            thrd_join(pl->workers[i].thread, NULL);
+        }
+        return -1;
+    }
+    for ( ;; ) {
+        if ( spsc_pop(&pl->workers[k % pl->nworker].out, (void**)&batch, 1000*500) < 0 ) {
+            output_flush(pl->out); // make output visible while idle
+            continue;
+        }
+        if ( NULL == batch ) { // the drain has stopped
+            break;
+        }
+        // after an error, keep recycling batches until the pipeline is empty
+        if ( 0 == ret && pipeline_write(pl, batch) < 0 ) {
+            pl->out->failed = 1;
+            g_requestExit = 1;
+            ret = -1;
+        }
+        spsc_push(&pl->free, batch);
+        k++;
+    }
+    thrd_join(pl->drain, NULL);
+    for ( int i = 0; i < pl->nworker; i++ ) {
+        thrd_join(pl->workers[i].thread, NULL);
+    }
+    fprintf(stderr, "pipeline: %d render workers, %d batches of %d messages, the drain stalled %" PRIu64 " times\n",
+            pl->nworker, pl->nbatch, pl->out->batch_max, pl->stalls);
+    for ( int i = 0; i < pl->nworker; i++ ) {
+        snprintf(name, sizeof(name), "drain->render%d", i);
+        spsc_report(&pl->workers[i].in, name);
+        snprintf(name, sizeof(name), "render%d->sink", i);
+        spsc_report(&pl->workers[i].out, name);
+    }
+    spsc_report(&pl->free, "sink->drain (free)");
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *usage = "Usage: dtracetail [options]... [pid]\n" \
+            "output the last party of dtrace ring buffer.\n\n"          \
+            "options:\n"                                                \
+            "  -h,--help\n"                                             \
+            "  -p,--pid <number>\n"                                     \
+            "  -b,--block         Start in blocking mode.\n"            \
+            "                     Note: log messages are not lost, but write performance may be reduced!\n" \
+            "  -d,--drop          Drop some messages to speed up processing When the buffer will be full.\n" \
+            "  -l,--list          List the PID of all the processes that open shmlog and exit.\n" \
+            "                     Columns: pid, parent pid, size, user, seconds since the latest activity, command line.\n" \
+            "                     Rings of forked processes are listed under their parent.\n" \
+            "  -i,--info          Displays shmlog information for the specified PID process and exits.\n" \
+            "  -s,--stats <pid>   Displays statistics of the ring buffer, e.g. slots abandoned by dead producers or consumers, and exits.\n" \
+            "  -L,--line-buffered Write and flush every message at once (default if stdout is a terminal).\n" \
+            "  -S,--splice        Move messages into stdout by vmsplice if it is a pipe, otherwise by writev.\n" \
+            "  -a,--archive <dir> Write messages to time-indexed segment files in <dir> instead of stdout.\n" \
+            "  --archive-size <MB>  Rotate archive segment when it exceeds this size (default 64).\n" \
+            "  -q,--query <dir>   Output archived messages in [--from, --to] of pid (or all processes) and exit.\n" \
+            "  --from <time>      Start of query, \"HH:MM:SS[.frac]\", \"YYYY-mm-dd HH:MM:SS[.frac]\" or \"@<epoch>[.frac]\".\n" \
+            "  --to <time>        End of query (inclusive).\n" \
+            "  -j,--jobs <number> Search archive segments in parallel.\n" \
+            "  --trace-out <file> Write trace records (shmlog_trace_*) as Chrome trace events in JSON,\n" \
+            "                     open it by chrome://tracing or ui.perfetto.dev.\n" \
+            "  --limit <rate>[/<burst>]  Set messages per second of every call site of pid and exit, 0: the site's own.\n" \
+            "  --sample <n>       Set 1-in-N sampling of every call site of pid and exit, 0: the site's own.\n" \
+            "                     Both apply to SHMLOG_PRINTF_LIMITED call sites only.\n" \
+            "  -t,--top           Show messages/s, bytes/s, fill level, overwrites/s, suppressed/s, reads/s and\n" \
+            "                     the consumer of every ring, refreshing at an interval, without consuming.\n" \
+            "  --interval <ms>    Refresh interval of --top (default 1000).\n" \
+            "  --sort <key>       Sort --top by msgs (default), bytes, fill, overwrite or pid.\n" \
+            "  --count <n>        Exit --top after n refreshes.\n" \
+            "  --file <path>      Read the persistent ring in file <path> (see shmlog_attr.path) instead of pid.\n" \
+            "  --dump <path>      Print the messages left in a persistent ring file and exit, without consuming them.\n" \
+            "  --checkpoint <file>  Save the position of output in <file> after every batch, and at start resume\n" \
+            "                     from it: messages taken but not output before a restart are output if they\n" \
+            "                     are still in the ring, otherwise they are counted as lost.\n" \
+            "  -P,--pipeline[=<n>]  Drain the ring by a dedicated thread into queues, and render messages by n\n" \
+            "                     worker threads (default 1) in parallel with the output, which keeps the order.\n" \
+            "                     A slow output doesn't slow down draining until all queues are full, then\n" \
+            "                     --drop drops messages. The depth of every queue is reported at exit.\n" \
+            "  --queue-depth <n>  Batches of every queue of --pipeline (default 8).\n" \
+            "  --match <string>   Output only the messages containing <string>.\n" \
+            "  --metrics <rules>  Extract counters, gauges and histograms from messages by the rules in file <rules>,\n" \
+            "                     see shmlogmetrics.h, and write them in Prometheus text format to --metrics-out.\n" \
+            "  --metrics-out <file>  Snapshot file of --metrics, replaced at every interval (default shmlog-<pid>.prom).\n" \
+            "  --metrics-interval <ms>  Interval of --metrics snapshots (default 10000).\n" \
+            "  --dedup <ms>       Count repeats of the same message per thread of pid instead of writing them,\n" \
+            "                     and write one record for a run of at most <ms>, then exit. 0: disable.\n" \
+            "  --resize <nmsg>    Resize the ring of pid to <nmsg> messages online, then exit. Readers drain\n" \
+            "                     the old ring and follow the new one. Persistent rings can't be resized.\n" \
+            "";
+    static struct option opts[] = {
+        {"help", 0, NULL, 'h'},
+        {"pid", 1, NULL, 'p'},
+        {"block", 0, NULL, 'b'},
+        {"drop", 0, NULL, 'd'},
+        {"list", 0, NULL, 'l'},
+        {"info", 0, NULL, 'i'},
+        {"stats", 1, NULL, 's'},
+        {"line-buffered", 0, NULL, 'L'},
+        {"splice", 0, NULL, 'S'},
+        {"archive", 1, NULL, 'a'},
+        {"archive-size", 1, NULL, 'A'},
+        {"query", 1, NULL, 'q'},
+        {"from", 1, NULL, 'F'},
+        {"to", 1, NULL, 'T'},
+        {"jobs", 1, NULL, 'j'},
+        {"trace-out", 1, NULL, 'O'},
+        {"limit", 1, NULL, 'R'},
+        {"sample", 1, NULL, 'N'},
+        {"dedup", 1, NULL, 'D'},
+        {"resize", 1, NULL, 'Z'},
+        {"top", 0, NULL, 't'},
+        {"file", 1, NULL, 'f'},
+        {"dump", 1, NULL, 'U'},
+        {"checkpoint", 1, NULL, 'k'},
+        {"interval", 1, NULL, 'I'},
+        {"sort", 1, NULL, 'K'},
+        {"count", 1, NULL, 'C'},
+        {"pipeline", 2, NULL, 'P'},
+        {"queue-depth", 1, NULL, 'Q'},
+        {"match", 1, NULL, 'M'},
+        {"metrics", 1, NULL, 'm'},
+        {"metrics-out", 1, NULL, 'o'},
+        {"metrics-interval", 1, NULL, 'W'},
+        {NULL, 0, NULL, 0}
+    };
+    pid_t pid = -1;
+    int block = 0, drop_in_emergency = 0;
+    int o, ret;
+    struct shm_log_client_t client;
+    struct output_engine out;
+    enum output_mode out_mode = isatty(STDOUT_FILENO) ? OUTPUT_LINE : OUTPUT_WRITEV;
+    struct shmlog_archive_t arc;
+    const char *arc_dir = NULL, *query_dir = NULL, *trace_file = NULL;
+    FILE *trace = NULL;
+    int arc_size_mb = 0, jobs = 1;
+    uint64_t from = 0, to = UINT64_MAX;
+    int64_t site_rate = -1, site_burst = 0, site_sample = -1, dedup_ms = -1, resize_nmsg = -1;
+    int top_mode = 0, top_interval_ms = 1000, top_count = 0;
+    const char *ring_file = NULL, *ckpt_file = NULL;
+    struct shmlog_checkpoint_t ckpt;
+    uint64_t gap;
+    struct shmlog_lease_t *lease;
+    int pipe_workers = 0, pipe_depth = PIPELINE_DEPTH_DEFAULT;
+    const char *match = NULL;
+    const char *metrics_rules = NULL, *metrics_out = NULL;
+    char metrics_path[64];
+    int metrics_interval_ms = 10000;
+    struct shmlog_metrics_t metrics;
+    struct pipeline pl;
+    int64_t total_read, total_lost, total_lost_cnt, total_drop;
+
+    // test
+    printf("shmlogtail: ");
+    for ( ret = 0; ret < argc; ret++ ) {
+        printf("%s ", argv[ret]);
+    }
+    printf("\n");
+    // test end
+    
+    // command line parse
+    opterr = 0;
+    while ( (o = getopt_long(argc, argv, ":hp:bdli:s:LSa:q:j:tP::", opts, NULL)) != EOF ) {
+        switch ( o ) {
+            case 'h':
+                puts(usage);
+                return 0;
+            case 'p':
+                if ( sscanf(optarg, "%d", &pid) != 1 || pid <= 0 ) {
+                    fprintf(stderr, "Error: invalid pid '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                block = 1;
+                break;
+            case 'd':
+                drop_in_emergency = 1;
+                break;
+            case 'L':
+                out_mode = OUTPUT_LINE;
+                break;
+            case 'S':
+                out_mode = OUTPUT_SPLICE;
+                break;
+            case 'a':
+                arc_dir = optarg;
+                break;
+            case 'A':
+                if ( sscanf(optarg, "%d", &arc_size_mb) != 1 || arc_size_mb <= 0 ) {
+                    fprintf(stderr, "Error: invalid archive size '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                query_dir = optarg;
+                break;
+            case 'F':
+            case 'T':
+                if ( shmlogarchive_parse_time(optarg, ('F' == o) ? &from : &to) < 0 ) {
+                    fprintf(stderr, "Error: invalid time '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                if ( sscanf(optarg, "%d", &jobs) != 1 || jobs <= 0 ) {
+                    fprintf(stderr, "Error: invalid number of jobs '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                trace_file = optarg;
+                break;
+            case 'R':
+                site_burst = 0;
+                if ( sscanf(optarg, "%" SCNd64 "/%" SCNd64, &site_rate, &site_burst) < 1 ||
+                     site_rate < 0 || site_rate > UINT_MAX || site_burst < 0 || site_burst > UINT_MAX ) {
+                    fprintf(stderr, "Error: invalid rate limit '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                if ( sscanf(optarg, "%" SCNd64, &site_sample) != 1 || site_sample < 0 || site_sample > UINT_MAX ) {
+                    fprintf(stderr, "Error: invalid sampling '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                top_mode = 1;
+                break;
+            case 'f':
+                ring_file = optarg;
+                break;
+            case 'U':
+                return dump(optarg);
+            case 'k':
+                ckpt_file = optarg;
+                break;
+            case 'I':
+                if ( sscanf(optarg, "%d", &top_interval_ms) != 1 || top_interval_ms <= 0 ) {
+                    fprintf(stderr, "Error: invalid interval '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'K':
+                for ( ret = 0; NULL != g_top_sort_names[ret] && strcmp(g_top_sort_names[ret], optarg) != 0; ret++ );
+                if ( NULL == g_top_sort_names[ret] ) {
+                    fprintf(stderr, "Error: invalid sort key '%s'!\n", optarg);
+                    return 1;
+                }
+                g_top_sort = (enum top_sort)ret;
+                break;
+            case 'C':
+                if ( sscanf(optarg, "%d", &top_count) != 1 || top_count <= 0 ) {
+                    fprintf(stderr, "Error: invalid count '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                pipe_workers = 1;
+                if ( NULL != optarg && (sscanf(optarg, "%d", &pipe_workers) != 1 || pipe_workers <= 0 || pipe_workers > PIPELINE_WORKER_MAX) ) {
+                    fprintf(stderr, "Error: invalid number of pipeline workers '%s', 1 to %d!\n", optarg, PIPELINE_WORKER_MAX);
+                    return 1;
+                }
+                break;
+            case 'Q':
+                if ( sscanf(optarg, "%d", &pipe_depth) != 1 || pipe_depth <= 0 || pipe_depth > 4096 ) {
+                    fprintf(stderr, "Error: invalid queue depth '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'M':
+                match = optarg;
+                break;
+            case 'm':
+                metrics_rules = optarg;
+                break;
+            case 'o':
+                metrics_out = optarg;
+                break;
+            case 'W':
+                if ( sscanf(optarg, "%d", &metrics_interval_ms) != 1 || metrics_interval_ms <= 0 ) {
+                    fprintf(stderr, "Error: invalid metrics interval '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if ( sscanf(optarg, "%" SCNd64, &dedup_ms) != 1 || dedup_ms < 0 || dedup_ms > UINT_MAX ) {
+                    fprintf(stderr, "Error: invalid dedup window '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                if ( sscanf(optarg, "%" SCNd64, &resize_nmsg) != 1 || resize_nmsg <= 0 || resize_nmsg > INT_MAX ) {
+                    fprintf(stderr, "Error: invalid ring size '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                return list();
+            case 'i':
+                if ( sscanf(optarg, "%d", &pid) != 1 || pid <= 0 ) {
+                    fprintf(stderr, "Error: invalid pid '%s'!\n", optarg);
+                    return 1;
+                }
+                return info(pid);
+            case 's':
+                if ( sscanf(optarg, "%d", &pid) != 1 || pid <= 0 ) {
+                    fprintf(stderr, "Error: invalid pid '%s'!\n", optarg);
+                    return 1;
+                }
+                return stats(pid);
+            case ':':
+                fprintf(stderr, "Error: missing option argument for option '%s'!\n", argv[optind-1]);
+                return 1;
+            case '?':
+                fprintf(stderr, "Error: unknown options '%s'!\n", argv[optind-1]);
+                return 1;
+            default:
+                fprintf(stderr, "Warning: unknown options '%c'!\n", o);
+        }
+    }
+    if ( optind < argc ) {
+        pid_t pid2;
+        if ( sscanf(argv[optind], "%d", &pid2) != 1 || pid2 <= 0 ) {
+            fprintf(stderr, "Error: invalid pid '%s'!\n", argv[optind]);
+            return 1;
+        }
+        if ( pid > 0 ) {
+            fprintf(stderr, "Warning: Previous pid '%d' are overwritten!\n", pid);
+        }
+        pid = pid2;
+        if ( (optind+1) < argc ) {
+            fprintf(stderr, "Error: unknown argument '%s'!\n", argv[optind+1]);
+            return 1;
+        }
+    }
+    if ( top_mode ) {
+        signal(SIGINT, sig_handle);
+        return top(top_interval_ms, top_count);
+    }
+    if ( NULL != query_dir ) {
+        struct shmlog_archive_query_t query = {
+            .dir = query_dir, .pid = pid, .from = from, .to = to, .jobs = jobs, .out = stdout,
+        };
+        return (shmlogarchive_query(&query) < 0) ? 1 : 0;
+    }
+    if ( pid <= 0 && NULL == ring_file ) {
+        fprintf(stderr, "pid is not specify!\n");
+        return 1;
+    }
+    if ( site_rate >= 0 || site_sample >= 0 || dedup_ms >= 0 ) {
+        ret = 0;
+        if ( site_rate >= 0 || site_sample >= 0 ) {
+            ret |= set_site_limit(pid, site_rate, site_burst, site_sample);
+        }
+        if ( dedup_ms >= 0 ) {
+            ret |= set_dedup(pid, dedup_ms);
+        }
+        return ret;
+    }
+    if ( resize_nmsg > 0 ) {
+        return resize(pid, resize_nmsg);
+    }
+    if ( NULL != metrics_rules && shmlogmetrics_load(&metrics, metrics_rules) < 0 ) {
+        fprintf(stderr, "Error: load metrics rules '%s' failed! %d:%s\n", metrics_rules, errno, strerror(errno));
+        return 1;
+    }
+    // open shm
+    if ( NULL != ring_file ) {
+        ret = shmlogclient_init_file(ring_file, &client, !block);
+        pid = client.pid;
+    } else {
+        ret = shmlogclient_init(pid, &client, !block);
+    }
+    if ( ret < 0 ) {
+        fprintf(stderr, "Error: initialize failed! %d:%s\n", errno, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "pid = %d\n", pid);
+
+    if ( NULL != arc_dir ) {
+        if ( shmlogarchive_open(&arc, arc_dir, pid, (size_t)arc_size_mb * 1024 * 1024) < 0 ) {
+            fprintf(stderr, "Error: open archive '%s' failed! %d:%s\n", arc_dir, errno, strerror(errno));
+            shmlogclient_uninit(&client);
+            return 1;
+        }
+        out_mode = OUTPUT_ARCHIVE;
+    }
+    if ( NULL != trace_file ) {
+        trace = fopen(trace_file, "w");
+        if ( NULL == trace ) {
+            fprintf(stderr, "Error: open trace file '%s' failed! %d:%s\n", trace_file, errno, strerror(errno));
+            if ( NULL != arc_dir ) {
+                shmlogarchive_close(&arc);
+            }
+            shmlogclient_uninit(&client);
+            return 1;
+        }
+    }
+    if ( pipe_workers > 0 && OUTPUT_SPLICE == out_mode ) {
+        fprintf(stderr, "Warning: --pipeline copies messages out of the ring, use writev instead of vmsplice!\n");
+        out_mode = OUTPUT_WRITEV;
+    }
+    output_init(&out, out_mode, &client, &arc, trace);
+    if ( NULL != match ) {
+        out.match = match;
+        out.match_len = strlen(match);
+    }
+    if ( NULL != metrics_rules ) {
+        if ( NULL == metrics_out ) {
+            snprintf(metrics_path, sizeof(metrics_path), "shmlog-%d.prom", pid);
+            metrics_out = metrics_path;
+        }
+        out.metrics = &metrics;
+        out.metrics_out = metrics_out;
+        out.metrics_interval_ms = metrics_interval_ms;
+        output_metrics(&out, 1);
+    }
+
+    // install signal handle
+    signal(SIGINT, sig_handle);
+
+    // producers wait for leased slots in blocking mode, otherwise they overwrite them
+    if ( block ) {
+        shmlogclient_set_lease_hold(&client, SHMLOG_SLOT_TIMEOUT_US);
+    }
+
+    total_read = 0;
+    total_lost = 0;
+    total_lost_cnt = 0;
+    total_drop = 0;
+
+    // resume from the checkpoint
+    if ( NULL != ckpt_file ) {
+        out.ckpt_fd = open(ckpt_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if ( out.ckpt_fd < 0 ) {
+            fprintf(stderr, "Error: open checkpoint '%s' failed! %d:%s\n", ckpt_file, errno, strerror(errno));
+            g_requestExit = 1;
+        } else if ( pread(out.ckpt_fd, &ckpt, sizeof(ckpt), 0) != sizeof(ckpt) || shmlogclient_resume(&client, &ckpt, &gap) < 0 ) {
+            fprintf(stderr, "checkpoint '%s' is not of this ring, start at the head\n", ckpt_file);
+            shmlogclient_checkpoint_init(&client, &ckpt);
+            out.ckpt = &ckpt;
+            output_checkpoint(&out);
+        } else {
+            out.ckpt = &ckpt;
+            total_lost = gap;
+            while ( !g_requestExit && output_prepare(&out) >= 0 ) {
+                lease = output_lease(&out);
+                ret = shmlogclient_lease_resume(&client, lease, out.batch_max);
+                if ( ret <= 0 ) {
+                    break;
+                }
+                total_read += ret;
+                total_lost += lease->lost;
+                if ( output_write(&out) < 0 ) {
+                    g_requestExit = 1;
+                }
+            }
+            fprintf(stderr, "resume from checkpoint '%s': %" PRId64 " messages replayed, %" PRId64 " lost\n",
+                    ckpt_file, total_read - (total_lost - (int64_t)gap), total_lost);
+        }
+    }
+
+    // pipelined output, replayed messages have been output and released above
+    if ( pipe_workers > 0 && !g_requestExit ) {
+        if ( pipeline_init(&pl, &out, pipe_workers, pipe_depth, drop_in_emergency) < 0 ) {
+            fprintf(stderr, "Error: initialize pipeline failed! %d:%s\n", errno, strerror(errno));
+        } else {
+            pl.total_read = total_read;
+            pl.total_lost = total_lost;
+            pipeline_run(&pl);
+            total_read = pl.total_read;
+            total_lost = pl.total_lost;
+            total_lost_cnt = pl.total_lost_cnt;
+            total_drop = pl.total_drop;
+            out.overrun += pl.overrun;
+            pipeline_free(&pl);
+        }
+        g_requestExit = 1;
+    }
+
+    // core loop
+    while ( !g_requestExit ) {
+
+        if ( output_prepare(&out) < 0 ) {
+            break;
+        }
+        lease = output_lease(&out);
+        ret = shmlogclient_lease_acquire(&client, lease, out.batch_max, 1000*500);
+        if ( ret < 0 ) {
+            if ( ETIMEDOUT == errno ) {
+                output_flush(&out); // make output visible while idle
+                usleep(1000*10);
+            } else  {
+                fprintf(stderr, "Error: read message! %d:%s\n", errno, strerror(errno));
+                break;
+            }
+            continue;
+        }
+        // stat.
+        total_read += ret;
+        total_lost += lease->lost;
+        if ( lease->lost > 0 ) {
+            total_lost_cnt++;
+        }
+        // output message or drop message to speed up
+        if ( drop_in_emergency && SHMLOG_LANE_MAIN == lease->lane && (client.remain * 3) > (client.hdr->nmsg * 2) ) {
+            // drop some message to speed up processing, never the ones of the priority lane
+            int drop_cnt = ret;
+            struct shmlog_lease_t drop;
+            if ( NULL != out.ckpt ) { // dropped on purpose, don't replay them
+                shmlogclient_checkpoint_update(&client, out.ckpt, lease);
+            }
+            shmlogclient_lease_release(&client, lease);
+            while ( (client.remain * 3) >= (client.hdr->nmsg) ) {
+                ret = shmlogclient_lease_acquire_lane(&client, &drop, SHMLOG_LANE_MAIN, client.remain - client.hdr->nmsg / 3 + 1, 0);
+                if ( ret < 0 ) {
+                    if ( ETIMEDOUT != errno ) {
+                        fprintf(stderr, "Error: read message! %d:%s\n", errno, strerror(errno));
+                    }
+                    break;
+                }
+                if ( NULL != out.ckpt ) {
+                    shmlogclient_checkpoint_update(&client, out.ckpt, &drop);
+                }
+                shmlogclient_lease_release(&client, &drop);
+                drop_cnt += ret;
+                total_read += ret;
+                total_lost += drop.lost;
+                if ( drop.lost > 0 ) {
+                    total_lost_cnt++;
+                }
+            }
+            if ( ret < 0 && ETIMEDOUT != errno )
+                break;
+            fprintf(stderr, "Warning: drop %d messages!\n", drop_cnt);
+            total_drop += drop_cnt;
+        } else {
+            // output messages
+            if ( output_write(&out) < 0 ) {
+                break;
+            }
+        }
+    }
+
+    // finish
+    output_finish(&out);
+    if ( NULL != arc_dir ) {
+        shmlogarchive_close(&arc);
+    }
+    if ( NULL != trace ) {
+        fclose(trace);
+    }
+    if ( block ) {
+        shmlogclient_set_lease_hold(&client, 0);
+    }
+    if ( out.ckpt_fd >= 0 ) {
+        close(out.ckpt_fd);
+    }
+    if ( NULL != metrics_rules ) {
+        shmlogmetrics_free(&metrics);
+    }
     shmlogclient_uninit(&client);
-    fprintf(stderr, "total read %ld messages, total lost %ld messages in %ld times, total drop %ld messages\n", total_read, total_lost, total_lost_cnt, total_drop);
+    fprintf(stderr, "total read %ld messages, total lost %ld messages in %ld times, total drop %ld messages, total overrun %ld messages\n",
+            total_read, total_lost, total_lost_cnt, total_drop, out.overrun);
     return 0;
 }